@@ -48,6 +48,12 @@ VISCO_INLINE int aabbCollidePoint(const aabb *a, const vec3 *b) {
 		   (b->y >= a->min.y && b->y <= a->max.y) &&
 		   (b->z >= a->min.z && b->z <= a->max.z);
 }
+//Tests if b lies completely inside a
+VISCO_INLINE int aabbContainsAabb(const aabb *a, const aabb *b) {
+	return (b->min.x >= a->min.x && b->max.x <= a->max.x) &&
+		   (b->min.y >= a->min.y && b->max.y <= a->max.y) &&
+		   (b->min.z >= a->min.z && b->max.z <= a->max.z);
+}
 VISCO_INLINE int aabbCollideAabb(const aabb *a, const aabb *b) {
 	return (a->min.x <= b->max.x && a->max.x >= b->min.x) &&
 		   (a->min.y <= b->max.y && a->max.y >= b->min.y) &&
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdlib.h>
+#include <string.h>
+#include "visco_def.h"
+
+//Memory callbacks for worlds and shapes. A NULL allocator, or one without allocate, uses malloc.
+//reallocate gets the old size so allocators that do not track sizes can copy. Without reallocate a new
+//block is allocated, the contents copied and the old block released.
+typedef struct viscoAllocator {
+	void* (*allocate)(size_t size, void *user);
+	void* (*reallocate)(void *ptr, size_t oldSize, size_t newSize, void *user);
+	void  (*release)(void *ptr, void *user);
+	void *user;
+} viscoAllocator;
+
+//Linear allocator over caller owned memory. Releasing or growing the latest allocation happens in place,
+//anything else is only reclaimed by viscoArenaReset which frees everything at once.
+typedef struct viscoArena {
+	unsigned char *memory;
+	size_t size;
+	size_t used;
+	size_t last; //offset of the latest allocation
+} viscoArena;
+
+VISCO_API void viscoArenaInit(viscoArena *arena, void *memory, size_t size);
+VISCO_API void viscoArenaReset(viscoArena *arena);
+VISCO_API viscoAllocator viscoArenaAllocator(viscoArena *arena);
+
+//Fixed size blocks over caller owned memory, requests larger than a block fail.
+//Sized for one kind of shape, e.g. blockSize = shapeGetSize(SHAPE_BOX).
+typedef struct viscoPool {
+	unsigned char *memory;
+	size_t block;
+	size_t count;
+	size_t used;  //blocks handed out at least once since the last reset
+	void *free;   //list of released blocks
+} viscoPool;
+
+VISCO_API void viscoPoolInit(viscoPool *pool, void *memory, size_t size, size_t blockSize);
+VISCO_API void viscoPoolReset(viscoPool *pool);
+VISCO_API viscoAllocator viscoPoolAllocator(viscoPool *pool);
+
+VISCO_INLINE void* viscoAlloc(const viscoAllocator *a, size_t size) {
+	if (!a || !a->allocate) {
+		return malloc(size);
+	}
+	return a->allocate(size, a->user);
+}
+VISCO_INLINE void* viscoRealloc(const viscoAllocator *a, void *ptr, size_t oldSize, size_t newSize) {
+	if (!a || !a->allocate) {
+		return realloc(ptr, newSize);
+	}
+	if (a->reallocate) {
+		return a->reallocate(ptr, oldSize, newSize, a->user);
+	}
+	void *ret = a->allocate(newSize, a->user);
+	if (ret && ptr) {
+		memcpy(ret, ptr, oldSize < newSize ? oldSize : newSize);
+		if (a->release) {
+			a->release(ptr, a->user);
+		}
+	}
+	return ret;
+}
+VISCO_INLINE void viscoFree(const viscoAllocator *a, void *ptr) {
+	if (!a || !a->allocate) {
+		free(ptr);
+	}
+	else if (ptr && a->release) {
+		a->release(ptr, a->user);
+	}
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "visco_def.h"
+#include "world.h"
+
+//Kinematic character controllers, capsules or spheres moved by collide and slide against the bodies of a world.
+//Characters push nothing and do not collide with each other, up is +y.
+typedef struct characterBatch characterBatch;
+typedef size_t characterID;
+
+VISCO_API characterBatch* characterBatchCreate(void);
+VISCO_API void            characterBatchDestroy(characterBatch *batch);
+
+//A height of 0 makes a sphere, otherwise height is the distance between the centers of the caps.
+//The position is the center of the proxy.
+VISCO_API characterID characterCreate(characterBatch *batch, scalar radius, scalar height, const vec3 *position);
+VISCO_API void        characterDestroy(characterBatch *batch, characterID character);
+
+//Defaults to a quarter of the proxy height including its caps.
+VISCO_API void characterSetStepHeight(characterBatch *batch, characterID character, scalar height);
+//Ground steeper than angle, in radians from up, is treated as a wall. Defaults to 45 degrees.
+VISCO_API void characterSetMaxSlope(characterBatch *batch, characterID character, scalar angle);
+
+VISCO_API void characterGetPosition(vec3 *dest, characterBatch *batch, characterID character);
+//Teleports without collision.
+VISCO_API void characterSetPosition(characterBatch *batch, characterID character, const vec3 *position);
+
+//Displacement to apply on the next update, gravity included. Replaces the previous one.
+VISCO_API void characterMove(characterBatch *batch, characterID character, const vec3 *displacement);
+
+//Ground from the last update, the normal is up when not grounded.
+VISCO_API int  characterIsGrounded(characterBatch *batch, characterID character);
+VISCO_API void characterGetGroundNormal(vec3 *dest, characterBatch *batch, characterID character);
+
+//Moves every character by its displacement, spread over the OpenMP threads. The world is only read,
+//update between steps.
+VISCO_API void characterBatchUpdate(characterBatch *batch, world *world);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "visco_def.h"
+#include "world.h"
+
+//SPH particle fluid, particles collide one way with the bodies of a world
+typedef struct fluid fluid;
+
+//Particles are spaced 2 * radius apart at rest, they interact with neighbours within 4 * radius.
+VISCO_API fluid* fluidCreate(scalar radius);
+VISCO_API void   fluidDestroy(fluid *fluid);
+
+//Particles are sorted by cell every step, indices only stay valid until the next fluidStep.
+VISCO_API size_t fluidAddParticle(fluid *fluid, const vec3 *position, const vec3 *velocity);
+VISCO_API void   fluidRemoveParticle(fluid *fluid, size_t particle);
+VISCO_API size_t fluidGetParticleCount(const fluid *fluid);
+
+VISCO_API void   fluidGetPosition(vec3 *dest, const fluid *fluid, size_t particle);
+VISCO_API void   fluidGetVelocity(vec3 *dest, const fluid *fluid, size_t particle);
+//Copies up to max positions, returns the amount copied.
+VISCO_API size_t fluidCopyPositions(vec3 *dest, const fluid *fluid, size_t max);
+
+VISCO_API void fluidSetRestDensity(fluid *fluid, scalar density);
+VISCO_API void fluidSetStiffness(fluid *fluid, scalar stiffness);
+VISCO_API void fluidSetViscosity(fluid *fluid, scalar viscosity);
+VISCO_API void fluidSetGravity(fluid *fluid, const vec3 *gravity);
+
+//Advances the fluid by delta, world may be NULL. The pressure is stiff, keep delta small or step several times per frame.
+VISCO_API void fluidStep(fluid *fluid, world *world, scalar delta);
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <stdint.h>
 #include "aabb.h"
+#include "allocator.h"
 #include "visco_def.h"
 
 typedef enum shapeType {
 	SHAPE_PLANE,
 	SHAPE_SPHERE,
 	SHAPE_BOX,
+	SHAPE_HULL,
+	SHAPE_CAPSULE,
+	SHAPE_HEIGHTFIELD,
 	SHAPE_MESH,
 	SHAPE_COMPOUND
 } shapeType;
@@ -18,6 +23,7 @@ typedef struct shape {
 	mat3 invInertiaTensor;
 	scalar restitution;
 	scalar friction;
+	viscoAllocator allocator; //the shape frees itself with it
 } shape;
 
 typedef struct contact {
@@ -26,16 +32,47 @@ typedef struct contact {
 	scalar distance;
 } contact;
 
+//Support directions of the last GJK simplex of a pair, local to the first shape
+typedef struct gjkCache {
+	vec3 dir[4];
+	int count;
+} gjkCache;
+
 VISCO_API void shapeDestroy(shape* shape);
+//Bytes a constructor allocates for a shape type, to size pools. Hulls vary with their vertex count and return 0.
+VISCO_API size_t shapeGetSize(shapeType type);
+
+//Constructors allocate through allocator, NULL uses malloc. They return NULL when the allocator fails.
+VISCO_API shape* shapeCreatePlane(const vec3 *normal, scalar distance, const viscoAllocator *allocator);
+VISCO_API shape* shapeCreateSphere(scalar radius, const viscoAllocator *allocator);
+VISCO_API shape* shapeCreateBox(const vec3 *size, const viscoAllocator *allocator);
+//Capsule along the local y axis, height is the distance between the centers of its caps.
+VISCO_API shape* shapeCreateCapsule(scalar radius, scalar height, const viscoAllocator *allocator);
+//Static terrain from a width * depth grid of quantized samples, row major along x. A sample is offset + scale * height[i]
+//and samples are spacing apart on x and z starting at the body position. The heights are not copied so they can point
+//into a mapped asset file, they must outlive the shape. Only spheres and boxes collide with it.
+VISCO_API shape* shapeCreateHeightfield(const uint16_t *heights, size_t width, size_t depth, scalar spacing, scalar scale, scalar offset,
+	const viscoAllocator *allocator);
+//Builds the convex hull of a point cloud, the hull is centered on its center of mass. Returns NULL for flat clouds.
+//Construction scratch comes from the heap, only the hull itself is allocated through allocator.
+VISCO_API shape* shapeCreateHull(const vec3 *points, size_t count, const viscoAllocator *allocator);
 
-VISCO_API shape* shapeCreatePlane(const vec3 *normal, scalar distance);
-VISCO_API shape* shapeCreateSphere(scalar radius);
-VISCO_API shape* shapeCreateBox(const vec3 *size);
+//Writes the definition of a shape to dest when size is large enough, returns the bytes it takes or 0 for types
+//that cannot be serialized. Heightfield samples are copied into the definition.
+VISCO_API size_t shapeSerialize(void *dest, size_t size, const shape *shape);
+//Creates a shape from a definition, NULL if it is truncated or invalid. src must be 8 byte aligned, heightfield
+//samples are read in place and src must outlive the shape.
+VISCO_API shape* shapeDeserialize(const void *src, size_t size, const viscoAllocator *allocator);
 
 VISCO_API void shapeSetDensity(shape *shape, scalar density);
 VISCO_API void shapeRecalcIntertia(shape* shape);
 
 VISCO_API void shapeGenerateAabb(aabb *dest, const shape *shape, const quat *rot);
 
+//Tests if 2 shapes overlap without generating contacts.
+VISCO_API int shapeOverlap(const shape *a, const vec3 *posa, const quat *rota, const shape *b, const vec3 *posb, const quat *rotb);
+
 //Tests collision between 2 shapes. returns the amount of contacts.
-VISCO_API int shapeCollide(contact *dest, int maxContacts, const shape *a, const vec3 *posa, const quat *rota, const shape *b, const vec3 *posb, const quat *rotb);
\ No newline at end of file
+VISCO_API int shapeCollide(contact *dest, int maxContacts, const shape *a, const vec3 *posa, const quat *rota, const shape *b, const vec3 *posb, const quat *rotb);
+//Same as shapeCollide, pairs solved with GJK start from and update the cached simplex.
+VISCO_API int shapeCollideCached(contact *dest, int maxContacts, const shape *a, const vec3 *posa, const quat *rota, const shape *b, const vec3 *posb, const quat *rotb, gjkCache *cache);
\ No newline at end of file
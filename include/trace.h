@@ -0,0 +1,21 @@
+#pragma once
+
+#include "visco_def.h"
+#include "world.h"
+
+//Recording writes the state of a world, the definitions of its shapes and every call that changes it into an
+//append-only file mapped in memory, a record costs a copy until the mapping has to grow. Pending contact events
+//are not captured, and a shape changed after it was given to a body is only recorded the next time a body gets it.
+//Returns 0 when the file cannot be created.
+VISCO_API int  worldTraceBegin(world *world, const char *path);
+VISCO_API void worldTraceEnd(world *world); //also done by worldDestroy
+
+typedef struct traceReplay traceReplay;
+
+//Shapes of the trace belong to the replay, destroy the world before closing it.
+VISCO_API traceReplay* traceReplayOpen(const char *path);
+VISCO_API void         traceReplayClose(traceReplay *replay);
+
+//Applies the recorded calls up to the next step to world, which starts empty. Returns 0 at the end of the trace,
+//otherwise the step is left to the caller with the recorded delta.
+VISCO_API int traceReplayNext(traceReplay *replay, world **world, scalar *delta);
@@ -6,6 +6,10 @@
 
 #define VISCO_MAX_CONTACTS 4
 
+VISCO_INLINE scalar viscoAbs(scalar x) {
+	return x < 0 ? -x : x;
+}
+
 #ifdef VISCO_DLL
 
 //DLL
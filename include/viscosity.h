@@ -10,6 +10,9 @@ extern "C" {
 #endif
 	
 	#include "world.h"
+	#include "fluid.h"
+	#include "character.h"
+	#include "trace.h"
 	
 	VISCO_API int viscoGetVersion(void);
 	
@@ -4,9 +4,14 @@
 #include "shape.h"
 
 typedef struct world world;
+typedef struct worldGroup worldGroup;
 typedef size_t bodyID;
 typedef size_t jointID;
 
+#define BODY_INVALID  ((bodyID)-1)  //returned when the world cannot grow
+#define JOINT_INVALID ((jointID)-1)
+#define WORLD_GROUP_INVALID ((size_t)-1)
+
 typedef enum bodyType {
 	BODY_DELETE = 0,
 	BODY_STATIC,
@@ -14,18 +19,89 @@ typedef enum bodyType {
 	BODY_KINEMATIC
 } bodyType;
 
-VISCO_API world* worldCreate(void);
+typedef enum bodyFlag {
+	BODY_FLAG_CONTACT_EVENTS = 1 << 0, //report contact begin/persist/end for this body
+	BODY_FLAG_SENSOR         = 1 << 1  //only report overlap begin/end, never generates contacts
+} bodyFlag;
+
+typedef enum contactEventType {
+	CONTACT_BEGIN,
+	CONTACT_PERSIST,
+	CONTACT_END,
+	SENSOR_BEGIN,
+	SENSOR_END
+} contactEventType;
+
+typedef struct contactEvent {
+	contactEventType type;
+	bodyID a, b;
+	vec3 position;
+	vec3 normal;   //points from a to b, zero for sensors
+	vec3 velocity; //velocity of b relative to a at position, before solving
+	scalar impulse;
+} contactEvent; //for sensor events a is the sensor and position is the position of b
+
+typedef struct contactListener {
+	void (*begin)(const contactEvent *event, void *user);
+	void (*persist)(const contactEvent *event, void *user);
+	void (*end)(const contactEvent *event, void *user);
+	void (*sensorBegin)(const contactEvent *event, void *user);
+	void (*sensorEnd)(const contactEvent *event, void *user);
+	void *user;
+} contactListener;
+
+//Counters from the last step
+typedef struct worldStats {
+	size_t bodies;
+	size_t joints;
+	size_t pairs;    //body pairs with overlapping AABBs
+	size_t contacts;
+	size_t rows;     //constraint rows of joints and contacts
+	size_t events;   //contact events waiting to be polled
+} worldStats;
+
+//Every buffer of the world comes from allocator, NULL uses malloc. Once the world and its buffers have grown
+//to fit a scene, stepping no longer allocates. When the allocator fails the world keeps its old buffers:
+//worldCreate returns NULL, bodyCreate and the joint functions return BODY_INVALID or JOINT_INVALID and leave
+//the world as it was, and a step leaves out the contacts, constraint rows, contact events and regions that
+//did not fit until a later step has room for them.
+VISCO_API world* worldCreate(const viscoAllocator *allocator);
 VISCO_API void   worldDestroy(world *world);
 
 VISCO_API void worldStep(world **world, scalar delta);
 
+//Collision detection only looks at bodies sharing a region, a cell of the given size. Body positions are
+//stored relative to the corner of their region so they stay precise far from the origin. Sizes that are not
+//positive are ignored. Bodies are entered in the regions with bounds grown by their velocity, a step where
+//any body leaves them rebuilds the regions of every body.
+VISCO_API void worldSetRegionSize(world *world, scalar size);
+
+//Writes up to max bodies with a shape whose AABB overlaps box, returns how many overlap.
+//Only reads the world, queries can run on several threads at once between steps.
+VISCO_API size_t worldQueryAabb(world *world, const aabb *box, bodyID *dest, size_t max);
+
+//Moves every body by -shift, worldGetOrigin returns the total shift.
+VISCO_API void worldShiftOrigin(world *world, const vec3 *shift);
+VISCO_API void worldGetOrigin(double *dest, world *world);
+
+//Contact events are stored in a ring buffer, the oldest events are overwritten when it is full. Returns 0 and
+//keeps the old ring when the allocator fails. Flagging a body creates a ring if there is none, without one
+//the events are dropped.
+VISCO_API int    worldSetContactEventCapacity(world *world, size_t capacity);
+VISCO_API size_t worldPollContactEvents(world *world, contactEvent *dest, size_t max);
+VISCO_API size_t worldDispatchContactEvents(world *world, const contactListener *listener);
+
 VISCO_API bodyID bodyCreate(world **world);
-VISCO_API void   bodyDestroy(world *world, bodyID body);
+VISCO_API void   bodyDestroy(world *world, bodyID body); //also destroys the joints attached to it
 
 VISCO_API void     bodySetType(world *world, bodyID body, bodyType type);
 VISCO_API bodyType bodyGetType(world *world, bodyID body);
 
+VISCO_API void     bodySetFlags(world *world, bodyID body, unsigned flags);
+VISCO_API unsigned bodyGetFlags(world *world, bodyID body);
+
 VISCO_API void bodyGetPosition(vec3 *dest, world *world, bodyID body);
+VISCO_API void bodyGetPositionDouble(double *dest, world *world, bodyID body); //without rounding to scalar
 VISCO_API void bodySetPosition(world *world, bodyID body, const vec3 *position);
 
 VISCO_API void bodyGetOrientation(quat *dest, world *world, bodyID body);
@@ -34,6 +110,7 @@ VISCO_API void bodySetOrientation(world *world, bodyID body, const quat *rot);
 VISCO_API void bodyGetTransform(transform *dest, world *world, bodyID body);
 VISCO_API void bodyGetMat4(mat4 *dest, world *world, bodyID body);
 
+VISCO_API shape* bodyGetShape(world *world, bodyID body);
 VISCO_API void bodySetShape(world *world, bodyID body, shape *shape);
 
 VISCO_API void bodyApplyForce(world *world, bodyID body, const vec3 *pos, const vec3 *force);
@@ -42,4 +119,62 @@ VISCO_API void bodyApplyTorque(world *world, bodyID body, const vec3 *torque);
 
 VISCO_API void bodyGetVelocityAtPoint(vec3 *dest, world *world, bodyID body, const vec3 *pos);
 
-//VISCO_API void jointDestroy(world *world, jointID joint);
\ No newline at end of file
+//Joint anchors and axes are given in world space at creation.
+VISCO_API jointID jointCreateBall(world **world, bodyID a, bodyID b, const vec3 *anchor);
+VISCO_API jointID jointCreateHinge(world **world, bodyID a, bodyID b, const vec3 *anchor, const vec3 *axis);
+VISCO_API jointID jointCreateSlider(world **world, bodyID a, bodyID b, const vec3 *axis);
+VISCO_API jointID jointCreateFixed(world **world, bodyID a, bodyID b);
+VISCO_API jointID jointCreateDistance(world **world, bodyID a, bodyID b, const vec3 *anchorA, const vec3 *anchorB);
+VISCO_API void    jointDestroy(world *world, jointID joint);
+
+//Limits are angles for hinges, translations for sliders and lengths for distance joints.
+//Ball and fixed joints have no free axis, limits and motors are ignored on them.
+VISCO_API void jointSetLimits(world *world, jointID joint, scalar lower, scalar upper);
+VISCO_API void jointDisableLimits(world *world, jointID joint);
+VISCO_API void jointSetMotor(world *world, jointID joint, scalar speed, scalar maxForce);
+VISCO_API void jointDisableMotor(world *world, jointID joint);
+
+VISCO_API void worldSetSolverIterations(world *world, int iterations);
+
+VISCO_API void worldGetStats(worldStats *dest, world *world);
+
+//Seconds spent in each phase of the last step, only measured while profiling is enabled
+typedef struct worldTimings {
+	double integrate;
+	double aabbs;
+	double collision; //broadphase and narrowphase
+	double solver;
+	double events;
+	double total;
+} worldTimings;
+
+VISCO_API void worldSetProfiling(world *world, int enabled);
+VISCO_API void worldGetTimings(worldTimings *dest, world *world);
+
+//Instruction sets the hot loops are compiled for, worldCreate picks the widest one the CPU supports.
+//They may round differently, lockstep simulations and replays should use the same ones everywhere.
+typedef enum worldKernels {
+	WORLD_KERNELS_GENERIC = 0, //what the library was built for
+	WORLD_KERNELS_AVX2         //AVX2 and FMA, x86 builds with GCC or Clang
+} worldKernels;
+
+VISCO_API worldKernels worldGetKernels(world *world);
+//Returns 0 and keeps the current ones when the build or the CPU lacks them
+VISCO_API int          worldSetKernels(world *world, worldKernels kernels);
+
+//Steps many independent worlds in one call, spread over the OpenMP threads. Worlds can share shapes,
+//shapes are only read while stepping. Stepping can move a world, get it back with worldGroupGetWorld.
+//The group does not own its worlds, worlds in a group should only be stepped through it.
+//The per thread solver buffers lent to the worlds come from allocator, NULL uses malloc. It is called from
+//several threads at once, the built-in arena and pool are not thread safe.
+VISCO_API worldGroup* worldGroupCreate(const viscoAllocator *allocator);
+VISCO_API void        worldGroupDestroy(worldGroup *group);
+
+//Returns WORLD_GROUP_INVALID and leaves the group and the world as they were when the allocator fails
+VISCO_API size_t worldGroupAdd(worldGroup *group, world *world);
+VISCO_API void   worldGroupRemove(worldGroup *group, size_t index); //the last world takes its index
+VISCO_API size_t worldGroupGetCount(worldGroup *group);
+VISCO_API world* worldGroupGetWorld(worldGroup *group, size_t index);
+
+//stats may be NULL, otherwise it receives one entry per world
+VISCO_API void worldGroupStep(worldGroup *group, scalar delta, worldStats *stats);
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <string.h>
+#include "allocator.h"
+
+//Enough for any scalar or SIMD vector type, larger alignments are done by the caller
+#define ALLOCATOR_ALIGN 16
+
+static inline size_t alignUp(size_t size) {
+	return (size + ALLOCATOR_ALIGN - 1) & ~(size_t)(ALLOCATOR_ALIGN - 1);
+}
+
+#pragma region Arena
+
+void viscoArenaInit(viscoArena *arena, void *memory, size_t size) {
+	//Start on an aligned address so offsets stay aligned
+	uintptr_t p = (uintptr_t)memory;
+	size_t pad = (size_t)(((p + ALLOCATOR_ALIGN - 1) & ~(uintptr_t)(ALLOCATOR_ALIGN - 1)) - p);
+	arena->memory = (unsigned char*)memory + pad;
+	arena->size = size > pad ? size - pad : 0;
+	arena->used = 0;
+	arena->last = 0;
+}
+void viscoArenaReset(viscoArena *arena) {
+	arena->used = 0;
+	arena->last = 0;
+}
+
+static void* arenaAllocate(size_t size, void *user) {
+	viscoArena *arena = (viscoArena*)user;
+	size_t offset = alignUp(arena->used);
+	if (size > arena->size || offset > arena->size - size) {
+		return NULL;
+	}
+	arena->last = offset;
+	arena->used = offset + size;
+	return &arena->memory[offset];
+}
+static void* arenaReallocate(void *ptr, size_t oldSize, size_t newSize, void *user) {
+	viscoArena *arena = (viscoArena*)user;
+	if (!ptr) {
+		return arenaAllocate(newSize, user);
+	}
+
+	//The latest allocation grows in place
+	unsigned char *p = (unsigned char*)ptr;
+	if (p == &arena->memory[arena->last]) {
+		if (newSize > arena->size - arena->last) {
+			return NULL;
+		}
+		arena->used = arena->last + newSize;
+		return ptr;
+	}
+
+	void *ret = arenaAllocate(newSize, user);
+	if (ret) {
+		memcpy(ret, ptr, oldSize < newSize ? oldSize : newSize);
+	}
+	return ret;
+}
+static void arenaRelease(void *ptr, void *user) {
+	viscoArena *arena = (viscoArena*)user;
+	if ((unsigned char*)ptr == &arena->memory[arena->last]) {
+		arena->used = arena->last;
+	}
+}
+
+viscoAllocator viscoArenaAllocator(viscoArena *arena) {
+	viscoAllocator ret = { arenaAllocate, arenaReallocate, arenaRelease, arena };
+	return ret;
+}
+
+#pragma endregion Arena
+
+#pragma region Pool
+
+void viscoPoolInit(viscoPool *pool, void *memory, size_t size, size_t blockSize) {
+	uintptr_t p = (uintptr_t)memory;
+	size_t pad = (size_t)(((p + ALLOCATOR_ALIGN - 1) & ~(uintptr_t)(ALLOCATOR_ALIGN - 1)) - p);
+	pool->memory = (unsigned char*)memory + pad;
+	pool->block = alignUp(blockSize < sizeof(void*) ? sizeof(void*) : blockSize);
+	pool->count = size > pad ? (size - pad) / pool->block : 0;
+	pool->used = 0;
+	pool->free = NULL;
+}
+void viscoPoolReset(viscoPool *pool) {
+	//Untouched blocks are handed out in order, no need to rebuild the free list
+	pool->used = 0;
+	pool->free = NULL;
+}
+
+static void* poolAllocate(size_t size, void *user) {
+	viscoPool *pool = (viscoPool*)user;
+	if (size > pool->block) {
+		return NULL;
+	}
+	if (pool->free) {
+		void *ret = pool->free;
+		pool->free = *(void**)ret;
+		return ret;
+	}
+	if (pool->used >= pool->count) {
+		return NULL;
+	}
+	return &pool->memory[pool->block * pool->used++];
+}
+static void* poolReallocate(void *ptr, size_t oldSize, size_t newSize, void *user) {
+	viscoPool *pool = (viscoPool*)user;
+	(void)oldSize;
+	if (newSize > pool->block) {
+		return NULL;
+	}
+	return ptr ? ptr : poolAllocate(newSize, user);
+}
+static void poolRelease(void *ptr, void *user) {
+	viscoPool *pool = (viscoPool*)user;
+	*(void**)ptr = pool->free;
+	pool->free = ptr;
+}
+
+viscoAllocator viscoPoolAllocator(viscoPool *pool) {
+	viscoAllocator ret = { poolAllocate, poolReallocate, poolRelease, pool };
+	return ret;
+}
+
+#pragma endregion Pool
@@ -0,0 +1,440 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "character.h"
+
+#define CHARACTER_MAX_BODIES 64    //bodies considered per character and update
+#define CHARACTER_MAX_SUBSTEPS 32  //substeps of at most half the radius per slide
+#define CHARACTER_DEPENETRATION 4  //push out passes per substep
+#define CHARACTER_BISECTIONS 6     //refinement of the time of impact inside a substep
+#define CHARACTER_PARALLEL_MIN 64
+#define CHARACTER_EPSILON 1e-5f
+
+#define DEFAULT_MAX_SLOPE 0.7853982f
+
+typedef struct character_state {
+	vec3 position;
+	vec3 move;
+	vec3 groundNormal;
+	scalar radius, halfHeight;
+	scalar stepHeight;
+	scalar minGroundY; //cosine of the max slope
+	int grounded;
+	int supported; //resting on something, walkable or not
+	shape *proxy; //NULL for free slots
+	shape *probe; //sphere of the same radius, capsules collide with heightfields as a row of them
+	shape *feeler; //small sphere telling the edge of a step from a steep slope
+} character_state;
+
+struct characterBatch {
+	character_state *characters;
+	size_t size, cap;
+
+	size_t *empty;
+	size_t empty_size;
+};
+
+//Bodies near one character, gathered once per update
+typedef struct character_query {
+	world *w;
+	bodyID bodies[CHARACTER_MAX_BODIES];
+	size_t count;
+} character_query;
+
+typedef struct character_ground {
+	int grounded;
+	int supported;
+	vec3 normal;
+
+	//Last support too steep to walk on
+	bodyID edgeBody;
+	vec3 edgePoint, edgeNormal;
+} character_ground;
+
+#define SLIDE_HORIZONTAL 1 //steep surfaces block instead of lifting
+#define SLIDE_PERCH      2 //stop on anything below, e.g. the edge of a step
+
+static void destroyShapes(character_state *c) {
+	if (c->probe != c->proxy) {
+		shapeDestroy(c->probe);
+	}
+	shapeDestroy(c->proxy);
+	shapeDestroy(c->feeler);
+	c->proxy = c->probe = c->feeler = NULL;
+}
+
+characterBatch* characterBatchCreate(void) {
+	characterBatch *ret = (characterBatch*)calloc(1, sizeof(characterBatch));
+	return ret;
+}
+void characterBatchDestroy(characterBatch *b) {
+	for (size_t i = 0; i < b->size; i++) {
+		if (b->characters[i].proxy) {
+			destroyShapes(&b->characters[i]);
+		}
+	}
+	free(b->characters);
+	free(b->empty);
+	free(b);
+}
+
+characterID characterCreate(characterBatch *b, scalar radius, scalar height, const vec3 *pos) {
+	size_t index;
+	if (b->empty_size) {
+		index = b->empty[--b->empty_size];
+	} else {
+		if (b->size >= b->cap) {
+			b->cap = b->cap ? b->cap * 2 : 64;
+			b->characters = (character_state*)realloc(b->characters, b->cap * sizeof(character_state));
+			b->empty = (size_t*)realloc(b->empty, b->cap * sizeof(size_t));
+		}
+		index = b->size++;
+	}
+
+	character_state *c = &b->characters[index];
+	memset(c, 0, sizeof(character_state));
+	c->position = *pos;
+	c->groundNormal = vec3YAxis;
+	c->radius = radius;
+	c->halfHeight = height * 0.5f;
+	c->stepHeight = (height + radius * 2) * 0.25f;
+	c->minGroundY = (scalar)cos(DEFAULT_MAX_SLOPE);
+	c->probe = shapeCreateSphere(radius, NULL);
+	c->proxy = height > 0 ? shapeCreateCapsule(radius, height, NULL) : c->probe;
+	c->feeler = shapeCreateSphere(radius * 0.1f, NULL);
+	return index;
+}
+void characterDestroy(characterBatch *b, characterID id) {
+	destroyShapes(&b->characters[id]);
+	b->empty[b->empty_size++] = id;
+}
+
+void characterSetStepHeight(characterBatch *b, characterID id, scalar height) {
+	b->characters[id].stepHeight = height;
+}
+void characterSetMaxSlope(characterBatch *b, characterID id, scalar angle) {
+	b->characters[id].minGroundY = (scalar)cos(angle);
+}
+
+void characterGetPosition(vec3 *dest, characterBatch *b, characterID id) {
+	*dest = b->characters[id].position;
+}
+void characterSetPosition(characterBatch *b, characterID id, const vec3 *pos) {
+	b->characters[id].position = *pos;
+	b->characters[id].grounded = 0;
+	b->characters[id].supported = 0;
+	b->characters[id].groundNormal = vec3YAxis;
+}
+
+void characterMove(characterBatch *b, characterID id, const vec3 *displacement) {
+	b->characters[id].move = *displacement;
+}
+
+int characterIsGrounded(characterBatch *b, characterID id) {
+	return b->characters[id].grounded;
+}
+void characterGetGroundNormal(vec3 *dest, characterBatch *b, characterID id) {
+	*dest = b->characters[id].groundNormal;
+}
+
+//Contacts between the proxy and a body, normals point towards the character
+static int collideProxy(contact *dest, const character_state *c, const vec3 *pos, const character_query *q, bodyID body) {
+	const shape *s = bodyGetShape(q->w, body);
+	vec3 bpos;
+	quat brot;
+	bodyGetPosition(&bpos, q->w, body);
+	bodyGetOrientation(&brot, q->w, body);
+
+	int count = 0;
+	if (s->type == SHAPE_HEIGHTFIELD && c->proxy != c->probe) {
+		//Heightfields only take spheres, cover the capsule with spheres at most a radius apart
+		int spheres = (int)ceil(c->halfHeight * 2 / c->radius) + 1;
+		for (int i = 0; i < spheres && count < VISCO_MAX_CONTACTS; i++) {
+			vec3 center = *pos;
+			center.y += c->halfHeight * ((scalar)i * 2 / (scalar)(spheres - 1) - 1);
+			int n = shapeCollide(&dest[count], VISCO_MAX_CONTACTS - count, c->probe, &center, &quatIndentity, s, &bpos, &brot);
+			if (n > 0) {
+				for (int k = 0; k < n; k++) {
+					vec3Negate(&dest[count + k].normal, &dest[count + k].normal);
+				}
+			}
+			count += n < 0 ? -n : n;
+		}
+		return count;
+	}
+
+	count = shapeCollide(dest, VISCO_MAX_CONTACTS, c->proxy, pos, &quatIndentity, s, &bpos, &brot);
+	if (count > 0) {
+		for (int k = 0; k < count; k++) {
+			vec3Negate(&dest[k].normal, &dest[k].normal);
+		}
+	}
+	return count < 0 ? -count : count;
+}
+
+static int penetrating(const character_state *c, const vec3 *pos, const character_query *q) {
+	for (size_t i = 0; i < q->count; i++) {
+		contact contacts[VISCO_MAX_CONTACTS];
+		int n = collideProxy(contacts, c, pos, q, q->bodies[i]);
+		for (int k = 0; k < n; k++) {
+			if (contacts[k].distance > CHARACTER_EPSILON) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+//Pushes the proxy out of every body, returns the direction of the total push
+static int depenetrate(vec3 *normal, const character_state *c, vec3 *pos, const character_query *q, character_ground *ground) {
+	vec3 total = vec3Zero;
+	int hit = 0;
+
+	for (int it = 0; it < CHARACTER_DEPENETRATION; it++) {
+		int moved = 0;
+		for (size_t i = 0; i < q->count; i++) {
+			contact contacts[VISCO_MAX_CONTACTS];
+			int n = collideProxy(contacts, c, pos, q, q->bodies[i]);
+
+			int deepest = -1;
+			for (int k = 0; k < n; k++) {
+				if (contacts[k].distance > CHARACTER_EPSILON && (deepest < 0 || contacts[k].distance > contacts[deepest].distance)) {
+					deepest = k;
+				}
+			}
+			if (deepest < 0) {
+				continue;
+			}
+
+			const contact *ct = &contacts[deepest];
+			vec3 push;
+			vec3MulScalar(&push, &ct->normal, ct->distance);
+			vec3Add(pos, pos, &push);
+			vec3Add(&total, &total, &push);
+			moved = hit = 1;
+
+			if (ground && ct->normal.y > CHARACTER_EPSILON) {
+				ground->supported = 1;
+				if (ct->normal.y < c->minGroundY) {
+					ground->edgeBody = q->bodies[i];
+					ground->edgePoint = ct->position;
+					ground->edgeNormal = ct->normal;
+				}
+			}
+			if (ground && ct->normal.y >= c->minGroundY && (!ground->grounded || ct->normal.y > ground->normal.y)) {
+				ground->grounded = 1;
+				ground->normal = ct->normal;
+			}
+		}
+		if (!moved) {
+			break;
+		}
+	}
+
+	if (hit) {
+		if (vec3Dot(&total, &total) < CHARACTER_EPSILON * CHARACTER_EPSILON) {
+			return 0;
+		}
+		vec3Normalize(normal, &total);
+	}
+	return hit;
+}
+
+//Collide and slide, the move is swept in substeps short enough not to skip through bodies thicker than the radius
+static void slide(const character_state *c, vec3 *pos, const vec3 *move, const character_query *q, character_ground *ground, int flags) {
+	vec3 rest = *move;
+	scalar maxStep = c->radius * 0.5f;
+
+	for (int i = 0; i < CHARACTER_MAX_SUBSTEPS; i++) {
+		scalar length = vec3Length(&rest);
+		if (length < CHARACTER_EPSILON) {
+			break;
+		}
+
+		vec3 step, to;
+		vec3MulScalar(&step, &rest, mm_min(length, maxStep) / length);
+		vec3Add(&to, pos, &step);
+		if (penetrating(c, &to, q)) {
+			//Approach the first touch so the contact normal is the surface hit and not a deep push out of an edge
+			scalar lo = 0, hi = 1;
+			for (int b = 0; b < CHARACTER_BISECTIONS; b++) {
+				scalar mid = (lo + hi) * 0.5f;
+				vec3 at;
+				vec3MulScalar(&at, &step, mid);
+				vec3Add(&at, pos, &at);
+				if (penetrating(c, &at, q)) {
+					hi = mid;
+				} else {
+					lo = mid;
+				}
+			}
+			vec3MulScalar(&step, &step, hi);
+			vec3Add(&to, pos, &step);
+		}
+		*pos = to;
+		vec3Sub(&rest, &rest, &step);
+
+		vec3 normal;
+		if (!depenetrate(&normal, c, pos, q, ground)) {
+			continue;
+		}
+		if (ground && (ground->grounded || (ground->supported && (flags & SLIDE_PERCH)))) {
+			break;
+		}
+
+		//Walls and slopes too steep to walk on block sideways moves without lifting the character
+		if ((flags & SLIDE_HORIZONTAL) && normal.y < c->minGroundY) {
+			normal.y = 0;
+			scalar flat = vec3Length(&normal);
+			if (flat < CHARACTER_EPSILON) {
+				continue;
+			}
+			vec3DivScalar(&normal, &normal, flat);
+		}
+
+		//Drop the part of the move going into the surface
+		scalar into = vec3Dot(&rest, &normal);
+		if (into < 0) {
+			vec3 remove;
+			vec3MulScalar(&remove, &normal, into);
+			vec3Sub(&rest, &rest, &remove);
+		}
+	}
+}
+
+//Whether a steep support is the rim of walkable ground, felt just past the contact on the far side
+static int onEdge(const character_state *c, const character_ground *ground, const character_query *q) {
+	vec3 inward = { -ground->edgeNormal.x, 0, -ground->edgeNormal.z };
+	scalar flat = vec3Length(&inward);
+	if (flat < CHARACTER_EPSILON) {
+		return 0;
+	}
+	scalar r = c->radius * 0.1f;
+	vec3 center;
+	vec3MulScalar(&inward, &inward, r * 2 / flat);
+	vec3Add(&center, &ground->edgePoint, &inward);
+	center.y += r * 0.5f;
+
+	const shape *s = bodyGetShape(q->w, ground->edgeBody);
+	vec3 bpos;
+	quat brot;
+	bodyGetPosition(&bpos, q->w, ground->edgeBody);
+	bodyGetOrientation(&brot, q->w, ground->edgeBody);
+
+	contact contacts[VISCO_MAX_CONTACTS];
+	int n = shapeCollide(contacts, VISCO_MAX_CONTACTS, c->feeler, &center, &quatIndentity, s, &bpos, &brot);
+	scalar sign = n > 0 ? -1.f : 1.f;
+	n = n < 0 ? -n : n;
+	for (int k = 0; k < n; k++) {
+		if (contacts[k].normal.y * sign >= c->minGroundY) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//Step up, move sideways, then come back down and snap to the ground when walking
+static void moveCharacter(vec3 *dest, character_ground *ground, const character_state *c, const character_query *q,
+	const vec3 *side, scalar vertical, scalar stepUp) {
+	vec3 pos = c->position;
+
+	if (stepUp > 0) {
+		vec3 up = { 0, stepUp, 0 };
+		slide(c, &pos, &up, q, NULL, 0);
+	}
+	scalar lifted = pos.y - c->position.y;
+
+	slide(c, &pos, side, q, NULL, SLIDE_HORIZONTAL);
+
+	scalar down = lifted;
+	if (vertical > 0) {
+		vec3 up = { 0, vertical, 0 };
+		slide(c, &pos, &up, q, NULL, 0);
+	} else {
+		down -= vertical;
+	}
+
+	ground->grounded = ground->supported = 0;
+	ground->normal = vec3YAxis;
+	vec3 fall = { 0, -down, 0 };
+	slide(c, &pos, &fall, q, ground, stepUp > 0 ? SLIDE_PERCH : 0);
+
+	if (!ground->supported && c->grounded && vertical <= 0) {
+		//Follow the ground down steps and slopes, stay in the air if there is none close enough
+		vec3 air = pos;
+		vec3 snap = { 0, -c->stepHeight, 0 };
+		slide(c, &pos, &snap, q, ground, 0);
+		if (!ground->grounded) {
+			pos = air;
+		}
+	}
+	*dest = pos;
+}
+
+static void updateCharacter(character_state *c, world *w) {
+	vec3 side = { c->move.x, 0, c->move.z };
+	scalar vertical = c->move.y;
+	c->move = vec3Zero;
+
+	//Everything the proxy can reach this update, stepping up and snapping down included
+	character_query q;
+	q.w = w;
+	vec3 end;
+	vec3Add(&end, &c->position, &side);
+	end.y += vertical;
+	vec3 extent = { c->radius, c->halfHeight + c->radius + c->stepHeight, c->radius };
+	aabb box = {
+		{ mm_min(c->position.x, end.x), mm_min(c->position.y, end.y), mm_min(c->position.z, end.z) },
+		{ mm_max(c->position.x, end.x), mm_max(c->position.y, end.y), mm_max(c->position.z, end.z) }
+	};
+	vec3Sub(&box.min, &box.min, &extent);
+	vec3Add(&box.max, &box.max, &extent);
+
+	bodyID found[CHARACTER_MAX_BODIES];
+	size_t count = worldQueryAabb(w, &box, found, CHARACTER_MAX_BODIES);
+	count = count < CHARACTER_MAX_BODIES ? count : CHARACTER_MAX_BODIES;
+	q.count = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (!(bodyGetFlags(w, found[i]) & BODY_FLAG_SENSOR)) {
+			q.bodies[q.count++] = found[i];
+		}
+	}
+
+	int walking = vec3Dot(&side, &side) > CHARACTER_EPSILON * CHARACTER_EPSILON;
+	scalar stepUp = c->supported && walking ? c->stepHeight : 0;
+
+	vec3 pos;
+	character_ground ground;
+	moveCharacter(&pos, &ground, c, &q, &side, vertical, stepUp);
+	if (stepUp > 0 && !ground.grounded) {
+		//Ending on the edge of a step is fine as long as it gets further than walking straight,
+		//resting on a steep slope is not or stepping would climb it
+		vec3 flat;
+		character_ground flatGround;
+		moveCharacter(&flat, &flatGround, c, &q, &side, vertical, 0);
+
+		vec3 stepped, walked;
+		vec3Sub(&stepped, &pos, &c->position);
+		vec3Sub(&walked, &flat, &c->position);
+		if (!ground.supported || !onEdge(c, &ground, &q) || vec3Dot(&stepped, &side) <= vec3Dot(&walked, &side) + CHARACTER_EPSILON) {
+			pos = flat;
+			ground = flatGround;
+		}
+	}
+
+	c->position = pos;
+	c->grounded = ground.grounded;
+	c->supported = ground.supported;
+	c->groundNormal = ground.normal;
+}
+
+void characterBatchUpdate(characterBatch *b, world *w) {
+	long count = (long)b->size;
+
+	#pragma omp parallel for schedule(dynamic, 16) if(count >= CHARACTER_PARALLEL_MIN)
+	for (long i = 0; i < count; i++) {
+		if (b->characters[i].proxy) {
+			updateCharacter(&b->characters[i], w);
+		}
+	}
+}
@@ -0,0 +1,466 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "fluid.h"
+
+#define FLUID_ALIGN 64
+#define FLUID_SUPPORT 4 //smoothing radius in particle radii
+#define FLUID_NEIGHBOUR_RANGES 18 //9 rows of 3 cells, each may wrap around the table
+
+#define DEFAULT_REST_DENSITY 1000.f
+#define DEFAULT_STIFFNESS 200.f
+#define DEFAULT_VISCOSITY 0.5f
+
+//Snapshot of a body touching the fluid, taken once per step
+typedef struct fluid_body {
+	bodyID id;
+	const shape *s;
+	vec3 pos;
+	quat rot;
+	aabb box;
+} fluid_body;
+
+struct fluid {
+	size_t count, cap;
+
+	//Particle arrays, cache line aligned and carved from one block
+	unsigned char *data;
+	scalar *px, *py, *pz;
+	scalar *vx, *vy, *vz;
+	scalar *ax, *ay, *az;
+	scalar *density, *pressure;
+	scalar *temp; //scratch for reordering
+	size_t *cell; //hash bucket of each particle
+	size_t *order;
+
+	//Particles sorted by bucket, bucket_count + 1 offsets
+	size_t *buckets;
+	size_t bucket_count, bucket_cap;
+
+	fluid_body *bodies;
+	bodyID *query;
+	size_t body_cap;
+
+	shape *probe; //sphere used to collide a particle with bodies
+	scalar radius, support, mass;
+	scalar restDensity, stiffness, viscosity;
+	vec3 gravity;
+};
+
+static inline void* carve(unsigned char **cursor, size_t size) {
+	uintptr_t p = ((uintptr_t)*cursor + FLUID_ALIGN - 1) & ~(uintptr_t)(FLUID_ALIGN - 1);
+	*cursor = (unsigned char*)p + size;
+	return (void*)p;
+}
+static void allocateParticles(fluid *f, size_t cap) {
+	const size_t scalars = 12;
+	size_t size = (sizeof(scalar) * scalars + sizeof(size_t) * 2) * cap + FLUID_ALIGN * (scalars + 3);
+	unsigned char *data = (unsigned char*)malloc(size);
+	unsigned char *cursor = data;
+
+	scalar *old[6] = { f->px, f->py, f->pz, f->vx, f->vy, f->vz };
+	scalar **arrays[12] = {
+		&f->px, &f->py, &f->pz,
+		&f->vx, &f->vy, &f->vz,
+		&f->ax, &f->ay, &f->az,
+		&f->density, &f->pressure, &f->temp
+	};
+	for (size_t i = 0; i < scalars; i++) {
+		*arrays[i] = (scalar*)carve(&cursor, sizeof(scalar) * cap);
+	}
+	f->cell  = (size_t*)carve(&cursor, sizeof(size_t) * cap);
+	f->order = (size_t*)carve(&cursor, sizeof(size_t) * cap);
+
+	//Only positions and velocities live across steps
+	for (size_t i = 0; i < 6; i++) {
+		if (f->count) {
+			memcpy(*arrays[i], old[i], sizeof(scalar) * f->count);
+		}
+	}
+
+	free(f->data);
+	f->data = data;
+	f->cap = cap;
+}
+
+fluid* fluidCreate(scalar radius) {
+	fluid *ret = (fluid*)calloc(1, sizeof(fluid));
+
+	ret->radius = radius;
+	ret->support = radius * FLUID_SUPPORT;
+	ret->restDensity = DEFAULT_REST_DENSITY;
+	ret->stiffness = DEFAULT_STIFFNESS;
+	ret->viscosity = DEFAULT_VISCOSITY;
+	ret->gravity = (vec3){ 0, -9.8f, 0 };
+	fluidSetRestDensity(ret, DEFAULT_REST_DENSITY);
+	ret->probe = shapeCreateSphere(radius, NULL);
+	allocateParticles(ret, 256);
+
+	return ret;
+}
+void fluidDestroy(fluid *f) {
+	shapeDestroy(f->probe);
+	free(f->bodies);
+	free(f->query);
+	free(f->buckets);
+	free(f->data);
+	free(f);
+}
+
+size_t fluidAddParticle(fluid *f, const vec3 *pos, const vec3 *vel) {
+	if (f->count >= f->cap) {
+		allocateParticles(f, f->cap * 2);
+	}
+	size_t i = f->count++;
+	f->px[i] = pos->x;
+	f->py[i] = pos->y;
+	f->pz[i] = pos->z;
+	f->vx[i] = vel ? vel->x : 0;
+	f->vy[i] = vel ? vel->y : 0;
+	f->vz[i] = vel ? vel->z : 0;
+	return i;
+}
+void fluidRemoveParticle(fluid *f, size_t i) {
+	size_t last = --f->count;
+	f->px[i] = f->px[last];
+	f->py[i] = f->py[last];
+	f->pz[i] = f->pz[last];
+	f->vx[i] = f->vx[last];
+	f->vy[i] = f->vy[last];
+	f->vz[i] = f->vz[last];
+}
+size_t fluidGetParticleCount(const fluid *f) {
+	return f->count;
+}
+
+void fluidGetPosition(vec3 *dest, const fluid *f, size_t i) {
+	*dest = (vec3){ f->px[i], f->py[i], f->pz[i] };
+}
+void fluidGetVelocity(vec3 *dest, const fluid *f, size_t i) {
+	*dest = (vec3){ f->vx[i], f->vy[i], f->vz[i] };
+}
+size_t fluidCopyPositions(vec3 *dest, const fluid *f, size_t max) {
+	size_t count = f->count < max ? f->count : max;
+	for (size_t i = 0; i < count; i++) {
+		dest[i] = (vec3){ f->px[i], f->py[i], f->pz[i] };
+	}
+	return count;
+}
+
+void fluidSetRestDensity(fluid *f, scalar density) {
+	//Particles fill a cube of side 2 * radius at rest
+	scalar side = f->radius * 2;
+	f->restDensity = density;
+	f->mass = density * side * side * side;
+}
+void fluidSetStiffness(fluid *f, scalar stiffness) {
+	f->stiffness = stiffness;
+}
+void fluidSetViscosity(fluid *f, scalar viscosity) {
+	f->viscosity = viscosity;
+}
+void fluidSetGravity(fluid *f, const vec3 *gravity) {
+	f->gravity = *gravity;
+}
+
+//Uniform grid with a cell per support radius, hashed into a power of 2 bucket count.
+//x is added unscrambled so a row of 3 neighbour cells is 3 consecutive buckets.
+static inline int fluidCell(const fluid *f, scalar x) {
+	return (int)floor(x / f->support);
+}
+static inline size_t fluidHash(int x, int y, int z, size_t count) {
+	return (size_t)((unsigned)x + (unsigned)y * 73856093u + (unsigned)z * 19349663u) & (count - 1);
+}
+//Particle ranges of the 27 cells around a point, buckets shared by several rows are only listed once
+static inline int neighbourRanges(size_t *first, size_t *last, const fluid *f, scalar x, scalar y, scalar z) {
+	int cx = fluidCell(f, x), cy = fluidCell(f, y), cz = fluidCell(f, z);
+	const size_t count = f->bucket_count;
+
+	size_t lo[FLUID_NEIGHBOUR_RANGES], hi[FLUID_NEIGHBOUR_RANGES];
+	int n = 0;
+	for (int j = -1; j <= 1; j++) {
+		for (int k = -1; k <= 1; k++) {
+			size_t start = fluidHash(cx - 1, cy + j, cz + k, count);
+			size_t end = start + 3;
+			if (end > count) {
+				//Row wraps around the table
+				lo[n] = 0;
+				hi[n++] = end - count;
+				end = count;
+			}
+			lo[n] = start;
+			hi[n++] = end;
+		}
+	}
+
+	//Insertion sort by start, then merge overlapping bucket intervals
+	for (int i = 1; i < n; i++) {
+		size_t l = lo[i], h = hi[i];
+		int k = i;
+		for (; k > 0 && lo[k - 1] > l; k--) {
+			lo[k] = lo[k - 1];
+			hi[k] = hi[k - 1];
+		}
+		lo[k] = l;
+		hi[k] = h;
+	}
+	int ranges = 0;
+	for (int i = 0; i < n;) {
+		size_t l = lo[i], h = hi[i];
+		for (i++; i < n && lo[i] <= h; i++) {
+			h = hi[i] > h ? hi[i] : h;
+		}
+		if (f->buckets[l] != f->buckets[h]) {
+			first[ranges] = f->buckets[l];
+			last[ranges++] = f->buckets[h];
+		}
+	}
+	return ranges;
+}
+static inline void permute(fluid *f, scalar **array) {
+	scalar *src = *array, *dst = f->temp;
+	const size_t *order = f->order;
+	#pragma omp parallel for
+	for (size_t i = 0; i < f->count; i++) {
+		dst[i] = src[order[i]];
+	}
+	f->temp = src;
+	*array = dst;
+}
+static void sortParticles(fluid *f) {
+	size_t count = 16;
+	while (count < f->count * 2) {
+		count *= 2;
+	}
+	if (f->bucket_cap < count + 1) {
+		free(f->buckets);
+		f->buckets = (size_t*)malloc((count + 1) * sizeof(size_t));
+		f->bucket_cap = count + 1;
+	}
+	f->bucket_count = count;
+	memset(f->buckets, 0, (count + 1) * sizeof(size_t));
+
+	#pragma omp parallel for
+	for (size_t i = 0; i < f->count; i++) {
+		f->cell[i] = fluidHash(fluidCell(f, f->px[i]), fluidCell(f, f->py[i]), fluidCell(f, f->pz[i]), count);
+	}
+
+	//Counting sort, same layout as the world regions
+	for (size_t i = 0; i < f->count; i++) {
+		f->buckets[f->cell[i] + 1]++;
+	}
+	for (size_t i = 0; i < count; i++) {
+		f->buckets[i + 1] += f->buckets[i];
+	}
+	for (size_t i = 0; i < f->count; i++) {
+		f->order[f->buckets[f->cell[i]]++] = i;
+	}
+	memmove(&f->buckets[1], &f->buckets[0], count * sizeof(size_t));
+	f->buckets[0] = 0;
+
+	//Neighbours end up next to each other in memory
+	permute(f, &f->px);
+	permute(f, &f->py);
+	permute(f, &f->pz);
+	permute(f, &f->vx);
+	permute(f, &f->vy);
+	permute(f, &f->vz);
+}
+
+//Density from the poly6 kernel, pressure from the equation of state
+static void computeDensity(fluid *f) {
+	const scalar h = f->support;
+	const scalar h2 = h * h;
+	const scalar h9 = h2 * h2 * h2 * h2 * h;
+	const scalar poly6 = 315.f / (64.f * mm_pi * h9);
+	const scalar *px = f->px, *py = f->py, *pz = f->pz;
+
+	#pragma omp parallel for
+	for (size_t i = 0; i < f->count; i++) {
+		const scalar xi = px[i], yi = py[i], zi = pz[i];
+		size_t first[FLUID_NEIGHBOUR_RANGES], last[FLUID_NEIGHBOUR_RANGES];
+		int count = neighbourRanges(first, last, f, xi, yi, zi);
+
+		scalar sum = 0;
+		for (int b = 0; b < count; b++) {
+			#pragma omp simd reduction(+:sum)
+			for (size_t j = first[b]; j < last[b]; j++) {
+				scalar dx = px[j] - xi, dy = py[j] - yi, dz = pz[j] - zi;
+				scalar w = h2 - (dx * dx + dy * dy + dz * dz);
+				//Multiplied by the mask, a select around arithmetic would be a branch the vectoriser refuses
+				sum += (scalar)(w > 0) * (w * w * w);
+			}
+		}
+		scalar density = f->mass * poly6 * sum;
+		f->density[i] = density;
+		f->pressure[i] = mm_max(f->stiffness * (density - f->restDensity), 0);
+	}
+}
+//Pressure from the spiky kernel gradient, viscosity from the viscosity kernel laplacian
+static void computeForces(fluid *f) {
+	const scalar h = f->support;
+	const scalar h2 = h * h;
+	const scalar h6 = h2 * h2 * h2;
+	const scalar kernel = 45.f / (mm_pi * h6); //shared by the spiky gradient and the viscosity laplacian
+	const scalar mass = f->mass;
+	const scalar viscosity = f->viscosity;
+	const scalar *px = f->px, *py = f->py, *pz = f->pz;
+	const scalar *vx = f->vx, *vy = f->vy, *vz = f->vz;
+	const scalar *density = f->density, *pressure = f->pressure;
+
+	#pragma omp parallel for
+	for (size_t i = 0; i < f->count; i++) {
+		const scalar xi = px[i], yi = py[i], zi = pz[i];
+		const scalar vxi = vx[i], vyi = vy[i], vzi = vz[i];
+		const scalar pi = pressure[i];
+		size_t first[FLUID_NEIGHBOUR_RANGES], last[FLUID_NEIGHBOUR_RANGES];
+		int count = neighbourRanges(first, last, f, xi, yi, zi);
+
+		scalar fx = 0, fy = 0, fz = 0;
+		for (int b = 0; b < count; b++) {
+			#pragma omp simd reduction(+:fx, fy, fz)
+			for (size_t j = first[b]; j < last[b]; j++) {
+				scalar dx = px[j] - xi, dy = py[j] - yi, dz = pz[j] - zi;
+				scalar r2 = dx * dx + dy * dy + dz * dz;
+				//Masked instead of branching, outside the support and the particle itself add nothing
+				scalar inside = (scalar)((r2 < h2) & (r2 > 1e-12f));
+				scalar r = mm_sqrt(r2);
+				scalar q = inside * (h - r);
+				scalar inv = inside / mm_max(r, 1e-6f);
+				scalar share = mass / density[j];
+
+				scalar push = -share * (pi + pressure[j]) * 0.5f * kernel * q * q * inv;
+				scalar drag = share * viscosity * kernel * q;
+				fx += push * dx + drag * (vx[j] - vxi);
+				fy += push * dy + drag * (vy[j] - vyi);
+				fz += push * dz + drag * (vz[j] - vzi);
+			}
+		}
+		scalar inv = 1.f / density[i];
+		f->ax[i] = fx * inv + f->gravity.x;
+		f->ay[i] = fy * inv + f->gravity.y;
+		f->az[i] = fz * inv + f->gravity.z;
+	}
+}
+static void integrate(fluid *f, scalar dt) {
+	scalar *px = f->px, *py = f->py, *pz = f->pz;
+	scalar *vx = f->vx, *vy = f->vy, *vz = f->vz;
+	const scalar *ax = f->ax, *ay = f->ay, *az = f->az;
+
+	#pragma omp parallel for simd
+	for (size_t i = 0; i < f->count; i++) {
+		vx[i] += ax[i] * dt;
+		vy[i] += ay[i] * dt;
+		vz[i] += az[i] * dt;
+		px[i] += vx[i] * dt;
+		py[i] += vy[i] * dt;
+		pz[i] += vz[i] * dt;
+	}
+}
+
+//One way collision, bodies push particles out and are not affected
+static size_t gatherBodies(fluid *f, world *w) {
+	aabb bounds = {
+		{ INFINITY, INFINITY, INFINITY },
+		{-INFINITY,-INFINITY,-INFINITY }
+	};
+	for (size_t i = 0; i < f->count; i++) {
+		bounds.min.x = mm_min(bounds.min.x, f->px[i]);
+		bounds.min.y = mm_min(bounds.min.y, f->py[i]);
+		bounds.min.z = mm_min(bounds.min.z, f->pz[i]);
+		bounds.max.x = mm_max(bounds.max.x, f->px[i]);
+		bounds.max.y = mm_max(bounds.max.y, f->py[i]);
+		bounds.max.z = mm_max(bounds.max.z, f->pz[i]);
+	}
+	vec3 pad = { f->radius, f->radius, f->radius };
+	vec3Sub(&bounds.min, &bounds.min, &pad);
+	vec3Add(&bounds.max, &bounds.max, &pad);
+
+	size_t count = worldQueryAabb(w, &bounds, f->query, f->body_cap);
+	if (count > f->body_cap) {
+		f->body_cap = count;
+		f->query  = (bodyID*)realloc(f->query, count * sizeof(bodyID));
+		f->bodies = (fluid_body*)realloc(f->bodies, count * sizeof(fluid_body));
+		count = worldQueryAabb(w, &bounds, f->query, f->body_cap);
+	}
+
+	size_t used = 0;
+	for (size_t i = 0; i < count; i++) {
+		bodyID id = f->query[i];
+		if (bodyGetFlags(w, id) & BODY_FLAG_SENSOR) {
+			continue;
+		}
+		fluid_body *b = &f->bodies[used++];
+		b->id = id;
+		b->s = bodyGetShape(w, id);
+		bodyGetPosition(&b->pos, w, id);
+		bodyGetOrientation(&b->rot, w, id);
+		shapeGenerateAabb(&b->box, b->s, &b->rot);
+		aabbAddVec3(&b->box, &b->box, &b->pos);
+	}
+	return used;
+}
+static void collideBodies(fluid *f, world *w) {
+	size_t count = gatherBodies(f, w);
+	if (count == 0) {
+		return;
+	}
+	const fluid_body *bodies = f->bodies;
+	const quat identity = quatIndentity;
+	const scalar r = f->radius;
+
+	#pragma omp parallel for
+	for (size_t i = 0; i < f->count; i++) {
+		vec3 p = { f->px[i], f->py[i], f->pz[i] };
+		for (size_t k = 0; k < count; k++) {
+			const fluid_body *b = &bodies[k];
+			if (p.x + r < b->box.min.x || p.x - r > b->box.max.x ||
+				p.y + r < b->box.min.y || p.y - r > b->box.max.y ||
+				p.z + r < b->box.min.z || p.z - r > b->box.max.z) {
+				continue;
+			}
+
+			contact c;
+			int n = shapeCollide(&c, 1, b->s, &b->pos, &b->rot, f->probe, &p, &identity);
+			if (n == 0) {
+				continue;
+			}
+			if (n < 0) {
+				vec3Negate(&c.normal, &c.normal);
+			}
+
+			vec3 t;
+			vec3MulScalar(&t, &c.normal, c.distance);
+			vec3Add(&p, &p, &t);
+
+			//Remove the approaching part of the velocity relative to the body
+			vec3 v = { f->vx[i], f->vy[i], f->vz[i] }, body, rel;
+			bodyGetVelocityAtPoint(&body, w, b->id, &p);
+			vec3Sub(&rel, &v, &body);
+			scalar vn = vec3Dot(&rel, &c.normal);
+			if (vn < 0) {
+				vec3MulScalar(&t, &c.normal, vn);
+				vec3Sub(&v, &v, &t);
+				f->vx[i] = v.x;
+				f->vy[i] = v.y;
+				f->vz[i] = v.z;
+			}
+		}
+		f->px[i] = p.x;
+		f->py[i] = p.y;
+		f->pz[i] = p.z;
+	}
+}
+
+void fluidStep(fluid *f, world *w, scalar dt) {
+	if (f->count == 0) {
+		return;
+	}
+	sortParticles(f);
+	computeDensity(f);
+	computeForces(f);
+	integrate(f, dt);
+	if (w) {
+		collideBodies(f, w);
+	}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "world.h"
+
+//Internal to the library, the hot loops compiled once per instruction set.
+//The base copy targets whatever the library is built for. On x86 with GCC or Clang a second copy is
+//compiled for AVX2 and FMA, worldCreate picks it when the CPU has both. VISCO_NO_DISPATCH leaves it out.
+
+#if defined(__AVX2__) && defined(__FMA__)
+#define VISCO_BUILD_AVX2
+#define VISCO_KERNELS_BASE WORLD_KERNELS_AVX2 //the whole build already targets them
+#else
+#define VISCO_KERNELS_BASE WORLD_KERNELS_GENERIC
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && \
+	!defined(VISCO_BUILD_AVX2) && !defined(VISCO_NO_DISPATCH)
+#define VISCO_DISPATCH_AVX2
+//Flattened so everything the kernel calls in its translation unit is compiled for AVX2 as well
+#define VISCO_KERNEL_AVX2 __attribute__((target("avx2,fma"), flatten))
+
+int  shapeCollideCachedAvx2(contact *dest, int maxContacts, const shape *a, const vec3 *posa, const quat *rota,
+	const shape *b, const vec3 *posb, const quat *rotb, gjkCache *cache);
+void shapeGenerateAabbAvx2(aabb *dest, const shape *s, const quat *rot);
+#endif
+
+static inline int viscoKernelsSupported(worldKernels kernels) {
+	if (kernels == VISCO_KERNELS_BASE) {
+		return 1;
+	}
+#ifdef VISCO_DISPATCH_AVX2
+	if (kernels == WORLD_KERNELS_AVX2) {
+		//Also checks the OS saves the AVX registers
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	}
+#endif
+	return 0;
+}
+static inline worldKernels viscoBestKernels(void) {
+	return viscoKernelsSupported(WORLD_KERNELS_AVX2) ? WORLD_KERNELS_AVX2 : VISCO_KERNELS_BASE;
+}
@@ -1,5 +1,8 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include "shape.h"
+#include "kernels.h"
 
 #pragma region Shape_Types
 
@@ -19,14 +22,61 @@ typedef struct box {
 	vec3 size;
 } box;
 
+typedef struct capsule {
+	shape s;
+	scalar radius;
+	scalar halfHeight; //half the distance between the cap centers, along local y
+} capsule;
+
+typedef struct heightfield {
+	shape s;
+	const uint16_t *heights; //borrowed, width * depth samples, row major along x
+	size_t width, depth;
+	scalar spacing;
+	scalar scale, offset;
+	scalar minHeight, maxHeight;
+} heightfield;
+
+typedef struct hull {
+	shape s;
+	size_t count;
+	vec3 *vertices;     //cache line aligned
+	size_t *adjacency;  //count + 1 offsets into neighbors
+	unsigned *neighbors;
+	scalar volume;
+	scalar covariance[6]; //xx, yy, zz, xy, xz, yz at unit density
+} hull;
+
 #pragma endregion Shape_Types
 
+static inline void* allocateShape(size_t size, const viscoAllocator *allocator) {
+	shape *ret = (shape*)viscoAlloc(allocator, size);
+	if (ret) {
+		ret->allocator = allocator ? *allocator : (viscoAllocator){ 0 };
+	}
+	return ret;
+}
 void shapeDestroy(shape *s) {
-	free(s);
+	//The allocator lives in the block it frees
+	viscoAllocator allocator = s->allocator;
+	viscoFree(&allocator, s);
+}
+size_t shapeGetSize(shapeType type) {
+	switch (type) {
+	case SHAPE_PLANE:       return sizeof(plane);
+	case SHAPE_SPHERE:      return sizeof(sphere);
+	case SHAPE_BOX:         return sizeof(box);
+	case SHAPE_CAPSULE:     return sizeof(capsule);
+	case SHAPE_HEIGHTFIELD: return sizeof(heightfield);
+	default:                return 0;
+	}
 }
 
-shape* shapeCreatePlane(const vec3 *n, scalar d) {
-	plane *ret = (plane*)malloc(sizeof(plane));
+shape* shapeCreatePlane(const vec3 *n, scalar d, const viscoAllocator *allocator) {
+	plane *ret = (plane*)allocateShape(sizeof(plane), allocator);
+	if (!ret) {
+		return NULL;
+	}
 
 	ret->s.type = SHAPE_PLANE;
 	ret->s.mass = 0;
@@ -48,8 +98,11 @@ static inline void sphereMass(sphere *s, scalar density) {
 	s->s.mass = 4.f / 3.f * mm_pi * (s->radius * s->radius * s->radius) * density;
 	sphereIntertia(s);
 }
-shape* shapeCreateSphere(scalar r) {
-	sphere *ret = (sphere*)malloc(sizeof(sphere));
+shape* shapeCreateSphere(scalar r, const viscoAllocator *allocator) {
+	sphere *ret = (sphere*)allocateShape(sizeof(sphere), allocator);
+	if (!ret) {
+		return NULL;
+	}
 
 	ret->s.type = SHAPE_SPHERE;
 	ret->s.restitution = 0.2f;
@@ -79,8 +132,11 @@ static inline void boxMass(box *b, scalar density) {
 	b->s.mass = b->size.x * b->size.y * b->size.z * 8 * density;
 	boxIntertia(b);
 }
-shape* shapeCreateBox(const vec3 *size) {
-	box *ret = (box*)malloc(sizeof(box));
+shape* shapeCreateBox(const vec3 *size, const viscoAllocator *allocator) {
+	box *ret = (box*)allocateShape(sizeof(box), allocator);
+	if (!ret) {
+		return NULL;
+	}
 
 	ret->s.type = SHAPE_BOX;
 	ret->s.restitution = 0.2f;
@@ -91,9 +147,484 @@ shape* shapeCreateBox(const vec3 *size) {
 	return (shape*)ret;
 }
 
+static inline void capsuleIntertia(capsule *c) {
+	//Split the mass between the cylinder and the two caps by volume
+	scalar r2 = c->radius * c->radius;
+	scalar h = c->halfHeight * 2;
+	scalar cylinder = mm_pi * r2 * h;
+	scalar caps = 4.f / 3.f * mm_pi * r2 * c->radius;
+	scalar mc = c->s.mass * cylinder / (cylinder + caps);
+	scalar ms = c->s.mass - mc;
+
+	scalar axial = mc * r2 / 2.f + ms * r2 * 2.f / 5.f;
+	scalar side = mc * (h * h / 12.f + r2 / 4.f) + ms * (r2 * 2.f / 5.f + h * h / 4.f + h * c->radius * 3.f / 8.f);
+	c->s.inertiaTensor = (mat3) {
+		side, 0,     0,
+		0,    axial, 0,
+		0,    0,     side
+	};
+	c->s.invInertiaTensor = (mat3) {
+		1.f/side, 0,         0,
+		0,        1.f/axial, 0,
+		0,        0,         1.f/side
+	};
+}
+static inline void capsuleMass(capsule *c, scalar density) {
+	scalar r2 = c->radius * c->radius;
+	c->s.mass = (mm_pi * r2 * c->halfHeight * 2 + 4.f / 3.f * mm_pi * r2 * c->radius) * density;
+	capsuleIntertia(c);
+}
+shape* shapeCreateCapsule(scalar radius, scalar height, const viscoAllocator *allocator) {
+	capsule *ret = (capsule*)allocateShape(sizeof(capsule), allocator);
+	if (!ret) {
+		return NULL;
+	}
+
+	ret->s.type = SHAPE_CAPSULE;
+	ret->s.restitution = 0.2f;
+	ret->s.friction = 0.4f;
+	ret->radius = radius;
+	ret->halfHeight = height * 0.5f;
+	capsuleMass(ret, 1);
+
+	return (shape*)ret;
+}
+
+shape* shapeCreateHeightfield(const uint16_t *heights, size_t width, size_t depth, scalar spacing, scalar scale, scalar offset,
+	const viscoAllocator *allocator) {
+	if (width < 2 || depth < 2) {
+		return NULL;
+	}
+	heightfield *ret = (heightfield*)allocateShape(sizeof(heightfield), allocator);
+	if (!ret) {
+		return NULL;
+	}
+
+	ret->s.type = SHAPE_HEIGHTFIELD;
+	ret->s.mass = 0;
+	ret->s.restitution = 0.2f;
+	ret->s.friction = 0.4f;
+	ret->heights = heights;
+	ret->width = width;
+	ret->depth = depth;
+	ret->spacing = spacing;
+	ret->scale = scale;
+	ret->offset = offset;
+
+	uint16_t min = UINT16_MAX, max = 0;
+	for (size_t i = 0; i < width * depth; i++) {
+		min = heights[i] < min ? heights[i] : min;
+		max = heights[i] > max ? heights[i] : max;
+	}
+	ret->minHeight = offset + scale * mm_min((scalar)min, (scalar)max);
+	ret->maxHeight = offset + scale * mm_max((scalar)min, (scalar)max);
+
+	return (shape*)ret;
+}
+
+//Convex hull
+#define HULL_ALIGN 64
+#define HULL_CLIMB_MIN 32 //smaller hulls are searched linearly
+
+typedef struct hull_face {
+	int v[3];
+	vec3 normal;
+	scalar offset;
+} hull_face;
+
+static inline int hullFace(hull_face *f, const vec3 *points, int a, int b, int c) {
+	vec3 ab, ac;
+	vec3Sub(&ab, &points[b], &points[a]);
+	vec3Sub(&ac, &points[c], &points[a]);
+	vec3Cross(&f->normal, &ab, &ac);
+	scalar length = vec3Length(&f->normal);
+	if (length == 0) {
+		return 0;
+	}
+	vec3DivScalar(&f->normal, &f->normal, length);
+	f->v[0] = a;
+	f->v[1] = b;
+	f->v[2] = c;
+	f->offset = vec3Dot(&f->normal, &points[a]);
+	return 1;
+}
+static inline int hullFaceHasEdge(const hull_face *f, int a, int b) {
+	return (f->v[0] == a && f->v[1] == b) ||
+		   (f->v[1] == a && f->v[2] == b) ||
+		   (f->v[2] == a && f->v[0] == b);
+}
+//Incremental hull, returns the amount of faces written to *faces or 0 if the points are flat
+static size_t buildHull(hull_face **faces, const vec3 *points, int count, scalar eps) {
+	//Initial tetrahedron
+	int i0 = 0, i1 = 0, i2 = 0, i3 = 0;
+	scalar best = 0;
+	for (int i = 1; i < count; i++) {
+		vec3 d;
+		vec3Sub(&d, &points[i], &points[i0]);
+		scalar dist = vec3Dot(&d, &d);
+		if (dist > best) {
+			best = dist;
+			i1 = i;
+		}
+	}
+	best = 0;
+	for (int i = 0; i < count; i++) {
+		vec3 ab, ap, c;
+		vec3Sub(&ab, &points[i1], &points[i0]);
+		vec3Sub(&ap, &points[i], &points[i0]);
+		vec3Cross(&c, &ab, &ap);
+		scalar dist = vec3Dot(&c, &c);
+		if (dist > best) {
+			best = dist;
+			i2 = i;
+		}
+	}
+	hull_face base;
+	if (best <= eps * eps || !hullFace(&base, points, i0, i1, i2)) {
+		return 0;
+	}
+	best = 0;
+	for (int i = 0; i < count; i++) {
+		scalar dist = viscoAbs(vec3Dot(&base.normal, &points[i]) - base.offset);
+		if (dist > best) {
+			best = dist;
+			i3 = i;
+		}
+	}
+	if (best <= eps) {
+		return 0;
+	}
+	if (vec3Dot(&base.normal, &points[i3]) - base.offset > 0) {
+		//Keep the base facing away from the apex
+		int t = i1;
+		i1 = i2;
+		i2 = t;
+	}
+
+	size_t size = 0, cap = 64;
+	hull_face *f = (hull_face*)malloc(cap * sizeof(hull_face));
+	hullFace(&f[size++], points, i0, i1, i2);
+	hullFace(&f[size++], points, i0, i3, i1);
+	hullFace(&f[size++], points, i1, i3, i2);
+	hullFace(&f[size++], points, i2, i3, i0);
+
+	int (*horizon)[2] = NULL;
+	size_t horizon_cap = 0;
+	unsigned char *visible = NULL;
+
+	for (int p = 0; p < count; p++) {
+		if (p == i0 || p == i1 || p == i2 || p == i3) {
+			continue;
+		}
+
+		visible = realloc(visible, size);
+		size_t visible_count = 0;
+		for (size_t i = 0; i < size; i++) {
+			visible[i] = vec3Dot(&f[i].normal, &points[p]) - f[i].offset > eps;
+			visible_count += visible[i];
+		}
+		if (visible_count == 0) {
+			continue;
+		}
+
+		//Edges of visible faces without a visible twin
+		size_t horizon_size = 0;
+		for (size_t i = 0; i < size; i++) {
+			if (!visible[i]) {
+				continue;
+			}
+			for (int e = 0; e < 3; e++) {
+				int a = f[i].v[e];
+				int b = f[i].v[(e + 1) % 3];
+				int shared = 0;
+				for (size_t j = 0; j < size && !shared; j++) {
+					shared = visible[j] && hullFaceHasEdge(&f[j], b, a);
+				}
+				if (!shared) {
+					if (horizon_size >= horizon_cap) {
+						horizon_cap = horizon_cap ? horizon_cap * 2 : 32;
+						horizon = realloc(horizon, horizon_cap * sizeof(*horizon));
+					}
+					horizon[horizon_size][0] = a;
+					horizon[horizon_size][1] = b;
+					horizon_size++;
+				}
+			}
+		}
+
+		size_t kept = 0;
+		for (size_t i = 0; i < size; i++) {
+			if (!visible[i]) {
+				f[kept++] = f[i];
+			}
+		}
+		size = kept;
+
+		if (size + horizon_size > cap) {
+			while (size + horizon_size > cap) {
+				cap *= 2;
+			}
+			f = realloc(f, cap * sizeof(hull_face));
+		}
+		for (size_t i = 0; i < horizon_size; i++) {
+			if (hullFace(&f[size], points, horizon[i][0], horizon[i][1], p)) {
+				size++;
+			}
+		}
+	}
+
+	free(horizon);
+	free(visible);
+	*faces = f;
+	return size;
+}
+
+static inline void* carve(unsigned char **cursor, size_t size) {
+	uintptr_t p = ((uintptr_t)*cursor + HULL_ALIGN - 1) & ~(uintptr_t)(HULL_ALIGN - 1);
+	*cursor = (unsigned char*)p + size;
+	return (void*)p;
+}
+static inline void hullIntertia(hull *h) {
+	//Inertia from the unit density covariance, I = tr(C) - C
+	const scalar *c = h->covariance;
+	scalar density = h->volume > 0 ? h->s.mass / h->volume : 0;
+	scalar trace = c[0] + c[1] + c[2];
+
+	scalar ixx = density * (trace - c[0]), iyy = density * (trace - c[1]), izz = density * (trace - c[2]);
+	scalar ixy = -density * c[3], ixz = -density * c[4], iyz = -density * c[5];
+	h->s.inertiaTensor = (mat3) {
+		ixx, ixy, ixz,
+		ixy, iyy, iyz,
+		ixz, iyz, izz
+	};
+
+	//Inverse of a symmetric matrix from its cofactors
+	scalar cxx = iyy * izz - iyz * iyz;
+	scalar cxy = ixz * iyz - ixy * izz;
+	scalar cxz = ixy * iyz - ixz * iyy;
+	scalar det = ixx * cxx + ixy * cxy + ixz * cxz;
+	scalar inv = det != 0 ? 1.f / det : 0;
+	scalar cyy = ixx * izz - ixz * ixz;
+	scalar cyz = ixy * ixz - ixx * iyz;
+	scalar czz = ixx * iyy - ixy * ixy;
+	h->s.invInertiaTensor = (mat3) {
+		cxx * inv, cxy * inv, cxz * inv,
+		cxy * inv, cyy * inv, cyz * inv,
+		cxz * inv, cyz * inv, czz * inv
+	};
+}
+static inline void hullMass(hull *h, scalar density) {
+	h->s.mass = h->volume * density;
+	hullIntertia(h);
+}
+static hull* allocateHull(size_t vertex_count, size_t neighbor_count, const viscoAllocator *allocator) {
+	unsigned char *data = allocateShape(sizeof(hull) + HULL_ALIGN * 3 +
+		vertex_count * sizeof(vec3) + (vertex_count + 1) * sizeof(size_t) + neighbor_count * sizeof(unsigned), allocator);
+	if (!data) {
+		return NULL;
+	}
+	hull *ret = (hull*)data;
+	unsigned char *cursor = &data[sizeof(hull)];
+	ret->vertices  = (vec3*)carve(&cursor, vertex_count * sizeof(vec3));
+	ret->adjacency = (size_t*)carve(&cursor, (vertex_count + 1) * sizeof(size_t));
+	ret->neighbors = (unsigned*)carve(&cursor, neighbor_count * sizeof(unsigned));
+	ret->count = vertex_count;
+
+	ret->s.type = SHAPE_HULL;
+	ret->s.restitution = 0.2f;
+	ret->s.friction = 0.4f;
+	return ret;
+}
+shape* shapeCreateHull(const vec3 *points, size_t count, const viscoAllocator *allocator) {
+	if (count < 4) {
+		return NULL;
+	}
+
+	//Deduplicate the input
+	aabb bounds = { points[0], points[0] };
+	for (size_t i = 1; i < count; i++) {
+		aabb p = { points[i], points[i] };
+		aabbAdd(&bounds, &bounds, &p);
+	}
+	vec3 extent;
+	vec3Sub(&extent, &bounds.max, &bounds.min);
+	scalar eps = vec3Length(&extent) * 1e-5f;
+
+	vec3 *unique = (vec3*)malloc(count * sizeof(vec3));
+	int unique_count = 0;
+	for (size_t i = 0; i < count; i++) {
+		int duplicate = 0;
+		for (int j = 0; j < unique_count && !duplicate; j++) {
+			vec3 d;
+			vec3Sub(&d, &points[i], &unique[j]);
+			duplicate = vec3Dot(&d, &d) <= eps * eps;
+		}
+		if (!duplicate) {
+			unique[unique_count++] = points[i];
+		}
+	}
+
+	hull_face *faces;
+	size_t face_count = unique_count >= 4 ? buildHull(&faces, unique, unique_count, eps) : 0;
+	if (face_count == 0) {
+		free(unique);
+		return NULL;
+	}
+
+	//Keep only the vertices on the hull
+	int *remap = (int*)malloc(unique_count * sizeof(int));
+	size_t *degree = (size_t*)calloc(unique_count, sizeof(size_t));
+	for (int i = 0; i < unique_count; i++) {
+		remap[i] = -1;
+	}
+	size_t vertex_count = 0;
+	for (size_t i = 0; i < face_count; i++) {
+		for (int e = 0; e < 3; e++) {
+			int v = faces[i].v[e];
+			if (remap[v] < 0) {
+				remap[v] = (int)vertex_count++;
+			}
+			//Every directed edge of a closed hull appears once
+			degree[v]++;
+		}
+	}
+
+	//Construction scratch stays on the heap, only the final block comes from the allocator
+	hull *ret = allocateHull(vertex_count, face_count * 3, allocator);
+	if (!ret) {
+		free(remap);
+		free(degree);
+		free(faces);
+		free(unique);
+		return NULL;
+	}
+
+	ret->adjacency[0] = 0;
+	for (int i = 0; i < unique_count; i++) {
+		if (remap[i] >= 0) {
+			ret->vertices[remap[i]] = unique[i];
+			ret->adjacency[remap[i] + 1] = degree[i];
+		}
+	}
+	for (size_t i = 0; i < vertex_count; i++) {
+		ret->adjacency[i + 1] += ret->adjacency[i];
+	}
+	memset(degree, 0, unique_count * sizeof(size_t));
+	for (size_t i = 0; i < face_count; i++) {
+		for (int e = 0; e < 3; e++) {
+			int a = faces[i].v[e];
+			int b = faces[i].v[(e + 1) % 3];
+			ret->neighbors[ret->adjacency[remap[a]] + degree[a]++] = (unsigned)remap[b];
+		}
+	}
+
+	//Volume, center and covariance from tetrahedrons to the origin
+	scalar volume = 0;
+	vec3 center = vec3Zero;
+	scalar cov[6] = {0};
+	for (size_t i = 0; i < face_count; i++) {
+		const vec3 *a = &unique[faces[i].v[0]];
+		const vec3 *b = &unique[faces[i].v[1]];
+		const vec3 *c = &unique[faces[i].v[2]];
+		vec3 bc;
+		vec3Cross(&bc, b, c);
+		scalar det = vec3Dot(a, &bc);
+
+		volume += det / 6.f;
+		vec3 sum;
+		vec3Add(&sum, a, b);
+		vec3Add(&sum, &sum, c);
+		vec3 weighted;
+		vec3MulScalar(&weighted, &sum, det / 24.f);
+		vec3Add(&center, &center, &weighted);
+
+		const int row[6] = { 0, 1, 2, 0, 0, 1 };
+		const int col[6] = { 0, 1, 2, 1, 2, 2 };
+		for (int k = 0; k < 6; k++) {
+			int r = row[k], q = col[k];
+			cov[k] += det / 120.f * (a->data[r] * a->data[q] + b->data[r] * b->data[q] +
+				c->data[r] * c->data[q] + sum.data[r] * sum.data[q]);
+		}
+	}
+	vec3DivScalar(&center, &center, volume);
+	{
+		//Move the covariance to the center
+		const int row[6] = { 0, 1, 2, 0, 0, 1 };
+		const int col[6] = { 0, 1, 2, 1, 2, 2 };
+		for (int k = 0; k < 6; k++) {
+			ret->covariance[k] = cov[k] - volume * center.data[row[k]] * center.data[col[k]];
+		}
+	}
+	ret->volume = volume;
+
+	//Hulls are centered on their center of mass
+	for (size_t i = 0; i < vertex_count; i++) {
+		vec3Sub(&ret->vertices[i], &ret->vertices[i], &center);
+	}
+	hullMass(ret, 1);
+
+	free(remap);
+	free(degree);
+	free(faces);
+	free(unique);
+	return (shape*)ret;
+}
+
+static inline size_t hullSupportIndex(const hull *h, const vec3 *dir, size_t start) {
+	if (h->count < HULL_CLIMB_MIN) {
+		size_t best = 0;
+		scalar max = vec3Dot(&h->vertices[0], dir);
+		for (size_t i = 1; i < h->count; i++) {
+			scalar d = vec3Dot(&h->vertices[i], dir);
+			if (d > max) {
+				max = d;
+				best = i;
+			}
+		}
+		return best;
+	} else {
+		//Hill climbing over the hull edges
+		size_t best = start;
+		scalar max = vec3Dot(&h->vertices[best], dir);
+		int improved = 1;
+		while (improved) {
+			improved = 0;
+			for (size_t n = h->adjacency[best]; n < h->adjacency[best + 1]; n++) {
+				size_t v = h->neighbors[n];
+				scalar d = vec3Dot(&h->vertices[v], dir);
+				if (d > max) {
+					max = d;
+					best = v;
+					improved = 1;
+				}
+			}
+		}
+		return best;
+	}
+}
+static inline void genHullAabb(aabb *dest, const hull *h, const quat *rot) {
+	static const vec3 axes[3] = {
+		{1, 0, 0},
+		{0, 1, 0},
+		{0, 0, 1}
+	};
+	quat reverse;
+	quatInverse(&reverse, rot);
+	for (int i = 0; i < 3; i++) {
+		vec3 dir, neg, p;
+		quatMulVec3(&dir, &reverse, &axes[i]);
+		vec3Negate(&neg, &dir);
+		quatMulVec3(&p, rot, &h->vertices[hullSupportIndex(h, &dir, 0)]);
+		dest->max.data[i] = p.data[i];
+		quatMulVec3(&p, rot, &h->vertices[hullSupportIndex(h, &neg, 0)]);
+		dest->min.data[i] = p.data[i];
+	}
+}
+
 void shapeSetDensity(shape *s, scalar density) {
 	switch (s->type) {
 	case SHAPE_PLANE:
+	case SHAPE_HEIGHTFIELD:
 		return;
 
 	case SHAPE_SPHERE:
@@ -103,11 +634,20 @@ void shapeSetDensity(shape *s, scalar density) {
 	case SHAPE_BOX:
 		boxMass((box*)s, density);
 		return;
+
+	case SHAPE_CAPSULE:
+		capsuleMass((capsule*)s, density);
+		return;
+
+	case SHAPE_HULL:
+		hullMass((hull*)s, density);
+		return;
 	}
 }
 void shapeRecalcIntertia(shape *s) {
 	switch (s->type) {
 	case SHAPE_PLANE:
+	case SHAPE_HEIGHTFIELD:
 		return;
 
 	case SHAPE_SPHERE:
@@ -117,9 +657,273 @@ void shapeRecalcIntertia(shape *s) {
 	case SHAPE_BOX:
 		boxIntertia((box*)s);
 		return;
+
+	case SHAPE_CAPSULE:
+		capsuleIntertia((capsule*)s);
+		return;
+
+	case SHAPE_HULL:
+		hullIntertia((hull*)s);
+		return;
+	}
+}
+
+#pragma region Serialization
+
+//A definition is the shapeType, the shape fields then the fields of the type. Heightfield samples
+//start on an 8 byte boundary of the definition so they can be read in place.
+#define SERIAL_ALIGN 8
+
+typedef struct shape_writer {
+	unsigned char *dest;
+	size_t size, used;
+} shape_writer;
+
+typedef struct shape_reader {
+	const unsigned char *src;
+	size_t size, used;
+	int failed;
+} shape_reader;
+
+static inline void put(shape_writer *w, const void *data, size_t size) {
+	if (w->used + size <= w->size) {
+		memcpy(&w->dest[w->used], data, size);
+	}
+	w->used += size;
+}
+static inline void putScalars(shape_writer *w, const scalar *data, size_t count) {
+	put(w, data, count * sizeof(scalar));
+}
+static inline void putSize(shape_writer *w, size_t value) {
+	uint64_t v = value;
+	put(w, &v, sizeof(v));
+}
+static inline void putAlign(shape_writer *w) {
+	static const unsigned char zero[SERIAL_ALIGN] = {0};
+	put(w, zero, (SERIAL_ALIGN - w->used % SERIAL_ALIGN) % SERIAL_ALIGN);
+}
+
+static inline const void* get(shape_reader *r, size_t size) {
+	if (r->failed || size > r->size - r->used) {
+		r->failed = 1;
+		return NULL;
+	}
+	const void *ret = &r->src[r->used];
+	r->used += size;
+	return ret;
+}
+static inline void getScalars(shape_reader *r, scalar *dest, size_t count) {
+	const void *p = get(r, count * sizeof(scalar));
+	if (p) {
+		memcpy(dest, p, count * sizeof(scalar));
+	} else {
+		memset(dest, 0, count * sizeof(scalar));
+	}
+}
+static inline size_t getSize(shape_reader *r) {
+	uint64_t v = 0;
+	const void *p = get(r, sizeof(v));
+	if (p) {
+		memcpy(&v, p, sizeof(v));
+	}
+	return (size_t)v;
+}
+static inline void getAlign(shape_reader *r) {
+	get(r, (SERIAL_ALIGN - r->used % SERIAL_ALIGN) % SERIAL_ALIGN);
+}
+
+size_t shapeSerialize(void *dest, size_t size, const shape *s) {
+	shape_writer w = { (unsigned char*)dest, size, 0 };
+	uint32_t type[2] = { (uint32_t)s->type, 0 };
+	put(&w, type, sizeof(type));
+	putScalars(&w, &s->mass, 1);
+	putScalars(&w, &s->restitution, 1);
+	putScalars(&w, &s->friction, 1);
+	put(&w, &s->inertiaTensor, sizeof(mat3));
+	put(&w, &s->invInertiaTensor, sizeof(mat3));
+
+	switch (s->type) {
+	case SHAPE_PLANE: {
+		const plane *p = (const plane*)s;
+		putScalars(&w, p->normal.data, 3);
+		putScalars(&w, &p->distance, 1);
+		break;
+	}
+	case SHAPE_SPHERE:
+		putScalars(&w, &((const sphere*)s)->radius, 1);
+		break;
+
+	case SHAPE_BOX:
+		putScalars(&w, ((const box*)s)->size.data, 3);
+		break;
+
+	case SHAPE_CAPSULE: {
+		const capsule *c = (const capsule*)s;
+		putScalars(&w, &c->radius, 1);
+		putScalars(&w, &c->halfHeight, 1);
+		break;
+	}
+	case SHAPE_HEIGHTFIELD: {
+		const heightfield *h = (const heightfield*)s;
+		putSize(&w, h->width);
+		putSize(&w, h->depth);
+		putScalars(&w, &h->spacing, 1);
+		putScalars(&w, &h->scale, 1);
+		putScalars(&w, &h->offset, 1);
+		putAlign(&w);
+		put(&w, h->heights, h->width * h->depth * sizeof(uint16_t));
+		break;
+	}
+	case SHAPE_HULL: {
+		//Stored as built so the replayed hull searches its vertices the same way
+		const hull *h = (const hull*)s;
+		putSize(&w, h->count);
+		putSize(&w, h->adjacency[h->count]);
+		for (size_t i = 0; i < h->count; i++) {
+			putScalars(&w, h->vertices[i].data, 3);
+		}
+		for (size_t i = 0; i <= h->count; i++) {
+			putSize(&w, h->adjacency[i]);
+		}
+		put(&w, h->neighbors, h->adjacency[h->count] * sizeof(unsigned));
+		putScalars(&w, &h->volume, 1);
+		putScalars(&w, h->covariance, 6);
+		break;
+	}
+	default:
+		return 0;
+	}
+	putAlign(&w);
+	return w.used;
+}
+
+shape* shapeDeserialize(const void *src, size_t size, const viscoAllocator *allocator) {
+	shape_reader r = { (const unsigned char*)src, size, 0, 0 };
+	uint32_t type[2] = { 0 };
+	const void *header = get(&r, sizeof(type));
+	if (header) {
+		memcpy(type, header, sizeof(type));
+	}
+	shape common;
+	getScalars(&r, &common.mass, 1);
+	getScalars(&r, &common.restitution, 1);
+	getScalars(&r, &common.friction, 1);
+	const void *inertia = get(&r, sizeof(mat3));
+	const void *invInertia = get(&r, sizeof(mat3));
+	if (r.failed) {
+		return NULL;
+	}
+
+	shape *ret = NULL;
+	switch ((shapeType)type[0]) {
+	case SHAPE_PLANE: {
+		vec3 n;
+		scalar d;
+		getScalars(&r, n.data, 3);
+		getScalars(&r, &d, 1);
+		ret = shapeCreatePlane(&vec3YAxis, d, allocator);
+		if (ret) {
+			((plane*)ret)->normal = n;
+		}
+		break;
+	}
+	case SHAPE_SPHERE: {
+		scalar radius;
+		getScalars(&r, &radius, 1);
+		ret = shapeCreateSphere(radius, allocator);
+		break;
+	}
+	case SHAPE_BOX: {
+		vec3 half;
+		getScalars(&r, half.data, 3);
+		ret = shapeCreateBox(&half, allocator);
+		if (ret) {
+			((box*)ret)->size = half;
+		}
+		break;
+	}
+	case SHAPE_CAPSULE: {
+		scalar radius, halfHeight;
+		getScalars(&r, &radius, 1);
+		getScalars(&r, &halfHeight, 1);
+		ret = shapeCreateCapsule(radius, 0, allocator);
+		if (ret) {
+			((capsule*)ret)->halfHeight = halfHeight;
+		}
+		break;
+	}
+	case SHAPE_HEIGHTFIELD: {
+		size_t width = getSize(&r);
+		size_t depth = getSize(&r);
+		scalar spacing, scale, offset;
+		getScalars(&r, &spacing, 1);
+		getScalars(&r, &scale, 1);
+		getScalars(&r, &offset, 1);
+		getAlign(&r);
+		if (r.failed || (depth && width > SIZE_MAX / sizeof(uint16_t) / depth)) {
+			return NULL;
+		}
+		const uint16_t *heights = (const uint16_t*)get(&r, width * depth * sizeof(uint16_t));
+		if (!heights) {
+			return NULL;
+		}
+		ret = shapeCreateHeightfield(heights, width, depth, spacing, scale, offset, allocator);
+		break;
+	}
+	case SHAPE_HULL: {
+		size_t count = getSize(&r);
+		size_t neighbors = getSize(&r);
+		//shapeCreateHull never builds hulls with fewer points
+		if (r.failed || count < 4 || count > size / (sizeof(scalar) * 3) || neighbors > size / sizeof(unsigned)) {
+			return NULL;
+		}
+		hull *h = allocateHull(count, neighbors, allocator);
+		if (!h) {
+			return NULL;
+		}
+		for (size_t i = 0; i < count; i++) {
+			getScalars(&r, h->vertices[i].data, 3);
+		}
+		for (size_t i = 0; i <= count; i++) {
+			h->adjacency[i] = getSize(&r);
+			if (h->adjacency[i] > neighbors) {
+				r.failed = 1;
+			}
+		}
+		const void *n = get(&r, neighbors * sizeof(unsigned));
+		if (n) {
+			memcpy(h->neighbors, n, neighbors * sizeof(unsigned));
+		}
+		for (size_t i = 0; i < neighbors && !r.failed; i++) {
+			if (h->neighbors[i] >= count) {
+				r.failed = 1;
+			}
+		}
+		getScalars(&r, &h->volume, 1);
+		getScalars(&r, h->covariance, 6);
+		ret = (shape*)h;
+		break;
+	}
+	default:
+		return NULL;
+	}
+
+	if (ret && r.failed) {
+		shapeDestroy(ret);
+		return NULL;
 	}
+	if (ret) {
+		ret->mass = common.mass;
+		ret->restitution = common.restitution;
+		ret->friction = common.friction;
+		memcpy(&ret->inertiaTensor, inertia, sizeof(mat3));
+		memcpy(&ret->invInertiaTensor, invInertia, sizeof(mat3));
+	}
+	return ret;
 }
 
+#pragma endregion Serialization
+
 static inline void genSphereAabb(aabb *dest, const sphere *s) {
 	*dest = (aabb){
 		{-s->radius,-s->radius,-s->radius },
@@ -127,30 +931,27 @@ static inline void genSphereAabb(aabb *dest, const sphere *s) {
 	};
 }
 static inline void genBoxAabb(aabb *dest, const box *b, const quat *rot) {
-	vec3 corners[8] = {
-		{-b->size.x,-b->size.y,-b->size.z},
-		{-b->size.x,-b->size.y, b->size.z},
-		{-b->size.x, b->size.y,-b->size.z},
-		{-b->size.x, b->size.y, b->size.z},
-		{ b->size.x,-b->size.y,-b->size.z},
-		{ b->size.x,-b->size.y, b->size.z},
-		{ b->size.x, b->size.y,-b->size.z},
-		{ b->size.x, b->size.y, b->size.z},
+	//Extents of a rotated box are |R| * size, R from the unit quaternion
+	const scalar x = rot->x, y = rot->y, z = rot->z, w = rot->w;
+	const scalar r[3][3] = {
+		{ 1 - 2 * (y * y + z * z), 2 * (x * y - z * w),     2 * (x * z + y * w)     },
+		{ 2 * (x * y + z * w),     1 - 2 * (x * x + z * z), 2 * (y * z - x * w)     },
+		{ 2 * (x * z - y * w),     2 * (y * z + x * w),     1 - 2 * (x * x + y * y) }
 	};
-	vec3 min = {0}, max = {0};
-	for (int i = 0; i < 8; i++) {
-		vec3 temp;
-		quatMulVec3(&temp, rot, &corners[i]);
-		for (int j = 0; j < 3; j++) {
-			if (temp.data[j] > max.data[j]) {
-				max.data[j] = temp.data[j];
-			} else if (temp.data[j] < min.data[j]){
-				min.data[j] = temp.data[j];
-			}
-		}
+	for (int i = 0; i < 3; i++) {
+		scalar extent = viscoAbs(r[i][0]) * b->size.x + viscoAbs(r[i][1]) * b->size.y + viscoAbs(r[i][2]) * b->size.z;
+		dest->min.data[i] = -extent;
+		dest->max.data[i] = extent;
+	}
+}
+static inline void genCapsuleAabb(aabb *dest, const capsule *c, const quat *rot) {
+	vec3 axis;
+	quatMulVec3(&axis, rot, &vec3YAxis);
+	for (int i = 0; i < 3; i++) {
+		scalar extent = viscoAbs(axis.data[i]) * c->halfHeight + c->radius;
+		dest->min.data[i] = -extent;
+		dest->max.data[i] = extent;
 	}
-	dest->max = max;
-	dest->min = min;
 }
 
 void shapeGenerateAabb(aabb *dest, const shape *s, const quat *rot) {
@@ -166,11 +967,35 @@ void shapeGenerateAabb(aabb *dest, const shape *s, const quat *rot) {
 	case SHAPE_BOX:
 		genBoxAabb(dest, (const box*)s, rot);
 		return;
+
+	case SHAPE_CAPSULE:
+		genCapsuleAabb(dest, (const capsule*)s, rot);
+		return;
+
+	case SHAPE_HEIGHTFIELD: {
+		//Placed like planes, relative to the body and not rotated
+		const heightfield *h = (const heightfield*)s;
+		*dest = (aabb){
+			{ 0, h->minHeight, 0 },
+			{ (scalar)(h->width - 1) * h->spacing, h->maxHeight, (scalar)(h->depth - 1) * h->spacing }
+		};
+		return;
+	}
+
+	case SHAPE_HULL:
+		genHullAabb(dest, (const hull*)s, rot);
+		return;
 	}
 }
 
-static inline int collidePlaneSphere(contact *dest, const plane *p, const sphere *b, const vec3 *posb) {
-	scalar dist = vec3Dot(posb, &p->normal) - p->distance;
+static inline scalar planeDistance(const plane *p, const vec3 *posp, const vec3 *pos) {
+	//Planes are placed relative to their body but are not rotated
+	vec3 rel;
+	vec3Sub(&rel, pos, posp);
+	return vec3Dot(&rel, &p->normal) - p->distance;
+}
+static inline int collidePlaneSphere(contact *dest, const plane *p, const vec3 *posp, const sphere *b, const vec3 *posb) {
+	scalar dist = planeDistance(p, posp, posb);
 
 	if (dist > -b->radius && dist < b->radius) {
 		dest->normal = p->normal;
@@ -184,8 +1009,8 @@ static inline int collidePlaneSphere(contact *dest, const plane *p, const sphere
 		return 0;
 	}
 }
-static inline int collidePlaneBox(contact *dest, int max, const plane *p, const box *b, const vec3 *posb, const quat *rotb) {
-	scalar dist = vec3Dot(posb, &p->normal) - p->distance;
+static inline int collidePlaneBox(contact *dest, int max, const plane *p, const vec3 *posp, const box *b, const vec3 *posb, const quat *rotb) {
+	scalar dist = planeDistance(p, posp, posb);
 	scalar corner = vec3Length(&b->size);
 	if (dist > corner || dist < -corner) {
 		return 0;
@@ -308,18 +1133,1489 @@ static inline int collideBoxSphere(contact *dest, const box *a, const vec3 *posa
 		return 1;
 	}
 }
-int shapeCollide(contact *dest, int maxContacts, const shape *a, const vec3 *posa, const quat *rota,
-				 const shape *b, const vec3 *posb, const quat *rotb) {
+static inline scalar boxProjectedRadius(const box *b, const quat *rot, const vec3 *axis) {
+	quat reverse;
+	quatInverse(&reverse, rot);
+	vec3 local;
+	quatMulVec3(&local, &reverse, axis);
+	return viscoAbs(local.x) * b->size.x + viscoAbs(local.y) * b->size.y + viscoAbs(local.z) * b->size.z;
+}
+static inline int overlapPlaneSphere(const plane *p, const vec3 *posp, const sphere *b, const vec3 *posb) {
+	return planeDistance(p, posp, posb) < b->radius;
+}
+static inline int overlapPlaneBox(const plane *p, const vec3 *posp, const box *b, const vec3 *posb, const quat *rotb) {
+	return planeDistance(p, posp, posb) < boxProjectedRadius(b, rotb, &p->normal);
+}
+static inline int overlapSphereSphere(const sphere *a, const vec3 *posa, const sphere *b, const vec3 *posb) {
+	vec3 t;
+	vec3Sub(&t, posb, posa);
+	scalar radius = a->radius + b->radius;
+	return vec3Dot(&t, &t) <= radius * radius;
+}
+static inline int overlapBoxSphere(const box *a, const vec3 *posa, const quat *rota, const sphere *b, const vec3 *posb) {
+	vec3 relative;
+	vec3Sub(&relative, posb, posa);
+	quat reverse;
+	quatInverse(&reverse, rota);
+	quatMulVec3(&relative, &reverse, &relative);
+
+	aabb box = {
+		{-a->size.x, -a->size.y, -a->size.z},
+		{ a->size.x,  a->size.y,  a->size.z}
+	};
+
+	vec3 closest;
+	aabbClosestPoint(&closest, &box, &relative);
+	vec3 dir;
+	vec3Sub(&dir, &relative, &closest);
+	return vec3Dot(&dir, &dir) <= b->radius * b->radius;
+}
+static inline int overlapBoxBox(const box *a, const vec3 *posa, const quat *rota, const box *b, const vec3 *posb, const quat *rotb) {
+	//Separating axis test on the 15 candidate axes
+	static const vec3 local[3] = {
+		{1, 0, 0},
+		{0, 1, 0},
+		{0, 0, 1}
+	};
+	vec3 axes[15];
+	for (int i = 0; i < 3; i++) {
+		quatMulVec3(&axes[i],     rota, &local[i]);
+		quatMulVec3(&axes[3 + i], rotb, &local[i]);
+	}
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			vec3Cross(&axes[6 + i * 3 + j], &axes[i], &axes[3 + j]);
+		}
+	}
+
+	vec3 t;
+	vec3Sub(&t, posb, posa);
+
+	for (int i = 0; i < 15; i++) {
+		if (vec3Dot(&axes[i], &axes[i]) < 1e-6f) {
+			//Parallel edges
+			continue;
+		}
+		scalar dist = viscoAbs(vec3Dot(&t, &axes[i]));
+		if (dist > boxProjectedRadius(a, rota, &axes[i]) + boxProjectedRadius(b, rotb, &axes[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+//Capsules, every test reduces to the closest points of the cap segments
+#define CAPSULE_EPSILON 1e-6f
+
+static inline scalar clampUnit(scalar t) {
+	return mm_min(mm_max(t, 0), 1);
+}
+static inline void capsuleSegment(vec3 *p0, vec3 *p1, const capsule *c, const vec3 *pos, const quat *rot) {
+	vec3 axis;
+	quatMulVec3(&axis, rot, &vec3YAxis);
+	vec3MulScalar(&axis, &axis, c->halfHeight);
+	vec3Sub(p0, pos, &axis);
+	vec3Add(p1, pos, &axis);
+}
+static inline scalar closestOnSegment(vec3 *dest, const vec3 *p0, const vec3 *p1, const vec3 *point) {
+	vec3 d, rel;
+	vec3Sub(&d, p1, p0);
+	vec3Sub(&rel, point, p0);
+	scalar length = vec3Dot(&d, &d);
+	scalar t = length > 0 ? clampUnit(vec3Dot(&rel, &d) / length) : 0;
+	vec3MulScalar(dest, &d, t);
+	vec3Add(dest, dest, p0);
+	return t;
+}
+static inline void closestSegmentSegment(vec3 *ca, vec3 *cb, const vec3 *p0, const vec3 *p1, const vec3 *q0, const vec3 *q1) {
+	vec3 d1, d2, r;
+	vec3Sub(&d1, p1, p0);
+	vec3Sub(&d2, q1, q0);
+	vec3Sub(&r, p0, q0);
+	scalar a = vec3Dot(&d1, &d1);
+	scalar e = vec3Dot(&d2, &d2);
+	scalar f = vec3Dot(&d2, &r);
+
+	if (a <= CAPSULE_EPSILON) {
+		*ca = *p0;
+		closestOnSegment(cb, q0, q1, p0);
+		return;
+	}
+	scalar c = vec3Dot(&d1, &r);
+	if (e <= CAPSULE_EPSILON) {
+		*cb = *q0;
+		closestOnSegment(ca, p0, p1, q0);
+		return;
+	}
+
+	scalar b = vec3Dot(&d1, &d2);
+	scalar denom = a * e - b * b;
+	scalar s;
+	if (denom <= CAPSULE_EPSILON * a * e) {
+		//Parallel, take the middle of the overlapping range so resting capsules do not get a lever arm
+		scalar t0 = clampUnit(-c / a);
+		scalar t1 = clampUnit((b - c) / a);
+		s = (t0 + t1) * 0.5f;
+	} else {
+		s = clampUnit((b * f - c * e) / denom);
+	}
+	scalar t = (b * s + f) / e;
+	if (t < 0) {
+		t = 0;
+		s = clampUnit(-c / a);
+	} else if (t > 1) {
+		t = 1;
+		s = clampUnit((b - c) / a);
+	}
+
+	vec3MulScalar(ca, &d1, s);
+	vec3Add(ca, ca, p0);
+	vec3MulScalar(cb, &d2, t);
+	vec3Add(cb, cb, q0);
+}
+//Contact between two spheres swept along their segments, normal points from a to b.
+//fallback is used when the cores touch and the closest points give no direction.
+static inline int collideRoundedPoints(contact *dest, const vec3 *ca, scalar ra, const vec3 *cb, scalar rb, const vec3 *fallback) {
+	vec3 t;
+	vec3Sub(&t, cb, ca);
+	scalar radius = ra + rb;
+	scalar distance = vec3Length(&t);
+	if (distance > radius) {
+		return 0;
+	}
+	if (distance < CAPSULE_EPSILON) {
+		dest->normal = *fallback;
+	} else {
+		vec3DivScalar(&dest->normal, &t, distance);
+	}
+	dest->distance = radius - distance;
+	vec3 offset;
+	vec3MulScalar(&offset, &dest->normal, ra);
+	vec3Add(&dest->position, ca, &offset);
+	return 1;
+}
+static inline int collidePlaneCapsule(contact *dest, const plane *p, const vec3 *posp, const capsule *c, const vec3 *posb, const quat *rotb) {
+	vec3 ends[2];
+	capsuleSegment(&ends[0], &ends[1], c, posb, rotb);
+
+	vec3 pos = vec3Zero;
+	dest->distance = 0;
+	int contacts = 0;
+	for (int i = 0; i < 2; i++) {
+		scalar pointDist = planeDistance(p, posp, &ends[i]) - c->radius;
+		if (pointDist <= 0) {
+			vec3 point;
+			vec3MulScalar(&point, &p->normal, -c->radius);
+			vec3Add(&point, &point, &ends[i]);
+			vec3Add(&pos, &pos, &point);
+			dest->distance -= pointDist;
+			contacts++;
+		}
+	}
+	if (contacts) {
+		vec3DivScalar(&dest->position, &pos, (scalar)contacts);
+		dest->distance /= (scalar)contacts;
+		dest->normal = p->normal;
+		return 1;
+	} else {
+		return 0;
+	}
+}
+static inline int collideSphereCapsule(contact *dest, const sphere *a, const vec3 *posa, const capsule *b, const vec3 *posb, const quat *rotb) {
+	vec3 p0, p1, closest;
+	capsuleSegment(&p0, &p1, b, posb, rotb);
+	closestOnSegment(&closest, &p0, &p1, posa);
+	return collideRoundedPoints(dest, posa, a->radius, &closest, b->radius, &vec3YAxis);
+}
+static inline int collideCapsuleCapsule(contact *dest, const capsule *a, const vec3 *posa, const quat *rota, const capsule *b, const vec3 *posb, const quat *rotb) {
+	vec3 p0, p1, q0, q1, ca, cb;
+	capsuleSegment(&p0, &p1, a, posa, rota);
+	capsuleSegment(&q0, &q1, b, posb, rotb);
+	closestSegmentSegment(&ca, &cb, &p0, &p1, &q0, &q1);
+
+	//Crossing segments separate along their common perpendicular
+	vec3 da, db, fallback, centers;
+	vec3Sub(&da, &p1, &p0);
+	vec3Sub(&db, &q1, &q0);
+	vec3Cross(&fallback, &da, &db);
+	vec3Sub(&centers, posb, posa);
+	if (vec3Dot(&fallback, &fallback) < CAPSULE_EPSILON) {
+		fallback = vec3YAxis;
+	} else {
+		vec3Normalize(&fallback, &fallback);
+		if (vec3Dot(&fallback, &centers) < 0) {
+			vec3Negate(&fallback, &fallback);
+		}
+	}
+	return collideRoundedPoints(dest, &ca, a->radius, &cb, b->radius, &fallback);
+}
+//Squared distance between a box and a segment in box space. The distance is piecewise
+//quadratic in t with breaks where the segment crosses a slab, so each piece is solved exactly.
+static scalar boxSegmentDistance(scalar *dest, const box *b, const vec3 *p0, const vec3 *d) {
+	scalar breaks[8];
+	int count = 0;
+	breaks[count++] = 0;
+	for (int i = 0; i < 3; i++) {
+		if (d->data[i] == 0) {
+			continue;
+		}
+		for (int sign = -1; sign <= 1; sign += 2) {
+			scalar t = (sign * b->size.data[i] - p0->data[i]) / d->data[i];
+			if (t > 0 && t < 1) {
+				//Insertion sort, there are at most 6 crossings
+				int k = count++;
+				for (; k > 0 && breaks[k - 1] > t; k--) {
+					breaks[k] = breaks[k - 1];
+				}
+				breaks[k] = t;
+			}
+		}
+	}
+	breaks[count++] = 1;
+
+	//The distance is convex, so the minimizers form one range, report its middle
+	scalar best = INFINITY;
+	scalar lo = 0, hi = 0;
+	for (int k = 0; k + 1 < count; k++) {
+		scalar t0 = breaks[k], t1 = breaks[k + 1];
+		scalar mid = (t0 + t1) * 0.5f;
+		scalar qa = 0, qb = 0, qc = 0;
+		for (int i = 0; i < 3; i++) {
+			scalar x = p0->data[i] + mid * d->data[i];
+			scalar face;
+			if (x > b->size.data[i]) {
+				face = b->size.data[i];
+			} else if (x < -b->size.data[i]) {
+				face = -b->size.data[i];
+			} else {
+				continue;
+			}
+			scalar o = p0->data[i] - face;
+			qa += d->data[i] * d->data[i];
+			qb += 2 * d->data[i] * o;
+			qc += o * o;
+		}
+
+		scalar t, from, to;
+		if (qa > CAPSULE_EPSILON) {
+			t = from = to = mm_min(mm_max(-qb / (2 * qa), t0), t1);
+		} else if (viscoAbs(qb) > CAPSULE_EPSILON) {
+			t = from = to = qb > 0 ? t0 : t1;
+		} else {
+			//Flat, lying along a face
+			t = t0;
+			from = t0;
+			to = t1;
+		}
+		scalar dist = (qa * t + qb) * t + qc;
+		if (dist < best - CAPSULE_EPSILON) {
+			best = dist;
+			lo = from;
+			hi = to;
+		} else if (dist <= best + CAPSULE_EPSILON) {
+			lo = mm_min(lo, from);
+			hi = mm_max(hi, to);
+		}
+	}
+	*dest = (lo + hi) * 0.5f;
+	return mm_max(best, 0);
+}
+static inline void capsuleToBox(vec3 *p0, vec3 *d, const vec3 *posa, const quat *rota, const capsule *b, const vec3 *posb, const quat *rotb) {
+	quat reverse;
+	quatInverse(&reverse, rota);
+	vec3 e0, e1;
+	capsuleSegment(&e0, &e1, b, posb, rotb);
+	vec3Sub(&e0, &e0, posa);
+	vec3Sub(&e1, &e1, posa);
+	quatMulVec3(p0, &reverse, &e0);
+	quatMulVec3(&e1, &reverse, &e1);
+	vec3Sub(d, &e1, p0);
+}
+static inline int collideBoxCapsule(contact *dest, const box *a, const vec3 *posa, const quat *rota, const capsule *b, const vec3 *posb, const quat *rotb) {
+	vec3 p0, d;
+	capsuleToBox(&p0, &d, posa, rota, b, posb, rotb);
+
+	scalar t;
+	scalar dist = boxSegmentDistance(&t, a, &p0, &d);
+	if (dist > b->radius * b->radius) {
+		return 0;
+	}
+
+	aabb bounds = {
+		{-a->size.x, -a->size.y, -a->size.z},
+		{ a->size.x,  a->size.y,  a->size.z}
+	};
+	vec3 point, closest, normal;
+	if (dist > CAPSULE_EPSILON) {
+		//Only the rounded part touches
+		vec3MulScalar(&point, &d, t);
+		vec3Add(&point, &point, &p0);
+		aabbClosestPoint(&closest, &bounds, &point);
+		vec3Sub(&normal, &point, &closest);
+		dist = mm_sqrt(dist);
+		vec3DivScalar(&normal, &normal, dist);
+		dest->distance = b->radius - dist;
+	} else {
+		//The segment enters the box, push it out through the face needing the least travel
+		scalar tin = 0, tout = 1;
+		for (int i = 0; i < 3; i++) {
+			if (d.data[i] == 0) {
+				continue;
+			}
+			scalar ta = (-a->size.data[i] - p0.data[i]) / d.data[i];
+			scalar tb = ( a->size.data[i] - p0.data[i]) / d.data[i];
+			tin = mm_max(tin, mm_min(ta, tb));
+			tout = mm_min(tout, mm_max(ta, tb));
+		}
+		if (tin > tout) {
+			//Grazing a face, within the tolerance of the distance test
+			tin = tout = t;
+		}
+		vec3 e1;
+		vec3Add(&e1, &p0, &d);
+
+		scalar best = INFINITY;
+		int axis = 0;
+		scalar side = 1;
+		for (int i = 0; i < 3; i++) {
+			for (int sign = -1; sign <= 1; sign += 2) {
+				scalar depth = a->size.data[i] - mm_min(sign * p0.data[i], sign * e1.data[i]);
+				if (depth < best) {
+					best = depth;
+					axis = i;
+					side = (scalar)sign;
+				}
+			}
+		}
+
+		scalar s0 = side * p0.data[axis];
+		scalar s1 = side * e1.data[axis];
+		scalar at;
+		if (viscoAbs(s0 - s1) < 1e-3f) {
+			at = (tin + tout) * 0.5f;
+		} else {
+			at = s0 < s1 ? tin : tout;
+		}
+		vec3MulScalar(&point, &d, at);
+		vec3Add(&point, &point, &p0);
+		aabbClosestPoint(&closest, &bounds, &point);
+		closest.data[axis] = side * a->size.data[axis];
+
+		normal = vec3Zero;
+		normal.data[axis] = side;
+		dest->distance = best + b->radius;
+	}
+
+	quatMulVec3(&dest->normal, rota, &normal);
+	quatMulVec3(&closest, rota, &closest);
+	vec3Add(&dest->position, &closest, posa);
+	return 1;
+}
+static inline int overlapPlaneCapsule(const plane *p, const vec3 *posp, const capsule *c, const vec3 *posb, const quat *rotb) {
+	vec3 p0, p1;
+	capsuleSegment(&p0, &p1, c, posb, rotb);
+	return mm_min(planeDistance(p, posp, &p0), planeDistance(p, posp, &p1)) < c->radius;
+}
+static inline int overlapSphereCapsule(const sphere *a, const vec3 *posa, const capsule *b, const vec3 *posb, const quat *rotb) {
+	vec3 p0, p1, closest;
+	capsuleSegment(&p0, &p1, b, posb, rotb);
+	closestOnSegment(&closest, &p0, &p1, posa);
+	vec3 t;
+	vec3Sub(&t, &closest, posa);
+	scalar radius = a->radius + b->radius;
+	return vec3Dot(&t, &t) <= radius * radius;
+}
+static inline int overlapCapsuleCapsule(const capsule *a, const vec3 *posa, const quat *rota, const capsule *b, const vec3 *posb, const quat *rotb) {
+	vec3 p0, p1, q0, q1, ca, cb;
+	capsuleSegment(&p0, &p1, a, posa, rota);
+	capsuleSegment(&q0, &q1, b, posb, rotb);
+	closestSegmentSegment(&ca, &cb, &p0, &p1, &q0, &q1);
+	vec3 t;
+	vec3Sub(&t, &cb, &ca);
+	scalar radius = a->radius + b->radius;
+	return vec3Dot(&t, &t) <= radius * radius;
+}
+static inline int overlapBoxCapsule(const box *a, const vec3 *posa, const quat *rota, const capsule *b, const vec3 *posb, const quat *rotb) {
+	vec3 p0, d;
+	capsuleToBox(&p0, &d, posa, rota, b, posb, rotb);
+	scalar t;
+	return boxSegmentDistance(&t, a, &p0, &d) <= b->radius * b->radius;
+}
+//Heightfield, contacts only look at the cells under the other shape
+static inline scalar hfSample(const heightfield *h, size_t x, size_t z) {
+	return h->offset + h->scale * (scalar)h->heights[z * h->width + x];
+}
+static inline void hfPoint(vec3 *dest, const heightfield *h, size_t x, size_t z) {
+	*dest = (vec3){ (scalar)x * h->spacing, hfSample(h, x, z), (scalar)z * h->spacing };
+}
+//Range of cells or samples covering [min, max] on one axis, returns 0 if it misses the grid
+static inline int hfRange(size_t *first, size_t *last, scalar min, scalar max, scalar spacing, size_t count) {
+	scalar extent = (scalar)(count - 1);
+	scalar lo = floor(min / spacing);
+	scalar hi = floor(max / spacing);
+	if (hi < 0 || lo > extent) {
+		return 0;
+	}
+	*first = (size_t)mm_max(lo, 0);
+	*last = (size_t)mm_min(hi, extent);
+	return 1;
+}
+//Triangles of cell (x, z), split along the (x, z) to (x + 1, z + 1) diagonal and wound up
+static inline void hfCellTriangles(vec3 tris[2][3], const heightfield *h, size_t x, size_t z) {
+	vec3 p00, p10, p01, p11;
+	hfPoint(&p00, h, x, z);
+	hfPoint(&p10, h, x + 1, z);
+	hfPoint(&p01, h, x, z + 1);
+	hfPoint(&p11, h, x + 1, z + 1);
+	tris[0][0] = p00; tris[0][1] = p11; tris[0][2] = p10;
+	tris[1][0] = p00; tris[1][1] = p01; tris[1][2] = p11;
+}
+static inline void triangleNormal(vec3 *dest, const vec3 *tri) {
+	vec3 ab, ac;
+	vec3Sub(&ab, &tri[1], &tri[0]);
+	vec3Sub(&ac, &tri[2], &tri[0]);
+	vec3Cross(dest, &ab, &ac);
+	vec3Normalize(dest, dest);
+}
+//Surface height and normal at a local x, z inside the grid
+static inline scalar hfSurface(vec3 *normal, const heightfield *h, scalar x, scalar z) {
+	scalar gx = x / h->spacing, gz = z / h->spacing;
+	size_t cx = (size_t)mm_min(floor(gx), (scalar)(h->width - 2));
+	size_t cz = (size_t)mm_min(floor(gz), (scalar)(h->depth - 2));
+	scalar fx = gx - (scalar)cx, fz = gz - (scalar)cz;
+
+	vec3 tris[2][3];
+	hfCellTriangles(tris, h, cx, cz);
+	const vec3 *tri = fx > fz ? tris[0] : tris[1];
+	triangleNormal(normal, tri);
+	//Plane through the first corner, the normal always has a y component
+	return tri[0].y - (normal->x * (x - tri[0].x) + normal->z * (z - tri[0].z)) / normal->y;
+}
+static inline void hfVertexNormal(vec3 *dest, const heightfield *h, size_t x, size_t z) {
+	size_t x0 = x > 0 ? x - 1 : x, x1 = x + 1 < h->width ? x + 1 : x;
+	size_t z0 = z > 0 ? z - 1 : z, z1 = z + 1 < h->depth ? z + 1 : z;
+	*dest = (vec3){
+		-(hfSample(h, x1, z) - hfSample(h, x0, z)) / ((scalar)(x1 - x0) * h->spacing),
+		1,
+		-(hfSample(h, x, z1) - hfSample(h, x, z0)) / ((scalar)(z1 - z0) * h->spacing)
+	};
+	vec3Normalize(dest, dest);
+}
+static inline void closestOnTriangle(vec3 *dest, const vec3 *tri, const vec3 *p) {
+	//Voronoi regions of the triangle
+	const vec3 *a = &tri[0], *b = &tri[1], *c = &tri[2];
+	vec3 ab, ac, ap, bp, cp;
+	vec3Sub(&ab, b, a);
+	vec3Sub(&ac, c, a);
+	vec3Sub(&ap, p, a);
+	scalar d1 = vec3Dot(&ab, &ap), d2 = vec3Dot(&ac, &ap);
+	if (d1 <= 0 && d2 <= 0) {
+		*dest = *a;
+		return;
+	}
+	vec3Sub(&bp, p, b);
+	scalar d3 = vec3Dot(&ab, &bp), d4 = vec3Dot(&ac, &bp);
+	if (d3 >= 0 && d4 <= d3) {
+		*dest = *b;
+		return;
+	}
+	vec3 t;
+	scalar vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+		vec3MulScalar(&t, &ab, d1 / (d1 - d3));
+		vec3Add(dest, a, &t);
+		return;
+	}
+	vec3Sub(&cp, p, c);
+	scalar d5 = vec3Dot(&ab, &cp), d6 = vec3Dot(&ac, &cp);
+	if (d6 >= 0 && d5 <= d6) {
+		*dest = *c;
+		return;
+	}
+	scalar vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+		vec3MulScalar(&t, &ac, d2 / (d2 - d6));
+		vec3Add(dest, a, &t);
+		return;
+	}
+	scalar va = d3 * d6 - d5 * d4;
+	if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) {
+		vec3 bc;
+		vec3Sub(&bc, c, b);
+		vec3MulScalar(&t, &bc, (d4 - d3) / ((d4 - d3) + (d5 - d6)));
+		vec3Add(dest, b, &t);
+		return;
+	}
+	scalar denom = 1.f / (va + vb + vc);
+	vec3 u;
+	vec3MulScalar(&t, &ab, vb * denom);
+	vec3MulScalar(&u, &ac, vc * denom);
+	vec3Add(dest, a, &t);
+	vec3Add(dest, dest, &u);
+}
+static int collideHeightfieldSphere(contact *dest, const heightfield *h, const vec3 *posa, const sphere *b, const vec3 *posb) {
+	vec3 center;
+	vec3Sub(&center, posb, posa);
+
+	size_t x0, x1, z0, z1;
+	if (center.y - b->radius > h->maxHeight || center.y + b->radius < h->minHeight ||
+		!hfRange(&x0, &x1, center.x - b->radius, center.x + b->radius, h->spacing, h->width - 1) ||
+		!hfRange(&z0, &z1, center.z - b->radius, center.z + b->radius, h->spacing, h->depth - 1)) {
+		return 0;
+	}
+
+	//Deepest triangle under the sphere
+	scalar best = 0;
+	for (size_t z = z0; z <= z1; z++) {
+		for (size_t x = x0; x <= x1; x++) {
+			vec3 tris[2][3];
+			hfCellTriangles(tris, h, x, z);
+			for (int t = 0; t < 2; t++) {
+				vec3 closest, rel, normal;
+				closestOnTriangle(&closest, tris[t], &center);
+				vec3Sub(&rel, &center, &closest);
+				triangleNormal(&normal, tris[t]);
+
+				scalar dist = vec3Length(&rel);
+				scalar depth;
+				if (vec3Dot(&rel, &normal) < 0) {
+					//Center below the surface
+					depth = b->radius + dist;
+				} else {
+					depth = b->radius - dist;
+					if (dist > 0) {
+						vec3DivScalar(&normal, &rel, dist);
+					}
+				}
+				if (depth > best) {
+					best = depth;
+					dest->normal = normal;
+					vec3Add(&dest->position, &closest, posa);
+					dest->distance = depth;
+				}
+			}
+		}
+	}
+	return best > 0;
+}
+static int collideHeightfieldBox(contact *dest, const heightfield *h, const vec3 *posa, const box *b, const vec3 *posb, const quat *rotb) {
+	aabb bounds;
+	genBoxAabb(&bounds, b, rotb);
+	vec3 center;
+	vec3Sub(&center, posb, posa);
+	aabbAddVec3(&bounds, &bounds, &center);
+
+	size_t x0, x1, z0, z1;
+	if (bounds.min.y > h->maxHeight || bounds.max.y < h->minHeight ||
+		!hfRange(&x0, &x1, bounds.min.x, bounds.max.x, h->spacing, h->width) ||
+		!hfRange(&z0, &z1, bounds.min.z, bounds.max.z, h->spacing, h->depth)) {
+		return 0;
+	}
+
+	vec3 pos = vec3Zero, normal = vec3Zero;
+	dest->distance = 0;
+	int contacts = 0;
+
+	//Box corners below the surface
+	scalar maxX = (scalar)(h->width - 1) * h->spacing, maxZ = (scalar)(h->depth - 1) * h->spacing;
+	for (int i = 0; i < 8; i++) {
+		vec3 corner = {
+			(i & 1) ? b->size.x : -b->size.x,
+			(i & 2) ? b->size.y : -b->size.y,
+			(i & 4) ? b->size.z : -b->size.z
+		};
+		quatMulVec3(&corner, rotb, &corner);
+		vec3Add(&corner, &corner, &center);
+		if (corner.x < 0 || corner.z < 0 || corner.x > maxX || corner.z > maxZ) {
+			continue;
+		}
+		vec3 n;
+		scalar depth = (hfSurface(&n, h, corner.x, corner.z) - corner.y) * n.y;
+		if (depth > 0) {
+			vec3Add(&pos, &pos, &corner);
+			vec3Add(&normal, &normal, &n);
+			dest->distance += depth;
+			contacts++;
+		}
+	}
+
+	//Terrain samples poking into the box
+	quat reverse;
+	quatInverse(&reverse, rotb);
+	for (size_t z = z0; z <= z1; z++) {
+		for (size_t x = x0; x <= x1; x++) {
+			vec3 p, local;
+			hfPoint(&p, h, x, z);
+			if (p.y < bounds.min.y || p.y > bounds.max.y) {
+				continue;
+			}
+			vec3Sub(&local, &p, &center);
+			quatMulVec3(&local, &reverse, &local);
+			if (viscoAbs(local.x) > b->size.x || viscoAbs(local.y) > b->size.y || viscoAbs(local.z) > b->size.z) {
+				continue;
+			}
+			vec3 n, rel;
+			hfVertexNormal(&n, h, x, z);
+			vec3Sub(&rel, &p, &center);
+			vec3Add(&pos, &pos, &p);
+			vec3Add(&normal, &normal, &n);
+			dest->distance += vec3Dot(&rel, &n) + boxProjectedRadius(b, rotb, &n);
+			contacts++;
+		}
+	}
+
+	if (contacts) {
+		vec3DivScalar(&pos, &pos, (scalar)contacts);
+		vec3Add(&dest->position, &pos, posa);
+		vec3Normalize(&dest->normal, &normal);
+		dest->distance /= (scalar)contacts;
+		return 1;
+	} else {
+		return 0;
+	}
+}
+//GJK/EPA, runs on the core of each shape, spheres are a point with a margin
+#define GJK_ITERATIONS 32
+#define EPA_ITERATIONS 32
+#define EPA_MAX_FACES 128
+#define GJK_EPSILON 1e-6f
+
+typedef struct gjk_vertex {
+	vec3 w;    //a - b
+	vec3 a, b; //support points
+	vec3 dir;  //world direction the vertex was found with
+} gjk_vertex;
+
+typedef struct gjk_shape {
+	const shape *s;
+	const vec3 *pos;
+	const quat *rot;
+	quat reverse;
+	size_t hint;
+} gjk_shape;
+
+static inline scalar shapeMargin(const shape *s) {
+	switch (s->type) {
+	case SHAPE_SPHERE:
+		return ((const sphere*)s)->radius;
+	case SHAPE_CAPSULE:
+		return ((const capsule*)s)->radius;
+	default:
+		return 0;
+	}
+}
+static inline void coreSupport(vec3 *dest, gjk_shape *g, const vec3 *dir) {
+	vec3 local;
+	quatMulVec3(&local, &g->reverse, dir);
+
+	switch (g->s->type) {
+	case SHAPE_BOX: {
+		const box *b = (const box*)g->s;
+		local = (vec3){
+			local.x < 0 ? -b->size.x : b->size.x,
+			local.y < 0 ? -b->size.y : b->size.y,
+			local.z < 0 ? -b->size.z : b->size.z
+		};
+		break;
+	}
+	case SHAPE_HULL: {
+		const hull *h = (const hull*)g->s;
+		g->hint = hullSupportIndex(h, &local, g->hint);
+		local = h->vertices[g->hint];
+		break;
+	}
+	case SHAPE_CAPSULE: {
+		scalar half = ((const capsule*)g->s)->halfHeight;
+		local = (vec3){ 0, local.y < 0 ? -half : half, 0 };
+		break;
+	}
+	default:
+		local = vec3Zero;
+		break;
+	}
+
+	quatMulVec3(dest, g->rot, &local);
+	vec3Add(dest, dest, g->pos);
+}
+static inline void gjkSupport(gjk_vertex *dest, gjk_shape *a, gjk_shape *b, const vec3 *dir) {
+	vec3 neg;
+	vec3Negate(&neg, dir);
+	coreSupport(&dest->a, a, dir);
+	coreSupport(&dest->b, b, &neg);
+	vec3Sub(&dest->w, &dest->a, &dest->b);
+	dest->dir = *dir;
+}
+
+//Closest point of a simplex to the origin, the simplex is reduced to the feature holding it
+static inline void gjkReduce(gjk_vertex *v, int *count, scalar *weights, const int *keep, int n) {
+	gjk_vertex temp[4];
+	scalar w[4];
+	for (int i = 0; i < n; i++) {
+		temp[i] = v[keep[i]];
+		w[i] = weights[keep[i]];
+	}
+	for (int i = 0; i < n; i++) {
+		v[i] = temp[i];
+		weights[i] = w[i];
+	}
+	*count = n;
+}
+static void gjkClosestSegment(gjk_vertex *v, int *count, scalar *weights) {
+	vec3 ab;
+	vec3Sub(&ab, &v[1].w, &v[0].w);
+	scalar denom = vec3Dot(&ab, &ab);
+	scalar t = denom > 0 ? -vec3Dot(&v[0].w, &ab) / denom : 0;
+	if (t <= 0) {
+		weights[0] = 1;
+		gjkReduce(v, count, weights, (const int[]){ 0 }, 1);
+	} else if (t >= 1) {
+		weights[1] = 1;
+		gjkReduce(v, count, weights, (const int[]){ 1 }, 1);
+	} else {
+		weights[0] = 1 - t;
+		weights[1] = t;
+	}
+}
+static void gjkClosestTriangle(gjk_vertex *v, int *count, scalar *weights) {
+	//Ericson, closest point on triangle to the origin
+	const vec3 *a = &v[0].w, *b = &v[1].w, *c = &v[2].w;
+	vec3 ab, ac, ap, bp, cp;
+	vec3Sub(&ab, b, a);
+	vec3Sub(&ac, c, a);
+	vec3Negate(&ap, a);
+	vec3Negate(&bp, b);
+	vec3Negate(&cp, c);
+
+	scalar d1 = vec3Dot(&ab, &ap), d2 = vec3Dot(&ac, &ap);
+	if (d1 <= 0 && d2 <= 0) {
+		weights[0] = 1;
+		gjkReduce(v, count, weights, (const int[]){ 0 }, 1);
+		return;
+	}
+	scalar d3 = vec3Dot(&ab, &bp), d4 = vec3Dot(&ac, &bp);
+	if (d3 >= 0 && d4 <= d3) {
+		weights[1] = 1;
+		gjkReduce(v, count, weights, (const int[]){ 1 }, 1);
+		return;
+	}
+	scalar vc = d1 * d4 - d3 * d2;
+	if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+		scalar t = d1 / (d1 - d3);
+		weights[0] = 1 - t;
+		weights[1] = t;
+		gjkReduce(v, count, weights, (const int[]){ 0, 1 }, 2);
+		return;
+	}
+	scalar d5 = vec3Dot(&ab, &cp), d6 = vec3Dot(&ac, &cp);
+	if (d6 >= 0 && d5 <= d6) {
+		weights[2] = 1;
+		gjkReduce(v, count, weights, (const int[]){ 2 }, 1);
+		return;
+	}
+	scalar vb = d5 * d2 - d1 * d6;
+	if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+		scalar t = d2 / (d2 - d6);
+		weights[0] = 1 - t;
+		weights[2] = t;
+		gjkReduce(v, count, weights, (const int[]){ 0, 2 }, 2);
+		return;
+	}
+	scalar va = d3 * d6 - d5 * d4;
+	if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) {
+		scalar t = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+		weights[1] = 1 - t;
+		weights[2] = t;
+		gjkReduce(v, count, weights, (const int[]){ 1, 2 }, 2);
+		return;
+	}
+	if (va + vb + vc <= 0) {
+		//Degenerate triangle
+		gjkReduce(v, count, weights, (const int[]){ 0, 1 }, 2);
+		gjkClosestSegment(v, count, weights);
+		return;
+	}
+	scalar denom = 1.f / (va + vb + vc);
+	weights[1] = vb * denom;
+	weights[2] = vc * denom;
+	weights[0] = 1 - weights[1] - weights[2];
+}
+static inline int originOutsideFace(const vec3 *a, const vec3 *b, const vec3 *c, const vec3 *d) {
+	//Origin and d on opposite sides of abc
+	vec3 ab, ac, n;
+	vec3Sub(&ab, b, a);
+	vec3Sub(&ac, c, a);
+	vec3Cross(&n, &ab, &ac);
+	scalar signOrigin = -vec3Dot(a, &n);
+	vec3 ad;
+	vec3Sub(&ad, d, a);
+	scalar signD = vec3Dot(&ad, &n);
+	return signOrigin * signD < 0;
+}
+static int gjkClosestTetrahedron(gjk_vertex *v, int *count, scalar *weights) {
+	static const int faces[4][4] = {
+		{ 0, 1, 2, 3 },
+		{ 0, 2, 3, 1 },
+		{ 0, 3, 1, 2 },
+		{ 1, 3, 2, 0 }
+	};
+
+	{
+		vec3 ab, ac, ad, n;
+		vec3Sub(&ab, &v[1].w, &v[0].w);
+		vec3Sub(&ac, &v[2].w, &v[0].w);
+		vec3Sub(&ad, &v[3].w, &v[0].w);
+		vec3Cross(&n, &ab, &ac);
+		if (viscoAbs(vec3Dot(&n, &ad)) < GJK_EPSILON * GJK_EPSILON) {
+			//Flat tetrahedron
+			*count = 3;
+			gjkClosestTriangle(v, count, weights);
+			return 0;
+		}
+	}
+
+	scalar best = INFINITY;
+	gjk_vertex bestVertices[3];
+	scalar bestWeights[3];
+	int bestCount = 0;
+
+	for (int f = 0; f < 4; f++) {
+		const int *i = faces[f];
+		if (!originOutsideFace(&v[i[0]].w, &v[i[1]].w, &v[i[2]].w, &v[i[3]].w)) {
+			continue;
+		}
+		gjk_vertex tri[3] = { v[i[0]], v[i[1]], v[i[2]] };
+		scalar w[3] = { 0 };
+		int n = 3;
+		gjkClosestTriangle(tri, &n, w);
+
+		vec3 p = vec3Zero;
+		for (int k = 0; k < n; k++) {
+			vec3 t;
+			vec3MulScalar(&t, &tri[k].w, w[k]);
+			vec3Add(&p, &p, &t);
+		}
+		scalar dist = vec3Dot(&p, &p);
+		if (dist < best) {
+			best = dist;
+			bestCount = n;
+			for (int k = 0; k < n; k++) {
+				bestVertices[k] = tri[k];
+				bestWeights[k] = w[k];
+			}
+		}
+	}
+
+	if (bestCount == 0) {
+		//Origin is inside
+		return 1;
+	}
+	for (int k = 0; k < bestCount; k++) {
+		v[k] = bestVertices[k];
+		weights[k] = bestWeights[k];
+	}
+	*count = bestCount;
+	return 0;
+}
+
+typedef struct gjk_result {
+	gjk_vertex v[4];
+	int count;
+	int intersect;
+	vec3 a, b; //closest points when separated
+	scalar distance;
+} gjk_result;
+
+static void gjk(gjk_result *r, gjk_shape *a, gjk_shape *b, const gjkCache *cache) {
+	gjk_vertex *v = r->v;
+	int count = 0;
+
+	if (cache && cache->count > 0) {
+		//Rebuild the last simplex from the cached directions
+		for (int i = 0; i < cache->count; i++) {
+			vec3 dir;
+			quatMulVec3(&dir, a->rot, &cache->dir[i]);
+			gjkSupport(&v[count], a, b, &dir);
+
+			int duplicate = 0;
+			for (int j = 0; j < count && !duplicate; j++) {
+				vec3 d;
+				vec3Sub(&d, &v[j].w, &v[count].w);
+				duplicate = vec3Dot(&d, &d) < GJK_EPSILON;
+			}
+			count += !duplicate;
+		}
+	} else {
+		vec3 dir;
+		vec3Sub(&dir, b->pos, a->pos);
+		if (vec3Dot(&dir, &dir) < GJK_EPSILON) {
+			dir = vec3YAxis;
+		}
+		gjkSupport(&v[count++], a, b, &dir);
+	}
+
+	scalar weights[4] = { 1, 0, 0, 0 };
+	r->intersect = 0;
+
+	for (int it = 0; it < GJK_ITERATIONS; it++) {
+		switch (count) {
+		case 1:
+			weights[0] = 1;
+			break;
+		case 2:
+			gjkClosestSegment(v, &count, weights);
+			break;
+		case 3:
+			gjkClosestTriangle(v, &count, weights);
+			break;
+		case 4:
+			r->intersect = gjkClosestTetrahedron(v, &count, weights);
+			break;
+		}
+		if (r->intersect) {
+			break;
+		}
+
+		vec3 p = vec3Zero;
+		for (int k = 0; k < count; k++) {
+			vec3 t;
+			vec3MulScalar(&t, &v[k].w, weights[k]);
+			vec3Add(&p, &p, &t);
+		}
+		scalar dist = vec3Dot(&p, &p);
+		if (dist < GJK_EPSILON * GJK_EPSILON) {
+			r->intersect = 1;
+			break;
+		}
+
+		vec3 dir;
+		vec3Negate(&dir, &p);
+		gjk_vertex next;
+		gjkSupport(&next, a, b, &dir);
+
+		//No progress towards the origin, p is the closest point
+		int duplicate = 0;
+		for (int k = 0; k < count && !duplicate; k++) {
+			vec3 d;
+			vec3Sub(&d, &v[k].w, &next.w);
+			duplicate = vec3Dot(&d, &d) < GJK_EPSILON * GJK_EPSILON;
+		}
+		if (duplicate || vec3Dot(&next.w, &dir) - vec3Dot(&p, &dir) <= GJK_EPSILON * mm_sqrt(dist)) {
+			break;
+		}
+		weights[count] = 0;
+		v[count++] = next;
+	}
+
+	r->count = count;
+	r->a = r->b = vec3Zero;
+	for (int k = 0; k < count; k++) {
+		vec3 t;
+		vec3MulScalar(&t, &v[k].a, weights[k]);
+		vec3Add(&r->a, &r->a, &t);
+		vec3MulScalar(&t, &v[k].b, weights[k]);
+		vec3Add(&r->b, &r->b, &t);
+	}
+	vec3 d;
+	vec3Sub(&d, &r->b, &r->a);
+	r->distance = r->intersect ? 0 : vec3Length(&d);
+}
+
+typedef struct epa_face {
+	int v[3];
+	vec3 normal;
+	scalar distance;
+} epa_face;
+
+static inline int epaFace(epa_face *f, const gjk_vertex *v, int a, int b, int c, const vec3 *inside) {
+	vec3 ab, ac;
+	vec3Sub(&ab, &v[b].w, &v[a].w);
+	vec3Sub(&ac, &v[c].w, &v[a].w);
+	vec3Cross(&f->normal, &ab, &ac);
+	scalar length = vec3Length(&f->normal);
+	if (length < GJK_EPSILON) {
+		return 0;
+	}
+	vec3DivScalar(&f->normal, &f->normal, length);
+	f->v[0] = a;
+	f->v[1] = b;
+	f->v[2] = c;
+	//Orient away from a point inside the polytope, the origin may lie on a face
+	vec3 d;
+	vec3Sub(&d, &v[a].w, inside);
+	if (vec3Dot(&f->normal, &d) < 0) {
+		vec3Negate(&f->normal, &f->normal);
+		f->v[1] = c;
+		f->v[2] = b;
+	}
+	f->distance = vec3Dot(&f->normal, &v[a].w);
+	return 1;
+}
+static int epaBlowUp(gjk_vertex *v, int count, gjk_shape *a, gjk_shape *b) {
+	//Grow the final GJK simplex into a tetrahedron
+	static const vec3 axes[6] = {
+		{ 1, 0, 0 }, {-1, 0, 0 },
+		{ 0, 1, 0 }, { 0,-1, 0 },
+		{ 0, 0, 1 }, { 0, 0,-1 }
+	};
+
+	for (int i = 0; i < 6 && count == 1; i++) {
+		gjkSupport(&v[1], a, b, &axes[i]);
+		vec3 d;
+		vec3Sub(&d, &v[1].w, &v[0].w);
+		if (vec3Dot(&d, &d) > GJK_EPSILON) {
+			count = 2;
+		}
+	}
+	if (count == 2) {
+		vec3 d, t1, t2;
+		vec3Sub(&d, &v[1].w, &v[0].w);
+		vec3Normalize(&d, &d);
+		if (viscoAbs(d.x) > 0.57735f) {
+			t1 = (vec3){ d.y, -d.x, 0 };
+		} else {
+			t1 = (vec3){ 0, d.z, -d.y };
+		}
+		vec3Normalize(&t1, &t1);
+		vec3Cross(&t2, &d, &t1);
+		const vec3 *dirs[2] = { &t1, &t2 };
+		for (int i = 0; i < 4 && count == 2; i++) {
+			vec3 dir;
+			vec3MulScalar(&dir, dirs[i / 2], i % 2 ? -1.f : 1.f);
+			gjkSupport(&v[2], a, b, &dir);
+			vec3 ab, ac, n;
+			vec3Sub(&ab, &v[1].w, &v[0].w);
+			vec3Sub(&ac, &v[2].w, &v[0].w);
+			vec3Cross(&n, &ab, &ac);
+			if (vec3Dot(&n, &n) > GJK_EPSILON) {
+				count = 3;
+			}
+		}
+	}
+	if (count == 3) {
+		vec3 ab, ac, n;
+		vec3Sub(&ab, &v[1].w, &v[0].w);
+		vec3Sub(&ac, &v[2].w, &v[0].w);
+		vec3Cross(&n, &ab, &ac);
+		vec3Normalize(&n, &n);
+		for (int i = 0; i < 2 && count == 3; i++) {
+			gjkSupport(&v[3], a, b, &n);
+			vec3 ad;
+			vec3Sub(&ad, &v[3].w, &v[0].w);
+			if (viscoAbs(vec3Dot(&ad, &n)) > GJK_EPSILON) {
+				count = 4;
+			}
+			vec3Negate(&n, &n);
+		}
+	}
+	return count == 4;
+}
+static int epa(contact *dest, gjk_vertex *simplex, int count, gjk_shape *a, gjk_shape *b) {
+	gjk_vertex v[EPA_ITERATIONS + 4];
+	epa_face faces[EPA_MAX_FACES];
+	int edges[EPA_MAX_FACES * 3][2];
+
+	for (int i = 0; i < count; i++) {
+		v[i] = simplex[i];
+	}
+	if (!epaBlowUp(v, count, a, b)) {
+		return 0;
+	}
+
+	vec3 inside = vec3Zero;
+	for (int i = 0; i < 4; i++) {
+		vec3Add(&inside, &inside, &v[i].w);
+	}
+	vec3MulScalar(&inside, &inside, 0.25f);
+
+	int vertex_count = 4;
+	int face_count = 0;
+	face_count += epaFace(&faces[face_count], v, 0, 1, 2, &inside);
+	face_count += epaFace(&faces[face_count], v, 0, 3, 1, &inside);
+	face_count += epaFace(&faces[face_count], v, 0, 2, 3, &inside);
+	face_count += epaFace(&faces[face_count], v, 1, 3, 2, &inside);
+
+	epa_face *closest = NULL;
+	for (int it = 0; it < EPA_ITERATIONS && face_count > 0; it++) {
+		closest = &faces[0];
+		for (int i = 1; i < face_count; i++) {
+			if (faces[i].distance < closest->distance) {
+				closest = &faces[i];
+			}
+		}
+
+		gjk_vertex next;
+		gjkSupport(&next, a, b, &closest->normal);
+		if (vec3Dot(&next.w, &closest->normal) - closest->distance < 1e-4f) {
+			break;
+		}
+
+		//Remove faces seen from the new vertex and patch the hole
+		int w = vertex_count++;
+		v[w] = next;
+		int edge_count = 0;
+		for (int i = 0; i < face_count; i++) {
+			vec3 d;
+			vec3Sub(&d, &next.w, &v[faces[i].v[0]].w);
+			if (vec3Dot(&faces[i].normal, &d) <= 0) {
+				continue;
+			}
+			for (int e = 0; e < 3; e++) {
+				int ea = faces[i].v[e];
+				int eb = faces[i].v[(e + 1) % 3];
+				int twin = -1;
+				for (int k = 0; k < edge_count && twin < 0; k++) {
+					if (edges[k][0] == eb && edges[k][1] == ea) {
+						twin = k;
+					}
+				}
+				if (twin >= 0) {
+					edges[twin][0] = edges[edge_count - 1][0];
+					edges[twin][1] = edges[edge_count - 1][1];
+					edge_count--;
+				} else {
+					edges[edge_count][0] = ea;
+					edges[edge_count][1] = eb;
+					edge_count++;
+				}
+			}
+			faces[i--] = faces[--face_count];
+		}
+		closest = NULL;
+		if (face_count + edge_count > EPA_MAX_FACES) {
+			break;
+		}
+		for (int k = 0; k < edge_count; k++) {
+			face_count += epaFace(&faces[face_count], v, edges[k][0], edges[k][1], w, &inside);
+		}
+		if (vertex_count >= EPA_ITERATIONS + 4) {
+			break;
+		}
+	}
+
+	if (closest == NULL) {
+		if (face_count == 0) {
+			return 0;
+		}
+		closest = &faces[0];
+		for (int i = 1; i < face_count; i++) {
+			if (faces[i].distance < closest->distance) {
+				closest = &faces[i];
+			}
+		}
+	}
+
+	//Contact point from the barycentric coordinates of the origin on the closest face
+	gjk_vertex tri[3] = { v[closest->v[0]], v[closest->v[1]], v[closest->v[2]] };
+	vec3 projected;
+	vec3MulScalar(&projected, &closest->normal, closest->distance);
+	for (int i = 0; i < 3; i++) {
+		vec3Sub(&tri[i].w, &tri[i].w, &projected);
+	}
+	scalar weights[3] = { 0 };
+	int n = 3;
+	gjkClosestTriangle(tri, &n, weights);
+
+	dest->position = vec3Zero;
+	for (int i = 0; i < n; i++) {
+		vec3 t;
+		vec3MulScalar(&t, &tri[i].a, weights[i]);
+		vec3Add(&dest->position, &dest->position, &t);
+	}
+	dest->normal = closest->normal;
+	dest->distance = closest->distance;
+	return 1;
+}
+static inline void gjkShape(gjk_shape *g, const shape *s, const vec3 *pos, const quat *rot) {
+	g->s = s;
+	g->pos = pos;
+	g->rot = rot;
+	g->hint = 0;
+	quatInverse(&g->reverse, rot);
+}
+//Centroid of the vertices of a polytope core within tolerance of its support plane
+static inline int featureCentroid(vec3 *dest, const gjk_shape *g, const vec3 *dir) {
+	vec3 local;
+	quatMulVec3(&local, &g->reverse, dir);
+
+	vec3 corners[8];
+	const vec3 *vertices;
+	size_t count;
+	switch (g->s->type) {
+	case SHAPE_BOX: {
+		const box *b = (const box*)g->s;
+		for (int i = 0; i < 8; i++) {
+			corners[i] = (vec3){
+				(i & 1) ? b->size.x : -b->size.x,
+				(i & 2) ? b->size.y : -b->size.y,
+				(i & 4) ? b->size.z : -b->size.z
+			};
+		}
+		vertices = corners;
+		count = 8;
+		break;
+	}
+	case SHAPE_HULL:
+		vertices = ((const hull*)g->s)->vertices;
+		count = ((const hull*)g->s)->count;
+		break;
+	default:
+		*dest = *g->pos;
+		return 1;
+	}
+
+	scalar max = -INFINITY;
+	for (size_t i = 0; i < count; i++) {
+		max = mm_max(max, vec3Dot(&vertices[i], &local));
+	}
+	vec3 sum = vec3Zero;
+	int n = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (vec3Dot(&vertices[i], &local) >= max - 1e-3f) {
+			vec3Add(&sum, &sum, &vertices[i]);
+			n++;
+		}
+	}
+	vec3DivScalar(&sum, &sum, (scalar)n);
+	quatMulVec3(dest, g->rot, &sum);
+	vec3Add(dest, dest, g->pos);
+	return n;
+}
+static inline void featureContact(contact *dest, const gjk_shape *a, const gjk_shape *b) {
+	//A single EPA point on a face makes resting contacts spin, use the center of the smaller feature instead
+	vec3 neg, ca, cb;
+	vec3Negate(&neg, &dest->normal);
+	int na = featureCentroid(&ca, a, &dest->normal);
+	int nb = featureCentroid(&cb, b, &neg);
+
+	vec3 point;
+	if (na < nb) {
+		point = ca;
+	} else if (nb < na) {
+		point = cb;
+	} else {
+		vec3Add(&point, &ca, &cb);
+		vec3MulScalar(&point, &point, 0.5f);
+	}
+
+	//Move it onto the surface of a
+	scalar offset = vec3Dot(&dest->normal, &dest->position) - vec3Dot(&dest->normal, &point);
+	vec3 t;
+	vec3MulScalar(&t, &dest->normal, offset);
+	vec3Add(&dest->position, &point, &t);
+}
+static int collideGjk(contact *dest, const shape *sa, const vec3 *posa, const quat *rota,
+	const shape *sb, const vec3 *posb, const quat *rotb, gjkCache *cache) {
+
+	gjk_shape a, b;
+	gjkShape(&a, sa, posa, rota);
+	gjkShape(&b, sb, posb, rotb);
+	scalar marginA = shapeMargin(sa);
+	scalar marginB = shapeMargin(sb);
+
+	gjk_result r;
+	gjk(&r, &a, &b, cache);
+
+	if (cache) {
+		//Directions are stored local to a so they follow its rotation
+		cache->count = r.count;
+		for (int i = 0; i < r.count; i++) {
+			quatMulVec3(&cache->dir[i], &a.reverse, &r.v[i].dir);
+		}
+	}
+
+	if (!r.intersect) {
+		if (r.distance > marginA + marginB || r.distance == 0) {
+			return 0;
+		}
+		//Only the margins overlap
+		vec3Sub(&dest->normal, &r.b, &r.a);
+		vec3DivScalar(&dest->normal, &dest->normal, r.distance);
+		dest->distance = marginA + marginB - r.distance;
+		vec3MulScalar(&dest->position, &dest->normal, marginA);
+		vec3Add(&dest->position, &dest->position, &r.a);
+		return 1;
+	}
+
+	if (!epa(dest, r.v, r.count, &a, &b)) {
+		return 0;
+	}
+	if (marginA == 0 && marginB == 0) {
+		featureContact(dest, &a, &b);
+	}
+	dest->distance += marginA + marginB;
+	vec3 offset;
+	vec3MulScalar(&offset, &dest->normal, marginA);
+	vec3Add(&dest->position, &dest->position, &offset);
+	return 1;
+}
+static int overlapGjk(const shape *sa, const vec3 *posa, const quat *rota,
+	const shape *sb, const vec3 *posb, const quat *rotb) {
+	gjk_shape a, b;
+	gjkShape(&a, sa, posa, rota);
+	gjkShape(&b, sb, posb, rotb);
+
+	gjk_result r;
+	gjk(&r, &a, &b, NULL);
+	return r.intersect || r.distance <= shapeMargin(sa) + shapeMargin(sb);
+}
+
+static inline int collidePlaneHull(contact *dest, const plane *p, const vec3 *posp, const hull *h, const vec3 *posb, const quat *rotb) {
+	scalar dist = planeDistance(p, posp, posb);
+	quat reverse;
+	quatInverse(&reverse, rotb);
+	vec3 normal;
+	quatMulVec3(&normal, &reverse, &p->normal);
+
+	vec3 down;
+	vec3Negate(&down, &normal);
+	size_t deepest = hullSupportIndex(h, &down, 0);
+	if (vec3Dot(&h->vertices[deepest], &normal) + dist > 0) {
+		return 0;
+	}
+
+	vec3 pos = vec3Zero;
+	dest->distance = 0;
+	int contacts = 0;
+	for (size_t i = 0; i < h->count; i++) {
+		scalar pointDist = vec3Dot(&h->vertices[i], &normal) + dist;
+		if (pointDist <= 0) {
+			vec3 point;
+			quatMulVec3(&point, rotb, &h->vertices[i]);
+			vec3Add(&point, &point, posb);
+			vec3Add(&pos, &pos, &point);
+			dest->distance += pointDist;
+			contacts++;
+		}
+	}
+	vec3DivScalar(&dest->position, &pos, (scalar)contacts);
+	dest->distance /= -((scalar)contacts);
+	dest->normal = p->normal;
+	return 1;
+}
+static inline int overlapPlaneHull(const plane *p, const vec3 *posp, const hull *h, const vec3 *posb, const quat *rotb) {
+	quat reverse;
+	quatInverse(&reverse, rotb);
+	vec3 down;
+	quatMulVec3(&down, &reverse, &p->normal);
+	vec3Negate(&down, &down);
+	return -vec3Dot(&h->vertices[hullSupportIndex(h, &down, 0)], &down) + planeDistance(p, posp, posb) < 0;
+}
+static inline int overlapHeightfield(const heightfield *h, const vec3 *posa, const shape *b, const vec3 *posb, const quat *rotb) {
+	contact c;
+	switch (b->type) {
+	case SHAPE_SPHERE:
+		return collideHeightfieldSphere(&c, h, posa, (const sphere*)b, posb);
+	case SHAPE_BOX:
+		return collideHeightfieldBox(&c, h, posa, (const box*)b, posb, rotb);
+	default:
+		return 0;
+	}
+}
+
+int shapeOverlap(const shape *a, const vec3 *posa, const quat *rota,
+				 const shape *b, const vec3 *posb, const quat *rotb) {
 
 	switch (a->type) {
 	case SHAPE_PLANE:
+		switch (b->type) {
+		case SHAPE_SPHERE:
+			return overlapPlaneSphere((const plane*)a, posa, (const sphere*)b, posb);
+		case SHAPE_BOX:
+			return overlapPlaneBox((const plane*)a, posa, (const box*)b, posb, rotb);
+		case SHAPE_HULL:
+			return overlapPlaneHull((const plane*)a, posa, (const hull*)b, posb, rotb);
+		case SHAPE_CAPSULE:
+			return overlapPlaneCapsule((const plane*)a, posa, (const capsule*)b, posb, rotb);
+		default:
+			return 0;
+		}
+	case SHAPE_SPHERE:
 		switch (b->type) {
 		case SHAPE_PLANE:
+			return overlapPlaneSphere((const plane*)b, posb, (const sphere*)a, posa);
+		case SHAPE_SPHERE:
+			return overlapSphereSphere((const sphere*)a, posa, (const sphere*)b, posb);
+		case SHAPE_BOX:
+			return overlapBoxSphere((const box*)b, posb, rotb, (const sphere*)a, posa);
+		case SHAPE_HULL:
+			return overlapGjk(a, posa, rota, b, posb, rotb);
+		case SHAPE_CAPSULE:
+			return overlapSphereCapsule((const sphere*)a, posa, (const capsule*)b, posb, rotb);
+		case SHAPE_HEIGHTFIELD:
+			return overlapHeightfield((const heightfield*)b, posb, a, posa, rota);
+		default:
 			return 0;
+		}
+	case SHAPE_BOX:
+		switch (b->type) {
+		case SHAPE_PLANE:
+			return overlapPlaneBox((const plane*)b, posb, (const box*)a, posa, rota);
 		case SHAPE_SPHERE:
-			return collidePlaneSphere(dest, (const plane*)a, (const sphere*)b, posb);
+			return overlapBoxSphere((const box*)a, posa, rota, (const sphere*)b, posb);
 		case SHAPE_BOX:
-			return collidePlaneBox(dest, maxContacts, (const plane*)a, (const box*)b, posb, rotb);
+			return overlapBoxBox((const box*)a, posa, rota, (const box*)b, posb, rotb);
+		case SHAPE_HULL:
+			return overlapGjk(a, posa, rota, b, posb, rotb);
+		case SHAPE_CAPSULE:
+			return overlapBoxCapsule((const box*)a, posa, rota, (const capsule*)b, posb, rotb);
+		case SHAPE_HEIGHTFIELD:
+			return overlapHeightfield((const heightfield*)b, posb, a, posa, rota);
+		default:
+			return 0;
+		}
+	case SHAPE_HULL:
+		switch (b->type) {
+		case SHAPE_PLANE:
+			return overlapPlaneHull((const plane*)b, posb, (const hull*)a, posa, rota);
+		case SHAPE_SPHERE:
+		case SHAPE_BOX:
+		case SHAPE_HULL:
+		case SHAPE_CAPSULE:
+			return overlapGjk(a, posa, rota, b, posb, rotb);
+		default:
+			return 0;
+		}
+	case SHAPE_CAPSULE:
+		switch (b->type) {
+		case SHAPE_PLANE:
+			return overlapPlaneCapsule((const plane*)b, posb, (const capsule*)a, posa, rota);
+		case SHAPE_SPHERE:
+			return overlapSphereCapsule((const sphere*)b, posb, (const capsule*)a, posa, rota);
+		case SHAPE_BOX:
+			return overlapBoxCapsule((const box*)b, posb, rotb, (const capsule*)a, posa, rota);
+		case SHAPE_HULL:
+			return overlapGjk(a, posa, rota, b, posb, rotb);
+		case SHAPE_CAPSULE:
+			return overlapCapsuleCapsule((const capsule*)a, posa, rota, (const capsule*)b, posb, rotb);
+		default:
+			return 0;
+		}
+	case SHAPE_HEIGHTFIELD:
+		return overlapHeightfield((const heightfield*)a, posa, b, posb, rotb);
+	default:
+		return 0;
+	}
+}
+
+int shapeCollide(contact *dest, int maxContacts, const shape *a, const vec3 *posa, const quat *rota,
+				 const shape *b, const vec3 *posb, const quat *rotb) {
+	return shapeCollideCached(dest, maxContacts, a, posa, rota, b, posb, rotb, NULL);
+}
+int shapeCollideCached(contact *dest, int maxContacts, const shape *a, const vec3 *posa, const quat *rota,
+				 const shape *b, const vec3 *posb, const quat *rotb, gjkCache *cache) {
+
+	switch (a->type) {
+	case SHAPE_PLANE:
+		switch (b->type) {
+		case SHAPE_PLANE:
+			return 0;
+		case SHAPE_SPHERE:
+			return collidePlaneSphere(dest, (const plane*)a, posa, (const sphere*)b, posb);
+		case SHAPE_BOX:
+			return collidePlaneBox(dest, maxContacts, (const plane*)a, posa, (const box*)b, posb, rotb);
+		case SHAPE_HULL:
+			return collidePlaneHull(dest, (const plane*)a, posa, (const hull*)b, posb, rotb);
+		case SHAPE_CAPSULE:
+			return collidePlaneCapsule(dest, (const plane*)a, posa, (const capsule*)b, posb, rotb);
 		default:
 			return 0;
 		}
@@ -327,11 +2623,17 @@ int shapeCollide(contact *dest, int maxContacts, const shape *a, const vec3 *pos
 	case SHAPE_SPHERE:
 		switch (b->type) {
 		case SHAPE_PLANE:
-			return -collidePlaneSphere(dest, (const plane*)b, (const sphere*)a, posa);
+			return -collidePlaneSphere(dest, (const plane*)b, posb, (const sphere*)a, posa);
 		case SHAPE_SPHERE:
 			return collideSphereSphere(dest, (const sphere*)a, posa, (const sphere*)b, posb);
 		case SHAPE_BOX:
 			return -collideBoxSphere(dest, (const box*)b, posb, rotb, (const sphere*)a, posa);
+		case SHAPE_HULL:
+			return collideGjk(dest, a, posa, rota, b, posb, rotb, cache);
+		case SHAPE_CAPSULE:
+			return collideSphereCapsule(dest, (const sphere*)a, posa, (const capsule*)b, posb, rotb);
+		case SHAPE_HEIGHTFIELD:
+			return -collideHeightfieldSphere(dest, (const heightfield*)b, posb, (const sphere*)a, posa);
 		default:
 			return 0;
 		}
@@ -339,9 +2641,52 @@ int shapeCollide(contact *dest, int maxContacts, const shape *a, const vec3 *pos
 	case SHAPE_BOX:
 		switch (b->type) {
 		case SHAPE_PLANE:
-			return -collidePlaneBox(dest, maxContacts, (const plane*)b, (const box*)a, posa, rota);
+			return -collidePlaneBox(dest, maxContacts, (const plane*)b, posb, (const box*)a, posa, rota);
 		case SHAPE_SPHERE:
 			return collideBoxSphere(dest, (const box*)a, posa, rota, (const sphere*)b, posb);
+		case SHAPE_BOX:
+		case SHAPE_HULL:
+			return collideGjk(dest, a, posa, rota, b, posb, rotb, cache);
+		case SHAPE_CAPSULE:
+			return collideBoxCapsule(dest, (const box*)a, posa, rota, (const capsule*)b, posb, rotb);
+		case SHAPE_HEIGHTFIELD:
+			return -collideHeightfieldBox(dest, (const heightfield*)b, posb, (const box*)a, posa, rota);
+		default:
+			return 0;
+		}
+	case SHAPE_HULL:
+		switch (b->type) {
+		case SHAPE_PLANE:
+			return -collidePlaneHull(dest, (const plane*)b, posb, (const hull*)a, posa, rota);
+		case SHAPE_SPHERE:
+		case SHAPE_BOX:
+		case SHAPE_HULL:
+		case SHAPE_CAPSULE:
+			return collideGjk(dest, a, posa, rota, b, posb, rotb, cache);
+		default:
+			return 0;
+		}
+	case SHAPE_CAPSULE:
+		switch (b->type) {
+		case SHAPE_PLANE:
+			return -collidePlaneCapsule(dest, (const plane*)b, posb, (const capsule*)a, posa, rota);
+		case SHAPE_SPHERE:
+			return -collideSphereCapsule(dest, (const sphere*)b, posb, (const capsule*)a, posa, rota);
+		case SHAPE_BOX:
+			return -collideBoxCapsule(dest, (const box*)b, posb, rotb, (const capsule*)a, posa, rota);
+		case SHAPE_HULL:
+			return collideGjk(dest, a, posa, rota, b, posb, rotb, cache);
+		case SHAPE_CAPSULE:
+			return collideCapsuleCapsule(dest, (const capsule*)a, posa, rota, (const capsule*)b, posb, rotb);
+		default:
+			return 0;
+		}
+	case SHAPE_HEIGHTFIELD:
+		switch (b->type) {
+		case SHAPE_SPHERE:
+			return collideHeightfieldSphere(dest, (const heightfield*)a, posa, (const sphere*)b, posb);
+		case SHAPE_BOX:
+			return collideHeightfieldBox(dest, (const heightfield*)a, posa, (const box*)b, posb, rotb);
 		default:
 			return 0;
 		}
@@ -349,3 +2694,17 @@ int shapeCollide(contact *dest, int maxContacts, const shape *a, const vec3 *pos
 		return 0;
 	}
 }
+
+#pragma region Kernels
+
+#ifdef VISCO_DISPATCH_AVX2
+VISCO_KERNEL_AVX2 int shapeCollideCachedAvx2(contact *dest, int maxContacts, const shape *a, const vec3 *posa, const quat *rota,
+				 const shape *b, const vec3 *posb, const quat *rotb, gjkCache *cache) {
+	return shapeCollideCached(dest, maxContacts, a, posa, rota, b, posb, rotb, cache);
+}
+VISCO_KERNEL_AVX2 void shapeGenerateAabbAvx2(aabb *dest, const shape *s, const quat *rot) {
+	shapeGenerateAabb(dest, s, rot);
+}
+#endif
+
+#pragma endregion Kernels
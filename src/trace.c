@@ -0,0 +1,370 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L //mmap and ftruncate
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "trace_format.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define TRACE_INITIAL_SIZE (1 << 20)
+
+static inline size_t alignRecord(size_t size) {
+	return (size + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1);
+}
+
+#pragma region Mapping
+
+typedef struct trace_map {
+	unsigned char *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file, mapping;
+#else
+	int file;
+#endif
+} trace_map;
+
+static int openMap(trace_map *m, const char *path, int writable) {
+	memset(m, 0, sizeof(trace_map));
+#ifdef _WIN32
+	m->file = CreateFileA(path, writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+		writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	return m->file != INVALID_HANDLE_VALUE;
+#else
+	m->file = writable ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path, O_RDONLY);
+	return m->file >= 0;
+#endif
+}
+static void unmap(trace_map *m) {
+	if (!m->data) {
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(m->data);
+	CloseHandle(m->mapping);
+#else
+	munmap(m->data, m->size);
+#endif
+	m->data = NULL;
+}
+//Maps size bytes, writable maps grow the file to size first
+static int map(trace_map *m, size_t size, int writable) {
+	unmap(m);
+#ifdef _WIN32
+	LARGE_INTEGER s;
+	s.QuadPart = (LONGLONG)size;
+	m->mapping = CreateFileMappingA(m->file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, s.HighPart, s.LowPart, NULL);
+	if (!m->mapping) {
+		return 0;
+	}
+	m->data = (unsigned char*)MapViewOfFile(m->mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+	if (!m->data) {
+		CloseHandle(m->mapping);
+		return 0;
+	}
+#else
+	if (writable && ftruncate(m->file, (off_t)size) != 0) {
+		return 0;
+	}
+	void *data = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, m->file, 0);
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+	m->data = (unsigned char*)data;
+#endif
+	m->size = size;
+	return 1;
+}
+//Unmaps and cuts the file to size when it was written
+static void closeMap(trace_map *m, size_t size, int writable) {
+	unmap(m);
+#ifdef _WIN32
+	if (writable) {
+		LARGE_INTEGER s;
+		s.QuadPart = (LONGLONG)size;
+		SetFilePointerEx(m->file, s, NULL, FILE_BEGIN);
+		SetEndOfFile(m->file);
+	}
+	CloseHandle(m->file);
+#else
+	//When the file cannot be cut the zeroed tail still reads as the end of the trace
+	int cut = writable ? ftruncate(m->file, (off_t)size) : 0;
+	(void)cut;
+	close(m->file);
+#endif
+}
+static size_t fileSize(trace_map *m) {
+#ifdef _WIN32
+	LARGE_INTEGER s;
+	return GetFileSizeEx(m->file, &s) ? (size_t)s.QuadPart : 0;
+#else
+	struct stat s;
+	return fstat(m->file, &s) == 0 ? (size_t)s.st_size : 0;
+#endif
+}
+
+#pragma endregion Mapping
+
+#pragma region Recording
+
+//Shapes already written, open addressing on the pointer
+typedef struct trace_shape {
+	const shape *s;
+	uint32_t id;
+	size_t offset, size; //definition in the file
+} trace_shape;
+
+struct world_trace {
+	trace_map map;
+	size_t used;
+	int failed; //the mapping could not grow, nothing more is written
+
+	trace_shape *shapes;
+	size_t shape_size, shape_cap;
+	uint32_t shape_ids;
+};
+
+world_trace* traceOpen(const char *path) {
+	world_trace *ret = (world_trace*)calloc(1, sizeof(world_trace));
+	if (!ret) {
+		return NULL;
+	}
+	if (!openMap(&ret->map, path, 1)) {
+		free(ret);
+		return NULL;
+	}
+	if (!map(&ret->map, TRACE_INITIAL_SIZE, 1)) {
+		closeMap(&ret->map, 0, 1);
+		free(ret);
+		return NULL;
+	}
+
+	trace_header header = { TRACE_MAGIC, TRACE_VERSION, (uint32_t)sizeof(scalar), (uint32_t)sizeof(vec3) };
+	memcpy(ret->map.data, &header, sizeof(header));
+	ret->used = alignRecord(sizeof(header));
+	return ret;
+}
+void traceClose(world_trace *t) {
+	closeMap(&t->map, t->used, 1);
+	free(t->shapes);
+	free(t);
+}
+
+//Room for size more bytes at the end of the trace, the mapping moves when it grows
+static unsigned char* reserve(world_trace *t, size_t size) {
+	if (t->failed) {
+		return NULL;
+	}
+	if (size > t->map.size - t->used) {
+		size_t grown = t->map.size;
+		while (size > grown - t->used) {
+			grown *= 2;
+		}
+		if (!map(&t->map, grown, 1)) {
+			t->failed = 1;
+			return NULL;
+		}
+	}
+	return &t->map.data[t->used];
+}
+
+void traceWrite(world_trace *t, traceRecordType type, const void *payload, size_t size) {
+	size_t total = sizeof(trace_record) + alignRecord(size);
+	unsigned char *p = reserve(t, total);
+	if (!p) {
+		return;
+	}
+	//Fresh pages are zero, so is the padding
+	trace_record r = { (uint32_t)type, (uint32_t)size };
+	memcpy(p, &r, sizeof(r));
+	if (size) {
+		memcpy(p + sizeof(r), payload, size);
+	}
+	t->used += total;
+}
+
+static inline size_t shapeSlot(const trace_shape *shapes, size_t cap, const shape *s) {
+	size_t i = (size_t)(((uintptr_t)s >> 4) * 0x9E3779B1u) & (cap - 1);
+	while (shapes[i].s && shapes[i].s != s) {
+		i = (i + 1) & (cap - 1);
+	}
+	return i;
+}
+static int growShapes(world_trace *t) {
+	size_t cap = t->shape_cap ? t->shape_cap * 2 : 64;
+	trace_shape *shapes = (trace_shape*)calloc(cap, sizeof(trace_shape));
+	if (!shapes) {
+		return 0;
+	}
+	for (size_t i = 0; i < t->shape_cap; i++) {
+		if (t->shapes[i].s) {
+			shapes[shapeSlot(shapes, cap, t->shapes[i].s)] = t->shapes[i];
+		}
+	}
+	free(t->shapes);
+	t->shapes = shapes;
+	t->shape_cap = cap;
+	return 1;
+}
+
+uint32_t traceShape(world_trace *t, const shape *s) {
+	size_t size = s ? shapeSerialize(NULL, 0, s) : 0;
+	if (size == 0) {
+		return TRACE_NO_SHAPE;
+	}
+	if ((t->shape_size + 1) * 2 > t->shape_cap && !growShapes(t)) {
+		return TRACE_NO_SHAPE;
+	}
+
+	//Serialize straight into the trace, the record is only kept when the definition is new
+	const size_t header = sizeof(trace_record) + TRACE_ALIGN;
+	size_t payload = TRACE_ALIGN + size;
+	unsigned char *p = reserve(t, header + alignRecord(size));
+	if (!p) {
+		return TRACE_NO_SHAPE;
+	}
+	unsigned char *definition = p + header;
+	shapeSerialize(definition, size, s);
+
+	trace_shape *entry = &t->shapes[shapeSlot(t->shapes, t->shape_cap, s)];
+	if (entry->s && entry->size == size && memcmp(&t->map.data[entry->offset], definition, size) == 0) {
+		//Past the end of the trace has to stay zero to read as its end
+		memset(definition, 0, size);
+		return entry->id;
+	}
+	if (!entry->s) {
+		t->shape_size++;
+		entry->s = s;
+		entry->id = t->shape_ids++;
+	}
+	entry->offset = t->used + header;
+	entry->size = size;
+
+	trace_record r = { TRACE_SHAPE, (uint32_t)payload };
+	uint32_t id[2] = { entry->id, 0 };
+	memcpy(p, &r, sizeof(r));
+	memcpy(p + sizeof(r), id, sizeof(id));
+	t->used += header + alignRecord(size);
+	return entry->id;
+}
+
+#pragma endregion Recording
+
+#pragma region Replay
+
+struct traceReplay {
+	trace_map map;
+	size_t cursor;
+
+	shape **shapes;
+	size_t shape_cap;
+};
+
+traceReplay* traceReplayOpen(const char *path) {
+	traceReplay *ret = (traceReplay*)calloc(1, sizeof(traceReplay));
+	if (!ret) {
+		return NULL;
+	}
+	if (!openMap(&ret->map, path, 0)) {
+		free(ret);
+		return NULL;
+	}
+
+	size_t size = fileSize(&ret->map);
+	trace_header header;
+	if (size < sizeof(header) || !map(&ret->map, size, 0)) {
+		closeMap(&ret->map, 0, 0);
+		free(ret);
+		return NULL;
+	}
+	memcpy(&header, ret->map.data, sizeof(header));
+	if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+		header.scalar_size != sizeof(scalar) || header.vec3_size != sizeof(vec3)) {
+		closeMap(&ret->map, 0, 0);
+		free(ret);
+		return NULL;
+	}
+	ret->cursor = alignRecord(sizeof(header));
+	return ret;
+}
+void traceReplayClose(traceReplay *r) {
+	for (size_t i = 0; i < r->shape_cap; i++) {
+		if (r->shapes[i]) {
+			shapeDestroy(r->shapes[i]);
+		}
+	}
+	free(r->shapes);
+	closeMap(&r->map, 0, 0);
+	free(r);
+}
+
+static int addShape(traceReplay *r, world *w, const unsigned char *payload, size_t size) {
+	uint32_t id;
+	if (size < TRACE_ALIGN) {
+		return 0;
+	}
+	memcpy(&id, payload, sizeof(id));
+	if (id >= r->shape_cap) {
+		size_t cap = r->shape_cap ? r->shape_cap : 64;
+		while (cap <= id) {
+			cap *= 2;
+		}
+		shape **shapes = (shape**)realloc(r->shapes, cap * sizeof(shape*));
+		if (!shapes) {
+			return 0;
+		}
+		memset(&shapes[r->shape_cap], 0, (cap - r->shape_cap) * sizeof(shape*));
+		r->shapes = shapes;
+		r->shape_cap = cap;
+	}
+	shape *old = r->shapes[id];
+	r->shapes[id] = shapeDeserialize(payload + TRACE_ALIGN, size - TRACE_ALIGN, NULL);
+	if (old) {
+		//Bodies sharing the shape saw it change
+		worldTraceReplaceShape(w, old, r->shapes[id]);
+		shapeDestroy(old);
+	}
+	return 1;
+}
+
+int traceReplayNext(traceReplay *r, world **w, scalar *delta) {
+	const size_t size = r->map.size;
+	while (sizeof(trace_record) <= size - r->cursor) {
+		trace_record record;
+		memcpy(&record, &r->map.data[r->cursor], sizeof(record));
+		const unsigned char *payload = &r->map.data[r->cursor + sizeof(record)];
+		if (record.type == TRACE_END || record.size > size - r->cursor - sizeof(record)) {
+			return 0;
+		}
+		r->cursor += sizeof(record) + alignRecord(record.size);
+		r->cursor = r->cursor < size ? r->cursor : size;
+
+		if (record.type == TRACE_SHAPE) {
+			if (!addShape(r, *w, payload, record.size)) {
+				return 0;
+			}
+			continue;
+		}
+
+		int result = worldTraceApply(w, (traceRecordType)record.type, payload, record.size, r->shapes, r->shape_cap, delta);
+		if (result < 0) {
+			return 0;
+		}
+		if (result > 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#pragma endregion Replay
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include "trace.h"
+
+//Internal to the library, the file layout shared by the recorder and the world
+
+#define TRACE_MAGIC   0x54435356 //VSCT
+#define TRACE_VERSION 2
+#define TRACE_ALIGN   8
+#define TRACE_NO_SHAPE UINT32_MAX
+
+typedef struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t scalar_size; //traces only replay with the precision they were recorded with
+	uint32_t vec3_size;
+} trace_header;
+
+//Every record is followed by size bytes of payload, padded to TRACE_ALIGN
+typedef struct trace_record {
+	uint32_t type;
+	uint32_t size;
+} trace_record;
+
+typedef enum traceRecordType {
+	TRACE_END = 0, //the unwritten end of the mapping is zeroed
+	TRACE_SHAPE,   //uint32 id, 4 bytes of padding then the shapeSerialize definition, an id seen before is a changed shape
+
+	//State when the recording began
+	TRACE_WORLD,
+	TRACE_BODY_STATE,
+	TRACE_BODY_EMPTY,
+	TRACE_JOINT_STATE,
+	TRACE_JOINT_EMPTY,
+	TRACE_GJK_CACHES,
+	TRACE_CONTACT_PAIRS,
+
+	//Calls
+	TRACE_STEP,
+	TRACE_BODY_CREATE,
+	TRACE_BODY_DESTROY,
+	TRACE_BODY_TYPE,
+	TRACE_BODY_FLAGS,
+	TRACE_BODY_POSITION,
+	TRACE_BODY_ORIENTATION,
+	TRACE_BODY_SHAPE,
+	TRACE_BODY_FORCE,
+	TRACE_JOINT_CREATE,
+	TRACE_JOINT_DESTROY,
+	TRACE_JOINT_LIMITS,
+	TRACE_JOINT_MOTOR,
+	TRACE_SOLVER_ITERATIONS,
+	TRACE_REGION_SIZE,
+	TRACE_SHIFT_ORIGIN,
+	TRACE_EVENT_CAPACITY
+} traceRecordType;
+
+typedef struct world_trace world_trace;
+
+world_trace* traceOpen(const char *path);
+void         traceClose(world_trace *trace);
+void         traceWrite(world_trace *trace, traceRecordType type, const void *payload, size_t size);
+//Writes the definition of a shape the first time it is seen or after it changed, returns its id
+uint32_t     traceShape(world_trace *trace, const shape *s);
+
+//Applies one record other than TRACE_SHAPE, in world.c. Returns 1 for a step, -1 when the trace does not match the world.
+int  worldTraceApply(world **world, traceRecordType type, const void *payload, size_t size,
+	shape *const *shapes, size_t shape_count, scalar *delta);
+//Moves every body using a shape to its changed definition
+void worldTraceReplaceShape(world *world, const shape *old, shape *s);
@@ -1,10 +1,33 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 199309L //clock_gettime
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 #include "world.h"
+#include "trace_format.h"
+#include "kernels.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+//Cell of the region grid, positions are stored relative to the origin of one
+typedef struct region_cell {
+	int x, y, z;
+} region_cell;
 
 typedef enum jointType {
 	JOINT_DELETE = 0,
-	JOINT_CONTACT
+	JOINT_CONTACT,
+	JOINT_BALL,
+	JOINT_HINGE,
+	JOINT_SLIDER,
+	JOINT_FIXED,
+	JOINT_DISTANCE
 } jointType;
 typedef struct joint {
 	jointType type;
@@ -12,15 +35,221 @@ typedef struct joint {
 } joint;
 typedef struct contact_joint {
 	joint j;
-	contact contact;
-} contact_joint, joint_max;
+	contact contact; //position relative to the origin of cell
+	region_cell cell;
+	size_t pair; //index into pair_cur, or NO_PAIR
+} contact_joint;
+typedef struct constraint_joint {
+	joint j;
+	vec3 anchorA, anchorB; //local to each body
+	vec3 axisA, axisB;     //local to each body
+	vec3 refA, refB;       //local, perpendicular to the axis
+	quat rel;              //orientation of b relative to a at creation
+	scalar length;
+	scalar lower, upper;
+	scalar speed, maxForce;
+	int limit, motor;
+} constraint_joint;
+typedef union joint_max {
+	joint j;
+	contact_joint contact;
+	constraint_joint constraint;
+} joint_max;
+
+//GJK simplex caches of the pairs from this and the last step
+typedef struct gjk_pair {
+	bodyID lo, hi;
+	gjkCache cache;
+} gjk_pair;
+
+//Solver rows, J = [-linear, -angularA, linear, angularB]
+#define DEFAULT_SOLVER_ITERATIONS 8
+#define JOINT_BAUMGARTE 0.2f
+#define NO_PAIR ((size_t)-1)
+
+typedef struct constraint_row {
+	bodyID a, b;
+	vec3 linear;
+	vec3 angularA, angularB;
+	vec3 invAngularA, invAngularB; //inverse inertia times angular
+	scalar invMassA, invMassB;
+	scalar mass; //effective mass
+	scalar bias;
+	scalar impulse, lower, upper;
+	scalar friction; //friction rows are bounded by friction times the impulse of their normal row
+	size_t normal;   //index of that row
+	size_t pair;     //contact_pair a normal row adds its impulse to, or NO_PAIR
+} constraint_row;
+
+//Every contact point becomes a non-penetration row and two friction rows, solved in the same
+//batches as the joint rows. Approaching faster than CONTACT_BOUNCE_SPEED bounces with the restitution.
+#define CONTACT_BAUMGARTE 0.2f
+#define CONTACT_SLOP 0.01f
+#define CONTACT_BOUNCE_SPEED 1.f
+
+//Constraints are colored so no two in a batch share a dynamic body.
+//The last color collects what did not fit and is solved serially.
+#define SOLVER_COLORS 32
+#define SOLVER_LANES 4
+#define SOLVER_PARALLEL_MIN 64
+#define SOLVER_CHUNK 16 //multiple of SOLVER_LANES
+
+typedef struct solver {
+	constraint_row *rows, *rows_sorted;
+	size_t row_size, row_cap;
+	size_t row_batch[SOLVER_COLORS + 1];
+
+	size_t contact_size; //contact points turned into rows
+
+	unsigned *body_colors;
+	size_t body_colors_cap;
+	unsigned char *colors;
+	size_t *order; //where each row moves when sorted by color
+	size_t colors_cap;
+} solver;
+
+//Contact events
+#define DEFAULT_EVENT_CAPACITY 256
+
+typedef struct contact_pair {
+	bodyID a, b; //same order as the contact normal
+	bodyID lo, hi; //sort key
+	int sensor;    //part of the key, a pair turning into a sensor pair ends and begins again
+	vec3 position;
+	vec3 normal;
+	vec3 velocity;
+	scalar impulse;
+} contact_pair;
 
 //World
 typedef struct accumulator {
 	vec3 vel, avel;
 } accumulator;
+
+//Trace record payloads
+typedef struct trace_world {
+	vec3 gravity;
+	double origin[3];
+	scalar region_size;
+	int32_t solver_iterations;
+	uint64_t event_cap;
+} trace_world;
+
+typedef struct trace_value {
+	uint64_t id;    //body or joint
+	uint64_t value; //type, flags, shape id or a count
+} trace_value;
+
+typedef struct trace_scalar {
+	scalar value;
+} trace_scalar;
+
+typedef struct trace_vec3 {
+	uint64_t body;
+	vec3 v;
+} trace_vec3;
+
+typedef struct trace_quat {
+	uint64_t body;
+	quat q;
+} trace_quat;
+
+typedef struct trace_force {
+	uint64_t body;
+	vec3 pos, force;
+} trace_force;
+
+typedef struct trace_body_state {
+	uint64_t body;
+	uint64_t type, flags, shape;
+	vec3 pos, vel, avel;
+	quat rot;
+	accumulator accum;
+	aabb tight, fat; //position and bounds relative to the origin of cell
+	aabb local;
+	int32_t cell[3];
+} trace_body_state;
+
+typedef struct trace_joint_create {
+	uint64_t joint;
+	uint64_t type, a, b;
+	vec3 anchorA, anchorB, axis; //anchors relative to the origin of cell
+	int32_t cell[3];
+	int32_t has_axis;
+} trace_joint_create;
+
+typedef struct trace_joint_params {
+	uint64_t joint;
+	scalar x, y; //lower and upper, or speed and max force
+	int32_t enabled;
+} trace_joint_params;
+
+//Body layout, by default the state touched by every phase is packed into one
+//cache line per body. Define VISCO_LAYOUT_SOA for one array per field instead.
+#ifdef VISCO_LAYOUT_SOA
+#define BODY_POS(w, i)  ((w)->body_pos[i])
+#define BODY_VEL(w, i)  ((w)->body_vel[i])
+#define BODY_ROT(w, i)  ((w)->body_rot[i])
+#define BODY_AVEL(w, i) ((w)->body_avel[i])
+#else
+typedef struct body_state {
+	vec3 pos;
+	vec3 vel;
+	quat rot;
+	vec3 avel;
+	scalar pad[3]; //64 bytes with floats
+} body_state;
+
+#define BODY_POS(w, i)  ((w)->body_hot[i].pos)
+#define BODY_VEL(w, i)  ((w)->body_hot[i].vel)
+#define BODY_ROT(w, i)  ((w)->body_hot[i].rot)
+#define BODY_AVEL(w, i) ((w)->body_hot[i].avel)
+#endif
+
+//Regions, a sparse grid of cells rebuilt whenever a body AABB changes. Bodies spanning more than
+//REGION_MAX_SPAN cells on an axis, like planes, are tested against every body.
+#define DEFAULT_REGION_SIZE 16.f
+#define REGION_MAX_SPAN 4
+#define REGION_CELL_LIMIT (1 << 28) //cells past it are merged, keeps loops over cells from overflowing
+
+//Body positions and bounds are relative to the origin of a region cell, cell times the region size from the
+//world origin, so they keep their precision however far from it. A body moves to the cell it is in once
+//it strays REGION_REBASE_MARGIN region sizes out of its own.
+#define REGION_REBASE_MARGIN 0.25f
+
+//Regions are built from fat AABBs, grown by a margin and AABB_PREDICTION steps of
+//the body velocity. A fat AABB is only refreshed once the tight AABB leaves it.
+#define AABB_MARGIN 0.05f
+#define AABB_PREDICTION 2.f
+
+//What integration changed since the tight AABB was last built. Only a new orientation regenerates the
+//shape bounds, and never for spheres.
+#define BODY_MOVED_POSITION 1
+#define BODY_MOVED_ROTATION 2
+
+typedef struct region_entry {
+	int x, y, z;
+	int awake;
+	bodyID body;
+} region_entry;
+
+typedef struct broadphase {
+	region_entry *entries, *entries_sorted;
+	size_t entry_size, entry_cap;
+	region_cell *first; //per body, the lowest cell it was entered in
+	size_t first_cap;
+	size_t *buckets; //bucket_count + 1 offsets into entries
+	size_t bucket_count, bucket_cap;
+	bodyID *large;
+	size_t large_size, large_cap;
+} broadphase;
+
+//Every array in the world block starts on its own cache line
+#define WORLD_ALIGN 64
 typedef struct world {
 	vec3 gravity;
+	double origin[3]; //total shift applied by worldShiftOrigin
+	scalar region_size;
 	
 	size_t body_size;
 	size_t body_cap;
@@ -29,12 +258,21 @@ typedef struct world {
 	size_t body_empty_size;
 
 	bodyType *body_type;
+	unsigned *body_flags;
+#ifdef VISCO_LAYOUT_SOA
 	vec3 *body_pos;  //3
 	vec3 *body_vel;  //3
 	quat *body_rot;  //4
 	vec3 *body_avel; //3
+#else
+	body_state *body_hot; //16
+#endif
 	accumulator *body_accum; // 6
 	aabb *body_aabb; //6
+	aabb *body_fat;  //6
+	aabb *body_local; //shape AABB at the current orientation, relative to the position
+	unsigned char *body_moved; //BODY_MOVED_*
+	region_cell *body_cell; //positions and bounds are relative to its origin
 	shape **body_shape; //array of pointers, shapes are stored separately from worlds
 
 	size_t joint_size;
@@ -45,57 +283,239 @@ typedef struct world {
 
 	joint_max* joints;
 
+	//contact pairs of flagged bodies from this and the last step
+	contact_pair *pair_prev, *pair_cur;
+	size_t pair_prev_size, pair_prev_cap;
+	size_t pair_cur_size, pair_cur_cap;
+
+	gjk_pair *gjk_prev, *gjk_cur;
+	size_t gjk_prev_size, gjk_prev_cap;
+	size_t gjk_cur_size, gjk_cur_cap;
+
+	contactEvent *event_ring;
+	size_t event_cap;
+	size_t event_head;
+	size_t event_size;
+
+	solver solver;
+	int solver_iterations;
+
+	broadphase broadphase;
+	int broadphase_dirty; //a body AABB changed since the regions were built
+
+	worldStats stats;
+
+	viscoAllocator allocator;
+	const viscoAllocator *scratch_allocator; //set while a group lends its scratch, NULL otherwise
+
+	world_trace *trace; //NULL unless recording
+	int profiling;
+	worldTimings timings;
+
+	worldKernels kernels;
+
 } world;
 
-static world* allocateWorld(size_t body_cap, size_t joint_cap) {
+//Buffers only used within a step, a group lends one set per thread to its worlds. The regions stay
+//with their world, they are reused by the next step and by queries while no body moved.
+typedef struct world_scratch {
+	solver solver;
+} world_scratch;
+
+struct worldGroup {
+	viscoAllocator allocator;
+
+	world **worlds;
+	size_t world_size, world_cap;
+
+	world_scratch *scratch;
+	size_t scratch_size;
+};
+
+static inline void* carve(unsigned char **cursor, size_t size) {
+	uintptr_t p = ((uintptr_t)*cursor + WORLD_ALIGN - 1) & ~(uintptr_t)(WORLD_ALIGN - 1);
+	*cursor = (unsigned char*)p + size;
+	return (void*)p;
+}
+static world* allocateWorld(size_t body_cap, size_t joint_cap, const viscoAllocator *allocator) {
+#ifdef VISCO_LAYOUT_SOA
+	const size_t body_state_size = sizeof(scalar) * 13;
+	const size_t body_arrays = 16;
+#else
+	const size_t body_state_size = sizeof(body_state);
+	const size_t body_arrays = 13;
+#endif
 	const size_t size = sizeof(world) +						//world
-						sizeof(scalar) * 25 * body_cap +	//body data
-						(sizeof(shape*) + sizeof(bodyType) + sizeof(size_t)) * body_cap + //body types, shapes, stack
-						(sizeof(joint_max) + sizeof(size_t)) * joint_cap; //Joint array and stack
-	unsigned char* data = calloc(1, size);
+						(body_state_size + sizeof(accumulator) + sizeof(aabb) * 3 + sizeof(region_cell) + 1) * body_cap + //body data
+						(sizeof(shape*) + sizeof(bodyType) + sizeof(unsigned) + sizeof(size_t)) * body_cap + //body types, flags, shapes, stack
+						(sizeof(joint_max) + sizeof(size_t)) * joint_cap + //Joint array and stack
+						WORLD_ALIGN * (body_arrays + 2); //alignment padding
+	unsigned char* data = viscoAlloc(allocator, size);
+	if (!data) {
+		return NULL;
+	}
+	memset(data, 0, size);
 
 	world* ret = (world*)data;
+	ret->allocator = *allocator;
 	ret->gravity.y = -9.8f;
+	ret->region_size = DEFAULT_REGION_SIZE;
+	ret->solver_iterations = DEFAULT_SOLVER_ITERATIONS;
 	ret->body_cap  = body_cap;
 	ret->joint_cap = joint_cap;
+	ret->broadphase_dirty = 1;
 
-	ret->body_empty  = (size_t*)&data[sizeof(world)];
-	ret->body_type   = (bodyType*)&ret->body_empty[body_cap];
-	ret->body_pos    = (vec3*)&ret->body_type[body_cap];
-	ret->body_vel    = (vec3*)&ret->body_pos[body_cap];
-	ret->body_rot    = (quat*)&ret->body_vel[body_cap];
-	ret->body_avel   = (vec3*)&ret->body_rot[body_cap];
-	ret->body_accum  = (accumulator*)&ret->body_avel[body_cap];
-	ret->body_aabb   = (aabb*)&ret->body_accum[body_cap];
-	ret->body_shape  = (shape**)&ret->body_aabb[body_cap];
-	ret->joint_empty = (size_t*)&ret->body_shape[body_cap];
-	ret->joints      = (joint_max*)&ret->joint_empty[joint_cap];
+	unsigned char *cursor = &data[sizeof(world)];
+#ifdef VISCO_LAYOUT_SOA
+	ret->body_pos    = (vec3*)carve(&cursor, sizeof(vec3) * body_cap);
+	ret->body_vel    = (vec3*)carve(&cursor, sizeof(vec3) * body_cap);
+	ret->body_rot    = (quat*)carve(&cursor, sizeof(quat) * body_cap);
+	ret->body_avel   = (vec3*)carve(&cursor, sizeof(vec3) * body_cap);
+#else
+	ret->body_hot    = (body_state*)carve(&cursor, sizeof(body_state) * body_cap);
+#endif
+	ret->body_accum  = (accumulator*)carve(&cursor, sizeof(accumulator) * body_cap);
+	ret->body_aabb   = (aabb*)carve(&cursor, sizeof(aabb) * body_cap);
+	ret->body_fat    = (aabb*)carve(&cursor, sizeof(aabb) * body_cap);
+	ret->body_local  = (aabb*)carve(&cursor, sizeof(aabb) * body_cap);
+	ret->body_moved  = (unsigned char*)carve(&cursor, body_cap);
+	ret->body_cell   = (region_cell*)carve(&cursor, sizeof(region_cell) * body_cap);
+	ret->body_type   = (bodyType*)carve(&cursor, sizeof(bodyType) * body_cap);
+	ret->body_flags  = (unsigned*)carve(&cursor, sizeof(unsigned) * body_cap);
+	ret->body_shape  = (shape**)carve(&cursor, sizeof(shape*) * body_cap);
+	ret->body_empty  = (size_t*)carve(&cursor, sizeof(size_t) * body_cap);
+	ret->joints      = (joint_max*)carve(&cursor, sizeof(joint_max) * joint_cap);
+	ret->joint_empty = (size_t*)carve(&cursor, sizeof(size_t) * joint_cap);
 
 	return ret;
 }
 static void copyWorld(world* newWorld, const world* oldWorld) {
 	memcpy(newWorld->body_empty, oldWorld->body_empty, oldWorld->body_cap  * sizeof(size_t));
 	memcpy(newWorld->body_type,  oldWorld->body_type,  oldWorld->body_cap  * sizeof(bodyType));
+	memcpy(newWorld->body_flags, oldWorld->body_flags, oldWorld->body_cap  * sizeof(unsigned));
+#ifdef VISCO_LAYOUT_SOA
 	memcpy(newWorld->body_pos,   oldWorld->body_pos,   oldWorld->body_cap  * sizeof(vec3));
 	memcpy(newWorld->body_vel,   oldWorld->body_vel,   oldWorld->body_cap  * sizeof(vec3));
 	memcpy(newWorld->body_rot,   oldWorld->body_rot,   oldWorld->body_cap  * sizeof(quat));
 	memcpy(newWorld->body_avel,  oldWorld->body_avel,  oldWorld->body_cap  * sizeof(vec3));
+#else
+	memcpy(newWorld->body_hot,   oldWorld->body_hot,   oldWorld->body_cap  * sizeof(body_state));
+#endif
+	memcpy(newWorld->body_accum, oldWorld->body_accum, oldWorld->body_cap  * sizeof(accumulator));
 	memcpy(newWorld->body_aabb,  oldWorld->body_aabb,  oldWorld->body_cap  * sizeof(aabb));
+	memcpy(newWorld->body_fat,   oldWorld->body_fat,   oldWorld->body_cap  * sizeof(aabb));
+	memcpy(newWorld->body_local, oldWorld->body_local, oldWorld->body_cap  * sizeof(aabb));
+	memcpy(newWorld->body_moved, oldWorld->body_moved, oldWorld->body_cap);
+	memcpy(newWorld->body_cell,  oldWorld->body_cell,  oldWorld->body_cap  * sizeof(region_cell));
 	memcpy(newWorld->body_shape, oldWorld->body_shape, oldWorld->body_cap  * sizeof(shape*));
 	memcpy(newWorld->joint_empty,oldWorld->joint_empty,oldWorld->joint_cap * sizeof(size_t));
 	memcpy(newWorld->joints,     oldWorld->joints,     oldWorld->joint_cap * sizeof(joint_max));
+	newWorld->gravity          = oldWorld->gravity;
+	newWorld->origin[0]        = oldWorld->origin[0];
+	newWorld->origin[1]        = oldWorld->origin[1];
+	newWorld->origin[2]        = oldWorld->origin[2];
+	newWorld->region_size      = oldWorld->region_size;
+	newWorld->broadphase       = oldWorld->broadphase;
+	newWorld->broadphase_dirty = oldWorld->broadphase_dirty;
 	newWorld->body_size        = oldWorld->body_size;
 	newWorld->body_empty_size  = oldWorld->body_empty_size;
 	newWorld->joint_size       = oldWorld->joint_size;
 	newWorld->joint_empty_size = oldWorld->joint_empty_size;
+
+	newWorld->pair_prev      = oldWorld->pair_prev;
+	newWorld->pair_prev_size = oldWorld->pair_prev_size;
+	newWorld->pair_prev_cap  = oldWorld->pair_prev_cap;
+	newWorld->pair_cur       = oldWorld->pair_cur;
+	newWorld->pair_cur_size  = oldWorld->pair_cur_size;
+	newWorld->pair_cur_cap   = oldWorld->pair_cur_cap;
+	newWorld->gjk_prev       = oldWorld->gjk_prev;
+	newWorld->gjk_prev_size  = oldWorld->gjk_prev_size;
+	newWorld->gjk_prev_cap   = oldWorld->gjk_prev_cap;
+	newWorld->gjk_cur        = oldWorld->gjk_cur;
+	newWorld->gjk_cur_size   = oldWorld->gjk_cur_size;
+	newWorld->gjk_cur_cap    = oldWorld->gjk_cur_cap;
+	newWorld->event_ring     = oldWorld->event_ring;
+	newWorld->event_cap      = oldWorld->event_cap;
+	newWorld->event_head     = oldWorld->event_head;
+	newWorld->event_size     = oldWorld->event_size;
+	newWorld->solver         = oldWorld->solver;
+	newWorld->solver_iterations = oldWorld->solver_iterations;
+	newWorld->stats          = oldWorld->stats;
+	newWorld->scratch_allocator = oldWorld->scratch_allocator;
+	newWorld->trace          = oldWorld->trace;
+	newWorld->profiling      = oldWorld->profiling;
+	newWorld->timings        = oldWorld->timings;
+	newWorld->kernels        = oldWorld->kernels;
+}
+
+//Records a call when the world is being traced
+static inline void traceValue(world *w, traceRecordType type, size_t id, uint64_t value) {
+	if (w->trace) {
+		trace_value v = { id, value };
+		traceWrite(w->trace, type, &v, sizeof(v));
+	}
+}
+static inline void traceScalar(world *w, traceRecordType type, scalar value) {
+	if (w->trace) {
+		trace_scalar v = { value };
+		traceWrite(w->trace, type, &v, sizeof(v));
+	}
+}
+static inline void traceVec3(world *w, traceRecordType type, size_t body, const vec3 *v) {
+	if (w->trace) {
+		trace_vec3 t = { body, *v };
+		traceWrite(w->trace, type, &t, sizeof(t));
+	}
+}
+
+static inline const viscoAllocator* scratchAllocator(const world *w) {
+	return w->scratch_allocator ? w->scratch_allocator : &w->allocator;
+}
+static void freeSolver(const viscoAllocator *a, solver *s) {
+	viscoFree(a, s->rows);
+	viscoFree(a, s->rows_sorted);
+	viscoFree(a, s->body_colors);
+	viscoFree(a, s->colors);
+	viscoFree(a, s->order);
+	memset(s, 0, sizeof(solver));
+}
+static void freeBroadphase(const viscoAllocator *a, broadphase *bp) {
+	viscoFree(a, bp->entries);
+	viscoFree(a, bp->entries_sorted);
+	viscoFree(a, bp->first);
+	viscoFree(a, bp->buckets);
+	viscoFree(a, bp->large);
+	memset(bp, 0, sizeof(broadphase));
 }
 
-world* worldCreate(void) {
-	world* ret = allocateWorld(4, 4);
+world* worldCreate(const viscoAllocator *allocator) {
+	const viscoAllocator heap = { 0 };
+	world* ret = allocateWorld(4, 4, allocator ? allocator : &heap);
+	if (ret) {
+		ret->kernels = viscoBestKernels();
+	}
 	return ret;
 }
 void worldDestroy(world *w) {
-	free(w);
+	//The allocator lives in the block it frees
+	viscoAllocator a = w->allocator;
+	viscoFree(&a, w->pair_prev);
+	viscoFree(&a, w->pair_cur);
+	viscoFree(&a, w->gjk_prev);
+	viscoFree(&a, w->gjk_cur);
+	viscoFree(&a, w->event_ring);
+	freeSolver(scratchAllocator(w), &w->solver);
+	freeBroadphase(&a, &w->broadphase);
+	if (w->trace) {
+		traceClose(w->trace);
+	}
+	viscoFree(&a, w);
+}
+
+static inline void destroyJoint(world *w, jointID j) {
+	w->joints[j].j.type = JOINT_DELETE;
+	w->joint_empty[w->joint_empty_size++] = j;
+	w->joint_size--;
 }
 
 //Bodies
@@ -104,10 +524,13 @@ bodyID bodyCreate(world** ptr) {
 
 	if (w->body_size >= w->body_cap) {
 		//Allocate more space
-		world* newWorld = allocateWorld(w->body_cap * 2, w->joint_cap);
+		world* newWorld = allocateWorld(w->body_cap * 2, w->joint_cap, &w->allocator);
+		if (!newWorld) {
+			return BODY_INVALID;
+		}
 		copyWorld(newWorld, w);
 		*ptr = newWorld;
-		free(w);
+		viscoFree(&w->allocator, w);
 		w = newWorld;
 	}
 
@@ -119,53 +542,183 @@ bodyID bodyCreate(world** ptr) {
 	}
 
 	w->body_type[index]  = BODY_STATIC;
-	w->body_pos[index]   =
-	w->body_vel[index]   =
-	w->body_avel[index]  = vec3Zero;
-	w->body_rot[index]   = quatIndentity;
+	w->body_flags[index] = 0;
+	BODY_POS(w, index)   =
+	BODY_VEL(w, index)   =
+	BODY_AVEL(w, index)  = vec3Zero;
+	BODY_ROT(w, index)   = quatIndentity;
 	w->body_aabb[index]  = (aabb){0};
+	w->body_fat[index]   = (aabb){0};
+	w->body_local[index] = (aabb){0};
+	w->body_moved[index] = 0;
+	w->body_cell[index]  = (region_cell){0};
 	w->body_shape[index] = NULL;
 	w->body_size++;
 
+	traceValue(w, TRACE_BODY_CREATE, index, 0);
 	return index;
 }
 void bodyDestroy(world* w, bodyID b) {
+	traceValue(w, TRACE_BODY_DESTROY, b, 0);
+
+	//Joints go with their body, the slot may be reused by an unrelated one. Replaying the call destroys them too.
+	for (size_t i = 0; i < w->joint_cap; i++) {
+		const joint *j = &w->joints[i].j;
+		if (j->type != JOINT_DELETE && (j->a == b || j->b == b)) {
+			destroyJoint(w, i);
+		}
+	}
+
 	w->body_type[b] = BODY_DELETE;
+	w->broadphase_dirty = 1;
 	w->body_empty[w->body_empty_size++] = b;
 	w->body_size--;
 }
 
 void bodySetType(world *w, bodyID b, bodyType t) {
+	traceValue(w, TRACE_BODY_TYPE, b, (uint64_t)t);
 	w->body_type[b] = t;
+	w->broadphase_dirty = 1;
 }
 bodyType bodyGetType(world *w, bodyID b) {
 	return w->body_type[b];
 }
 
+void bodySetFlags(world *w, bodyID b, unsigned flags) {
+	traceValue(w, TRACE_BODY_FLAGS, b, flags);
+	w->body_flags[b] = flags;
+
+	//Without a ring the events are dropped, a later call or worldSetContactEventCapacity can still add it
+	if ((flags & (BODY_FLAG_CONTACT_EVENTS | BODY_FLAG_SENSOR)) && w->event_cap == 0) {
+		worldSetContactEventCapacity(w, DEFAULT_EVENT_CAPACITY);
+	}
+}
+unsigned bodyGetFlags(world *w, bodyID b) {
+	return w->body_flags[b];
+}
+
+static inline int clampCell(double c) {
+	if (!(c > -REGION_CELL_LIMIT)) {
+		return -REGION_CELL_LIMIT; //also NaN
+	}
+	return c < REGION_CELL_LIMIT ? (int)c : REGION_CELL_LIMIT;
+}
+static inline double cellOrigin(const world *w, int c) {
+	return (double)c * w->region_size;
+}
+//Cell holding a point given relative to the world origin
+static inline void pointCell(region_cell *dest, const world *w, const double *p) {
+	dest->x = clampCell(floor(p[0] / w->region_size));
+	dest->y = clampCell(floor(p[1] / w->region_size));
+	dest->z = clampCell(floor(p[2] / w->region_size));
+}
+//A point given relative to the world origin made relative to the origin of cell
+static inline void pointInCell(vec3 *dest, const world *w, const region_cell *cell, const vec3 *point) {
+	dest->x = (scalar)(point->x - cellOrigin(w, cell->x));
+	dest->y = (scalar)(point->y - cellOrigin(w, cell->y));
+	dest->z = (scalar)(point->z - cellOrigin(w, cell->z));
+}
+//Cell holding a point given relative to the world origin, and the point relative to that cell
+static inline void toCell(region_cell *cell, vec3 *local, const world *w, const vec3 *point) {
+	double p[3] = { point->x, point->y, point->z };
+	pointCell(cell, w, p);
+	pointInCell(local, w, cell, point);
+}
+//Offset from the origin of cell from to the origin of cell to
+static inline void cellOffset(vec3 *dest, const world *w, const region_cell *from, const region_cell *to) {
+	dest->x = (scalar)(((double)to->x - from->x) * w->region_size);
+	dest->y = (scalar)(((double)to->y - from->y) * w->region_size);
+	dest->z = (scalar)(((double)to->z - from->z) * w->region_size);
+}
+//Position of body b relative to the origin of cell
+static inline void posInCell(vec3 *dest, const world *w, bodyID b, const region_cell *cell) {
+	vec3 offset;
+	cellOffset(&offset, w, cell, &w->body_cell[b]);
+	vec3Add(dest, &BODY_POS(w, b), &offset);
+}
+//Position of body b relative to the world origin
+static inline void globalPos(double *dest, const world *w, bodyID b) {
+	dest[0] = cellOrigin(w, w->body_cell[b].x) + BODY_POS(w, b).x;
+	dest[1] = cellOrigin(w, w->body_cell[b].y) + BODY_POS(w, b).y;
+	dest[2] = cellOrigin(w, w->body_cell[b].z) + BODY_POS(w, b).z;
+}
+//Offset from body b to a point given relative to the world origin
+static inline void offsetTo(vec3 *dest, const world *w, bodyID b, const vec3 *point) {
+	double p[3];
+	globalPos(p, w, b);
+	dest->x = (scalar)(point->x - p[0]);
+	dest->y = (scalar)(point->y - p[1]);
+	dest->z = (scalar)(point->z - p[2]);
+}
+//Moves body b to the cell it is in, origin is where the origin of its current cell lies now.
+//Its position and bounds shift by the difference.
+static void rebaseBody(world *w, bodyID b, const double *origin) {
+	double p[3] = {
+		origin[0] + BODY_POS(w, b).x,
+		origin[1] + BODY_POS(w, b).y,
+		origin[2] + BODY_POS(w, b).z
+	};
+	region_cell cell;
+	pointCell(&cell, w, p);
+	vec3 delta = {
+		(scalar)(origin[0] - cellOrigin(w, cell.x)),
+		(scalar)(origin[1] - cellOrigin(w, cell.y)),
+		(scalar)(origin[2] - cellOrigin(w, cell.z))
+	};
+	vec3Add(&BODY_POS(w, b), &BODY_POS(w, b), &delta);
+	aabbAddVec3(&w->body_aabb[b], &w->body_aabb[b], &delta);
+	aabbAddVec3(&w->body_fat[b], &w->body_fat[b], &delta);
+	w->body_cell[b] = cell;
+	w->broadphase_dirty = 1;
+}
+
 void bodyGetPosition(vec3 *dest, world *w, bodyID b) {
-	*dest = w->body_pos[b];
+	double p[3];
+	globalPos(p, w, b);
+	*dest = (vec3){ (scalar)p[0], (scalar)p[1], (scalar)p[2] };
+}
+void bodyGetPositionDouble(double *dest, world *w, bodyID b) {
+	globalPos(dest, w, b);
+}
+static inline void refreshAabb(world *w, bodyID b) {
+	if (w->body_shape[b] != NULL) {
+		shapeGenerateAabb(&w->body_local[b], w->body_shape[b], &BODY_ROT(w, b));
+		aabbAddVec3(&w->body_aabb[b], &w->body_local[b], &BODY_POS(w, b));
+		w->body_fat[b] = w->body_aabb[b];
+		w->body_moved[b] = 0;
+	}
+	w->broadphase_dirty = 1;
 }
 void bodySetPosition(world *w, bodyID b, const vec3 *pos) {
-	w->body_pos[b] = *pos;
+	traceVec3(w, TRACE_BODY_POSITION, b, pos);
+	toCell(&w->body_cell[b], &BODY_POS(w, b), w, pos);
+	refreshAabb(w, b);
 }
 
 void bodyGetOrientation(quat *dest, world *w, bodyID body) {
-	*dest = w->body_rot[body];
+	*dest = BODY_ROT(w, body);
 }
 void bodySetOrientation(world *w, bodyID body, const quat *rot) {
-	quatNormalize(&w->body_rot[body], rot);
+	if (w->trace) {
+		trace_quat t = { body, *rot };
+		traceWrite(w->trace, TRACE_BODY_ORIENTATION, &t, sizeof(t));
+	}
+	quatNormalize(&BODY_ROT(w, body), rot);
+	refreshAabb(w, body);
 }
 
 void bodyGetTransform(transform *dest, world *w, bodyID b) {
 	transform ret = {
-		w->body_pos[b],
+		vec3Zero,
 		vec3Identity,
-		w->body_rot[b]
+		BODY_ROT(w, b)
 	};
+	bodyGetPosition(&ret.position, w, b);
 	*dest = ret;
 }
 void bodyGetMat4(mat4 *dest, world *w, bodyID b) {
-	vec3 pos = w->body_pos[b];
+	vec3 pos;
+	bodyGetPosition(&pos, w, b);
 	mat4 ret = {
 		1, 0, 0, 0,
 		0, 1, 0, 0,
@@ -173,21 +726,22 @@ void bodyGetMat4(mat4 *dest, world *w, bodyID b) {
 		pos.x, pos.y, pos.z, 1
 	};
 	mat4 rot;
-	quatToMat4(&rot, &w->body_rot[b]);
+	quatToMat4(&rot, &BODY_ROT(w, b));
 	mat4Mul(dest, &rot, &ret);
 }
 
+shape* bodyGetShape(world *w, bodyID b) {
+	return w->body_shape[b];
+}
 void bodySetShape(world *w, bodyID b, shape *s) {
-	w->body_shape[b] = s;
-
-	if (s != NULL) {
-		aabb newAABB;
-		shapeGenerateAabb(&newAABB, w->body_shape[b], &w->body_rot[b]);
-		aabbAddVec3(&w->body_aabb[b], &newAABB, &w->body_pos[b]);
+	if (w->trace) {
+		traceValue(w, TRACE_BODY_SHAPE, b, traceShape(w->trace, s));
 	}
+	w->body_shape[b] = s;
+	refreshAabb(w, b);
 }
 
-static inline void applyForce(world *w, bodyID b, const vec3 *pos, const vec3 *force) {
+static inline void applyForce(world *w, bodyID b, const vec3 *offset, const vec3 *force) {
 	if (w->body_type[b] != BODY_DYNAMIC) {
 		return;
 	} else {
@@ -210,69 +764,44 @@ static inline void applyForce(world *w, bodyID b, const vec3 *pos, const vec3 *f
 			vec3 linear;
 			vec3MulScalar(&linear, force, mass);
 			vec3Add(&w->body_accum[b].vel, &w->body_accum[b].vel, &linear);
-			//vec3Add(&w->body_vel[b], &w->body_vel[b], &linear);
+			//vec3Add(&BODY_VEL(w, b), &BODY_VEL(w, b), &linear);
 		}
 
 		{//Angular velocity
-			vec3 toPos;
-			vec3Sub(&toPos, pos, &w->body_pos[b]);
 			vec3 cross;
-			vec3Cross(&cross, &toPos, force);
+			vec3Cross(&cross, offset, force);
 			vec3 torque;
 			mat3MulVec3(&torque, &inertia, &cross);
 			vec3Add(&w->body_accum[b].avel, &w->body_accum[b].avel, &torque);
-			//vec3Add(&w->body_avel[b], &w->body_avel[b], &torque);
+			//vec3Add(&BODY_AVEL(w, b), &BODY_AVEL(w, b), &torque);
 		}
 	}
 }
 void bodyApplyForce(world *w, bodyID b, const vec3 *pos, const vec3 *force) {
-	applyForce(w, b, pos, force);
-}
-
-static inline void velAtPoint(vec3 *dest, world *w, bodyID b, const vec3 *pos) {
-	if (w->body_type[b] <= BODY_STATIC) {
-		*dest = vec3Zero;
-		return;
-	} else {
-		vec3 toPos;
-		vec3Sub(&toPos, pos, &w->body_pos[b]);
-		vec3 angular;
-		vec3Cross(&angular, &w->body_avel[b], &toPos);
-		vec3Add(dest, &w->body_vel[b], &angular);
+	if (w->trace) {
+		trace_force t = { b, *pos, *force };
+		traceWrite(w->trace, TRACE_BODY_FORCE, &t, sizeof(t));
 	}
+	vec3 offset;
+	offsetTo(&offset, w, b, pos);
+	applyForce(w, b, &offset, force);
 }
-static inline void forceAtPoint(vec3 *dest, world *w, bodyID b, const vec3 *pos) {
+
+//Velocity of the point of body b at offset from its position
+static inline void velAtOffset(vec3 *dest, world *w, bodyID b, const vec3 *offset) {
 	if (w->body_type[b] <= BODY_STATIC) {
 		*dest = vec3Zero;
 		return;
 	} else {
-		scalar mass;
-		mat3 inertia;
-
-		if (w->body_shape[b] != NULL) {
-			mass = w->body_shape[b]->mass;
-			if (mass == 0) {
-				*dest = vec3Zero;
-				return;
-			}
-			inertia = w->body_shape[b]->inertiaTensor;
-		} else {
-			mass = 1;
-			inertia = mat3Identity;
-		}
-		vec3 toPos;
-		vec3Sub(&toPos, pos, &w->body_pos[b]);
 		vec3 angular;
-		vec3Cross(&angular, &w->body_avel[b], &toPos);
-		vec3 torque;
-		mat3MulVec3(&torque, &inertia, &angular);
-		vec3 force;
-		vec3MulScalar(&force, &w->body_vel[b], mass);
-		vec3Add(dest, &force, &torque);
+		vec3Cross(&angular, &BODY_AVEL(w, b), offset);
+		vec3Add(dest, &BODY_VEL(w, b), &angular);
 	}
 }
 void bodyGetVelocityAtPoint(vec3 *dest, world *w, bodyID b, const vec3 *pos) {
-	velAtPoint(dest, w, b, pos);
+	vec3 offset;
+	offsetTo(&offset, w, b, pos);
+	velAtOffset(dest, w, b, &offset);
 }
 
 //Joints
@@ -281,10 +810,13 @@ static inline jointID pushJoint(world **ptr, joint *j) {
 
 	if (w->joint_size >= w->joint_cap) {
 		//Allocate more space
-		world* newWorld = allocateWorld(w->body_cap, w->joint_cap * 2);
+		world* newWorld = allocateWorld(w->body_cap, w->joint_cap * 2, &w->allocator);
+		if (!newWorld) {
+			return JOINT_INVALID;
+		}
 		copyWorld(newWorld, w);
 		*ptr = newWorld;
-		free(w);
+		viscoFree(&w->allocator, w);
 		w = newWorld;
 	}
 
@@ -297,206 +829,2027 @@ static inline jointID pushJoint(world **ptr, joint *j) {
 
 	switch (j->type) {
 	case JOINT_CONTACT:
-		w->joints[index] = *((contact_joint*)j);
+		w->joints[index].contact = *((contact_joint*)j);
+		break;
+	default:
+		w->joints[index].constraint = *((constraint_joint*)j);
 		break;
 	}
 	w->joint_size++;
 
 	return index;
 }
-static inline void destroyJoint(world *w, jointID j) {
-	w->joints[j].j.type = JOINT_DELETE;
-	w->joint_empty[w->joint_empty_size++] = j;
-	w->joint_size--;
-}
-
-//Solve joints
-static inline void solveContact(world *w, contact_joint *j) {
-	bodyID a = j->j.a;
-	bodyID b = j->j.b;
-
-	shape* sA = w->body_shape[a];
-	shape* sB = w->body_shape[b];
 
-	//Error handling and checking body type
-	//TODO: limit amount of error handling
-	if (w->body_type[b] == BODY_DYNAMIC) {
-		if (j->contact.distance > 0.01f) {
-			vec3 err;
-			vec3MulScalar(&err, &j->contact.normal, j->contact.distance);
-			vec3Add(&w->body_pos[b], &w->body_pos[b], &err);
-		}
-	} else if (w->body_type[a] == BODY_DYNAMIC) {
-		if (j->contact.distance > 0.01f) {
-			vec3 err;
-			vec3MulScalar(&err, &j->contact.normal, -j->contact.distance);
-			vec3Add(&w->body_pos[a], &w->body_pos[a], &err);
-		}
+static inline void perpendicular(vec3 *t1, vec3 *t2, const vec3 *n) {
+	if (viscoAbs(n->x) > 0.57735f) {
+		*t1 = (vec3){ n->y, -n->x, 0 };
 	} else {
-		return;
+		*t1 = (vec3){ 0, n->z, -n->y };
 	}
+	vec3Normalize(t1, t1);
+	vec3Cross(t2, n, t1);
+}
+//point is relative to the origin of cell
+static inline void toLocal(vec3 *dest, world *w, bodyID b, const region_cell *cell, const vec3 *point) {
+	quat reverse;
+	quatInverse(&reverse, &BODY_ROT(w, b));
+	vec3 pos, rel;
+	posInCell(&pos, w, b, cell);
+	vec3Sub(&rel, point, &pos);
+	quatMulVec3(dest, &reverse, &rel);
+}
+static inline void toLocalDir(vec3 *dest, world *w, bodyID b, const vec3 *dir) {
+	quat reverse;
+	quatInverse(&reverse, &BODY_ROT(w, b));
+	quatMulVec3(dest, &reverse, dir);
+	vec3Normalize(dest, dest);
+}
+//Anchors are relative to the origin of cell
+static inline jointID createJoint(world **ptr, jointType type, bodyID a, bodyID b, const region_cell *cell,
+	const vec3 *anchorA, const vec3 *anchorB, const vec3 *axis) {
+	world *w = *ptr;
 
-	vec3 fA, fB;
-	forceAtPoint(&fA, w, a, &j->contact.position);
-	forceAtPoint(&fB, w, b, &j->contact.position);
+	constraint_joint j = {0};
+	j.j.type = type;
+	j.j.a = a;
+	j.j.b = b;
 
-	//if (div4) {
-	//	vec3DivScalar(&fA, &fA, 4);
-	//	vec3DivScalar(&fB, &fB, 4);
-	//}
+	toLocal(&j.anchorA, w, a, cell, anchorA);
+	toLocal(&j.anchorB, w, b, cell, anchorB);
 
-	vec3 relative;
-	vec3Sub(&relative, &fB, &fA);
-	scalar contactForce = vec3Dot(&j->contact.normal, &relative);
+	vec3 worldAxis = axis ? *axis : vec3YAxis;
+	toLocalDir(&j.axisA, w, a, &worldAxis);
+	toLocalDir(&j.axisB, w, b, &worldAxis);
 
-	if (contactForce > 0) {
-		return;
-	} else {
-		//restitution
-		scalar e = 1 + mm_max(sA->restitution, sB->restitution);
-		scalar r = contactForce;
+	vec3 worldRef, unused;
+	perpendicular(&worldRef, &unused, &worldAxis);
+	toLocalDir(&j.refA, w, a, &worldRef);
+	toLocalDir(&j.refB, w, b, &worldRef);
 
-		//friction
-		vec3 friction;
-		{
-			vec3 temp;
-			vec3Cross(&temp, &relative, &j->contact.normal);
-			vec3Cross(&friction, &temp, &j->contact.normal);
-			vec3Normalize(&friction, &friction);
-			scalar f = mm_sqrt(sA->friction * sB->friction) * vec3Dot(&friction, &relative);
-			vec3MulScalar(&friction, &friction, f);
-		}
+	quat reverse;
+	quatInverse(&reverse, &BODY_ROT(w, a));
+	quatMul(&j.rel, &reverse, &BODY_ROT(w, b));
 
-		vec3 force;
-		vec3MulScalar(&force, &j->contact.normal, r);
-		vec3Add(&force, &force, &friction);
+	vec3 d;
+	vec3Sub(&d, anchorB, anchorA);
+	j.length = vec3Length(&d);
 
-		applyForce(w, a, &j->contact.position, &force);
-		vec3Negate(&force, &force);
-		applyForce(w, b, &j->contact.position, &force);
+	jointID ret = pushJoint(ptr, (joint*)&j);
+	w = *ptr;
+	if (w->trace && ret != JOINT_INVALID) {
+		trace_joint_create t = { ret, (uint64_t)type, a, b, *anchorA, *anchorB, worldAxis,
+			{ cell->x, cell->y, cell->z }, axis != NULL };
+		traceWrite(w->trace, TRACE_JOINT_CREATE, &t, sizeof(t));
+	}
+	return ret;
+}
+jointID jointCreateBall(world **ptr, bodyID a, bodyID b, const vec3 *anchor) {
+	region_cell cell;
+	vec3 local;
+	toCell(&cell, &local, *ptr, anchor);
+	return createJoint(ptr, JOINT_BALL, a, b, &cell, &local, &local, NULL);
+}
+jointID jointCreateHinge(world **ptr, bodyID a, bodyID b, const vec3 *anchor, const vec3 *axis) {
+	region_cell cell;
+	vec3 local;
+	toCell(&cell, &local, *ptr, anchor);
+	return createJoint(ptr, JOINT_HINGE, a, b, &cell, &local, &local, axis);
+}
+jointID jointCreateSlider(world **ptr, bodyID a, bodyID b, const vec3 *axis) {
+	//Slides the center of b along the axis through a
+	region_cell cell = (*ptr)->body_cell[b];
+	vec3 anchor = BODY_POS(*ptr, b);
+	return createJoint(ptr, JOINT_SLIDER, a, b, &cell, &anchor, &anchor, axis);
+}
+jointID jointCreateFixed(world **ptr, bodyID a, bodyID b) {
+	region_cell cell = (*ptr)->body_cell[b];
+	vec3 anchor = BODY_POS(*ptr, b);
+	return createJoint(ptr, JOINT_FIXED, a, b, &cell, &anchor, &anchor, NULL);
+}
+jointID jointCreateDistance(world **ptr, bodyID a, bodyID b, const vec3 *anchorA, const vec3 *anchorB) {
+	region_cell cell;
+	vec3 localA, localB;
+	toCell(&cell, &localA, *ptr, anchorA);
+	pointInCell(&localB, *ptr, &cell, anchorB);
+	return createJoint(ptr, JOINT_DISTANCE, a, b, &cell, &localA, &localB, NULL);
+}
+void jointDestroy(world *w, jointID j) {
+	traceValue(w, TRACE_JOINT_DESTROY, j, 0);
+	if (w->joints[j].j.type != JOINT_DELETE) {
+		destroyJoint(w, j);
 	}
 }
 
-//Simulation
-static inline void integrateVelocity(world *w, scalar dt) {
-	vec3 gravDelta;
-	vec3MulScalar(&gravDelta, &w->gravity, dt);
+static inline void traceJoint(world *w, traceRecordType type, jointID j, scalar x, scalar y, int enabled) {
+	if (w->trace) {
+		trace_joint_params t = { j, x, y, enabled };
+		traceWrite(w->trace, type, &t, sizeof(t));
+	}
+}
+//Only hinges, sliders and distance joints have a free axis to limit or drive
+static inline constraint_joint* freeAxisJoint(world *w, jointID j) {
+	switch (w->joints[j].j.type) {
+	case JOINT_HINGE:
+	case JOINT_SLIDER:
+	case JOINT_DISTANCE:
+		return &w->joints[j].constraint;
+	default:
+		return NULL;
+	}
+}
+void jointSetLimits(world *w, jointID j, scalar lower, scalar upper) {
+	constraint_joint *c = freeAxisJoint(w, j);
+	if (!c) {
+		return;
+	}
+	traceJoint(w, TRACE_JOINT_LIMITS, j, lower, upper, 1);
+	c->lower = lower;
+	c->upper = upper;
+	c->limit = 1;
+}
+void jointDisableLimits(world *w, jointID j) {
+	constraint_joint *c = freeAxisJoint(w, j);
+	if (!c) {
+		return;
+	}
+	traceJoint(w, TRACE_JOINT_LIMITS, j, 0, 0, 0);
+	c->limit = 0;
+}
+void jointSetMotor(world *w, jointID j, scalar speed, scalar maxForce) {
+	constraint_joint *c = freeAxisJoint(w, j);
+	if (!c) {
+		return;
+	}
+	traceJoint(w, TRACE_JOINT_MOTOR, j, speed, maxForce, 1);
+	c->speed    = speed;
+	c->maxForce = maxForce;
+	c->motor    = 1;
+}
+void jointDisableMotor(world *w, jointID j) {
+	constraint_joint *c = freeAxisJoint(w, j);
+	if (!c) {
+		return;
+	}
+	traceJoint(w, TRACE_JOINT_MOTOR, j, 0, 0, 0);
+	c->motor = 0;
+}
 
-	for (size_t i = 0; i < w->body_cap; i++) {
-		if (w->body_type[i] > BODY_STATIC) {
+void worldSetSolverIterations(world *w, int iterations) {
+	traceValue(w, TRACE_SOLVER_ITERATIONS, 0, (uint64_t)iterations);
+	w->solver_iterations = iterations;
+}
 
-			vec3Add(&w->body_vel[i], &w->body_vel[i], &w->body_accum[i].vel);
-			vec3Add(&w->body_avel[i], &w->body_avel[i], &w->body_accum[i].avel);
-			w->body_accum[i] = (accumulator){0};
+//Solve joints
+static inline void invInertiaMul(vec3 *dest, world *w, bodyID b, const vec3 *v) {
+	//World space inverse inertia
+	if (w->body_shape[b] == NULL) {
+		*dest = *v;
+		return;
+	}
+	quat reverse;
+	quatInverse(&reverse, &BODY_ROT(w, b));
+	vec3 local;
+	quatMulVec3(&local, &reverse, v);
+	mat3MulVec3(&local, &w->body_shape[b]->invInertiaTensor, &local);
+	quatMulVec3(dest, &BODY_ROT(w, b), &local);
+}
+static inline scalar invMass(world *w, bodyID b) {
+	if (w->body_type[b] != BODY_DYNAMIC) {
+		return 0;
+	} else if (w->body_shape[b] == NULL) {
+		return 1;
+	} else {
+		scalar m = w->body_shape[b]->mass;
+		return m == 0 ? 0 : 1.f / m;
+	}
+}
+//Returns NULL when the rows cannot grow, the row is left out of this step
+static inline constraint_row* pushRow(world *w, const joint *j, const vec3 *linear,
+	const vec3 *angularA, const vec3 *angularB, scalar bias, scalar lower, scalar upper) {
 
-			{ //Linear velocity
-				vec3 delta;
-				vec3MulScalar(&delta, &w->body_vel[i], dt);
-				vec3Add(&w->body_pos[i], &w->body_pos[i], &delta);
-			}
-			{ //Angular velocity
-					
-				{	//Angular dampening
-					//TODO: allow customizable dampening
-					vec3 dampen;
-					vec3MulScalar(&dampen, &w->body_avel[i], dt * 0.1f);
-					vec3Sub(&w->body_avel[i], &w->body_avel[i], &dampen);
-				}
+	solver *s = &w->solver;
+	if (s->row_size >= s->row_cap) {
+		size_t cap = s->row_cap ? s->row_cap * 2 : 64;
+		const viscoAllocator *a = scratchAllocator(w);
+		constraint_row *rows = viscoRealloc(a, s->rows, s->row_cap * sizeof(constraint_row), cap * sizeof(constraint_row));
+		if (!rows) {
+			return NULL;
+		}
+		s->rows = rows;
+		rows = viscoRealloc(a, s->rows_sorted, s->row_cap * sizeof(constraint_row), cap * sizeof(constraint_row));
+		if (!rows) {
+			return NULL;
+		}
+		s->rows_sorted = rows;
+		s->row_cap = cap;
+	}
 
-				quat adelta;
-				adelta.w = 0;
-				adelta.axis = w->body_avel[i];
-				quat hw;
-				quatMulScalar(&hw, &adelta, dt * 0.5f);
-				quat hwq;
-				quatMul(&hwq, &hw, &w->body_rot[i]);
-				quat end;
-				quatAdd(&end, &w->body_rot[i], &hwq);
-				quatNormalize(&w->body_rot[i], &end);
-			}
+	constraint_row *r = &s->rows[s->row_size++];
+	r->a = j->a;
+	r->b = j->b;
+	r->linear   = *linear;
+	r->angularA = *angularA;
+	r->angularB = *angularB;
+	r->invMassA = invMass(w, r->a);
+	r->invMassB = invMass(w, r->b);
 
-			if (w->body_type[i] == BODY_DYNAMIC) {
-				//Gravy
-				vec3Add(&w->body_vel[i], &w->body_vel[i], &gravDelta);
-			}
-		}
+	r->invAngularA = r->invAngularB = vec3Zero;
+	if (r->invMassA != 0) {
+		invInertiaMul(&r->invAngularA, w, r->a, angularA);
+	}
+	if (r->invMassB != 0) {
+		invInertiaMul(&r->invAngularB, w, r->b, angularB);
 	}
+
+	scalar k = (r->invMassA + r->invMassB) * vec3Dot(linear, linear) +
+		vec3Dot(angularA, &r->invAngularA) + vec3Dot(angularB, &r->invAngularB);
+
+	r->mass    = k > 0 ? 1.f / k : 0;
+	r->bias    = bias;
+	r->impulse = 0;
+	r->lower   = lower;
+	r->upper   = upper;
+	r->friction = 0;
+	r->normal   = 0;
+	r->pair     = NO_PAIR;
+	return r;
 }
-static inline void recalculateAABB(world *w) {
-	for (size_t i = 0; i < w->body_cap; i++) {
-		if (w->body_type[i] > BODY_STATIC && w->body_shape[i] != NULL) {
-			aabb newAABB;
-			shapeGenerateAabb(&newAABB, w->body_shape[i], &w->body_rot[i]);
-			aabbAddVec3(&w->body_aabb[i], &newAABB, &w->body_pos[i]);
-		}
+static inline void pushPointRows(world *w, const constraint_joint *j, const vec3 *rA, const vec3 *rB, const vec3 *d, scalar beta) {
+	static const vec3 axes[3] = {
+		{1, 0, 0},
+		{0, 1, 0},
+		{0, 0, 1}
+	};
+	for (int i = 0; i < 3; i++) {
+		vec3 angA, angB;
+		vec3Cross(&angA, rA, &axes[i]);
+		vec3Cross(&angB, rB, &axes[i]);
+		pushRow(w, &j->j, &axes[i], &angA, &angB, beta * d->data[i], -INFINITY, INFINITY);
 	}
 }
-static inline void naive_collision(world **ptr) { // O(n^2) broad phase, hella optimized
-	world* w = *ptr;
-	for (size_t i = 0; i < (w->body_cap - 1); i++) {
-		if ((w->body_type[i] > BODY_DELETE) && (w->body_shape[i] != NULL)) {
-
-			for (size_t j = i + 1; j < w->body_cap; j++) {
-				if ((w->body_type[j] > BODY_DELETE) && (w->body_shape[j] != NULL)) {
-
-					if (aabbCollideAabb(&w->body_aabb[i], &w->body_aabb[j])) {
-						//Possible collision, you could in theory thread this part
-
-						//Collision detection and creating manifold
-						contact_joint constraint;
-						contact contacts[4];
-						int numContacts;
-
-						if (numContacts = shapeCollide(contacts, 4,
-							w->body_shape[i], &w->body_pos[i], &w->body_rot[i],
-							w->body_shape[j], &w->body_pos[j], &w->body_rot[j])) {
-
-							constraint.j.type = JOINT_CONTACT;
-
-							if (numContacts < 0) {
-								numContacts = -numContacts;
-								constraint.j.a = j;
-								constraint.j.b = i;
-							} else {
-								constraint.j.a = i;
-								constraint.j.b = j;
-							}
-
-							for (int c = 0; c < numContacts; c++) {
-								//Collisions detected and contacts generated
-								constraint.contact = contacts[c];
-
-								//Add joint for resolution
-								pushJoint(ptr, (joint*)&constraint);
-								w = *ptr;
-							}
-						}
-					}
-				}
-			}
-		}
+static inline void pushAngularRow(world *w, const constraint_joint *j, const vec3 *axis, scalar bias, scalar lower, scalar upper) {
+	pushRow(w, &j->j, &vec3Zero, axis, axis, bias, lower, upper);
+}
+static inline void pushLockRows(world *w, const constraint_joint *j, scalar beta) {
+	//Keep the relative orientation from creation
+	quat target, reverse, err;
+	quatMul(&target, &BODY_ROT(w, j->j.a), &j->rel);
+	quatInverse(&reverse, &target);
+	quatMul(&err, &BODY_ROT(w, j->j.b), &reverse);
+	if (err.w < 0) {
+		vec3Negate(&err.axis, &err.axis);
+	}
+
+	static const vec3 axes[3] = {
+		{1, 0, 0},
+		{0, 1, 0},
+		{0, 0, 1}
+	};
+	for (int i = 0; i < 3; i++) {
+		pushAngularRow(w, j, &axes[i], beta * 2 * err.axis.data[i], -INFINITY, INFINITY);
 	}
 }
-static inline void solveConstraints(world *w) {
-	for (size_t i = 0; i < w->joint_cap; i++) {
-		switch (w->joints[i].j.type) {
-		case JOINT_DELETE:
-			break;
-		case JOINT_CONTACT:
-			solveContact(w, (contact_joint*)&w->joints[i]);
-			destroyJoint(w, i);
-			break;
+static inline void pushFreeRows(world *w, const constraint_joint *j, const vec3 *linear,
+	const vec3 *angularA, const vec3 *angularB, scalar position, scalar beta, scalar dt) {
+	//Limits and motor along the free axis of a joint
+	if (j->limit) {
+		if (position <= j->lower) {
+			pushRow(w, &j->j, linear, angularA, angularB, beta * (position - j->lower), 0, INFINITY);
+		} else if (position >= j->upper) {
+			pushRow(w, &j->j, linear, angularA, angularB, beta * (position - j->upper), -INFINITY, 0);
 		}
 	}
+	if (j->motor) {
+		scalar max = j->maxForce * dt;
+		pushRow(w, &j->j, linear, angularA, angularB, -j->speed, -max, max);
+	}
 }
+static inline void prepareJoint(world *w, const constraint_joint *j, scalar dt) {
+	bodyID a = j->j.a;
+	bodyID b = j->j.b;
+	if (w->body_type[a] == BODY_DELETE || w->body_type[b] == BODY_DELETE) {
+		return;
+	}
 
-void worldStep(world **w, scalar dt) {
-	integrateVelocity(*w, dt);
-	recalculateAABB(*w); //TODO: broadphase here
+	scalar beta = JOINT_BAUMGARTE / dt;
 
-	//collision detection
-	naive_collision(w);
+	vec3 rA, rB, d;
+	quatMulVec3(&rA, &BODY_ROT(w, a), &j->anchorA);
+	quatMulVec3(&rB, &BODY_ROT(w, b), &j->anchorB);
+	{
+		//Relative to the cell of a
+		vec3 pA, pB;
+		posInCell(&pB, w, b, &w->body_cell[a]);
+		vec3Add(&pA, &BODY_POS(w, a), &rA);
+		vec3Add(&pB, &pB, &rB);
+		vec3Sub(&d, &pB, &pA);
+	}
 
-	//constraints
-	solveConstraints(*w);
+	switch (j->j.type) {
+	case JOINT_BALL:
+		pushPointRows(w, j, &rA, &rB, &d, beta);
+		break;
+
+	case JOINT_FIXED:
+		pushPointRows(w, j, &rA, &rB, &d, beta);
+		pushLockRows(w, j, beta);
+		break;
+
+	case JOINT_HINGE: {
+		pushPointRows(w, j, &rA, &rB, &d, beta);
+
+		vec3 axisA, axisB, t1, t2, err;
+		quatMulVec3(&axisA, &BODY_ROT(w, a), &j->axisA);
+		quatMulVec3(&axisB, &BODY_ROT(w, b), &j->axisB);
+		perpendicular(&t1, &t2, &axisA);
+		vec3Cross(&err, &axisA, &axisB);
+		pushAngularRow(w, j, &t1, beta * vec3Dot(&t1, &err), -INFINITY, INFINITY);
+		pushAngularRow(w, j, &t2, beta * vec3Dot(&t2, &err), -INFINITY, INFINITY);
+
+		if (j->limit || j->motor) {
+			vec3 refA, refB, cross;
+			quatMulVec3(&refA, &BODY_ROT(w, a), &j->refA);
+			quatMulVec3(&refB, &BODY_ROT(w, b), &j->refB);
+			vec3Cross(&cross, &refA, &refB);
+			scalar angle = (scalar)atan2(vec3Dot(&cross, &axisA), vec3Dot(&refA, &refB));
+			pushFreeRows(w, j, &vec3Zero, &axisA, &axisA, angle, beta, dt);
+		}
+		break;
+	}
+
+	case JOINT_SLIDER: {
+		pushLockRows(w, j, beta);
+
+		//Lever arm of a reaches the anchor on b
+		vec3 armA, axis, t1, t2, angA, angB;
+		vec3Add(&armA, &rA, &d);
+		quatMulVec3(&axis, &BODY_ROT(w, a), &j->axisA);
+		perpendicular(&t1, &t2, &axis);
+
+		vec3Cross(&angA, &armA, &t1);
+		vec3Cross(&angB, &rB, &t1);
+		pushRow(w, &j->j, &t1, &angA, &angB, beta * vec3Dot(&d, &t1), -INFINITY, INFINITY);
+		vec3Cross(&angA, &armA, &t2);
+		vec3Cross(&angB, &rB, &t2);
+		pushRow(w, &j->j, &t2, &angA, &angB, beta * vec3Dot(&d, &t2), -INFINITY, INFINITY);
+
+		if (j->limit || j->motor) {
+			vec3Cross(&angA, &armA, &axis);
+			vec3Cross(&angB, &rB, &axis);
+			pushFreeRows(w, j, &axis, &angA, &angB, vec3Dot(&d, &axis), beta, dt);
+		}
+		break;
+	}
+
+	case JOINT_DISTANCE: {
+		scalar length = vec3Length(&d);
+		vec3 n, angA, angB;
+		if (length > 1e-6f) {
+			vec3DivScalar(&n, &d, length);
+		} else {
+			n = vec3YAxis;
+		}
+		vec3Cross(&angA, &rA, &n);
+		vec3Cross(&angB, &rB, &n);
+
+		if (j->limit) {
+			pushFreeRows(w, j, &n, &angA, &angB, length, beta, dt);
+		} else {
+			pushRow(w, &j->j, &n, &angA, &angB, beta * (length - j->length), -INFINITY, INFINITY);
+			if (j->motor) {
+				scalar max = j->maxForce * dt;
+				pushRow(w, &j->j, &n, &angA, &angB, -j->speed, -max, max);
+			}
+		}
+		break;
+	}
+
+	default:
+		break;
+	}
+}
+static inline void prepareContact(world *w, const contact_joint *c, scalar dt) {
+	bodyID a = c->j.a;
+	bodyID b = c->j.b;
+	const shape *sA = w->body_shape[a];
+	const shape *sB = w->body_shape[b];
+	const vec3 *n = &c->contact.normal;
+
+	vec3 rA, rB, angA, angB;
+	posInCell(&rA, w, a, &c->cell);
+	posInCell(&rB, w, b, &c->cell);
+	vec3Sub(&rA, &c->contact.position, &rA);
+	vec3Sub(&rB, &c->contact.position, &rB);
+
+	//Push out what is deeper than the slop, bounce when hitting fast enough
+	scalar bias = -CONTACT_BAUMGARTE / dt * mm_max(c->contact.distance - CONTACT_SLOP, 0);
+	vec3 velA, velB, rel;
+	velAtOffset(&velA, w, a, &rA);
+	velAtOffset(&velB, w, b, &rB);
+	vec3Sub(&rel, &velB, &velA);
+	scalar approach = vec3Dot(&rel, n);
+	if (approach < -CONTACT_BOUNCE_SPEED) {
+		bias = mm_min(bias, mm_max(sA->restitution, sB->restitution) * approach);
+	}
+
+	vec3Cross(&angA, &rA, n);
+	vec3Cross(&angB, &rB, n);
+	size_t normal = w->solver.row_size;
+	constraint_row *r = pushRow(w, &c->j, n, &angA, &angB, bias, 0, INFINITY);
+	if (!r) {
+		return;
+	}
+	r->pair = c->pair;
+	w->solver.contact_size++;
+
+	scalar friction = mm_sqrt(sA->friction * sB->friction);
+	if (friction > 0) {
+		vec3 t[2];
+		perpendicular(&t[0], &t[1], n);
+		for (int i = 0; i < 2; i++) {
+			vec3Cross(&angA, &rA, &t[i]);
+			vec3Cross(&angB, &rB, &t[i]);
+			r = pushRow(w, &c->j, &t[i], &angA, &angB, 0, 0, 0);
+			if (!r) {
+				return;
+			}
+			r->friction = friction;
+			r->normal   = normal;
+		}
+	}
+}
+static inline void rowBounds(const world *w, const constraint_row *r, scalar *lower, scalar *upper) {
+	if (r->friction > 0) {
+		*upper = r->friction * w->solver.rows[r->normal].impulse;
+		*lower = -*upper;
+	} else {
+		*lower = r->lower;
+		*upper = r->upper;
+	}
+}
+static inline void solveRow(world *w, constraint_row *r) {
+	accumulator *accA = &w->body_accum[r->a];
+	accumulator *accB = &w->body_accum[r->b];
+
+	//Velocity the bodies will be integrated with
+	vec3 vA, wA, vB, wB;
+	vec3Add(&vA, &BODY_VEL(w, r->a),  &accA->vel);
+	vec3Add(&wA, &BODY_AVEL(w, r->a), &accA->avel);
+	vec3Add(&vB, &BODY_VEL(w, r->b),  &accB->vel);
+	vec3Add(&wB, &BODY_AVEL(w, r->b), &accB->avel);
+
+	vec3 dv;
+	vec3Sub(&dv, &vB, &vA);
+	scalar jv = vec3Dot(&r->linear, &dv) + vec3Dot(&r->angularB, &wB) - vec3Dot(&r->angularA, &wA);
+
+	scalar lower, upper;
+	rowBounds(w, r, &lower, &upper);
+
+	scalar lambda = -r->mass * (jv + r->bias);
+	scalar old = r->impulse;
+	r->impulse = mm_min(mm_max(old + lambda, lower), upper);
+	lambda = r->impulse - old;
+
+	vec3 temp;
+	if (r->invMassA != 0) {
+		vec3MulScalar(&temp, &r->linear, r->invMassA * lambda);
+		vec3Sub(&accA->vel, &accA->vel, &temp);
+		vec3MulScalar(&temp, &r->invAngularA, lambda);
+		vec3Sub(&accA->avel, &accA->avel, &temp);
+	}
+	if (r->invMassB != 0) {
+		vec3MulScalar(&temp, &r->linear, r->invMassB * lambda);
+		vec3Add(&accB->vel, &accB->vel, &temp);
+		vec3MulScalar(&temp, &r->invAngularB, lambda);
+		vec3Add(&accB->avel, &accB->avel, &temp);
+	}
+}
+
+static inline void solveRowLanes(world *w, constraint_row *rows, size_t count) {
+	//Rows in a batch share no dynamic body, so all lanes are gathered before any is written
+	scalar lin[3][SOLVER_LANES], angA[3][SOLVER_LANES], angB[3][SOLVER_LANES];
+	scalar dv[3][SOLVER_LANES], wA[3][SOLVER_LANES], wB[3][SOLVER_LANES];
+	scalar jv[SOLVER_LANES], lambda[SOLVER_LANES];
+
+	for (size_t l = 0; l < SOLVER_LANES; l++) {
+		if (l < count) {
+			const constraint_row *r = &rows[l];
+			const accumulator *accA = &w->body_accum[r->a];
+			const accumulator *accB = &w->body_accum[r->b];
+			for (int i = 0; i < 3; i++) {
+				lin[i][l]  = r->linear.data[i];
+				angA[i][l] = r->angularA.data[i];
+				angB[i][l] = r->angularB.data[i];
+				dv[i][l]   = (BODY_VEL(w, r->b).data[i] + accB->vel.data[i]) -
+							 (BODY_VEL(w, r->a).data[i] + accA->vel.data[i]);
+				wA[i][l]   = BODY_AVEL(w, r->a).data[i] + accA->avel.data[i];
+				wB[i][l]   = BODY_AVEL(w, r->b).data[i] + accB->avel.data[i];
+			}
+		} else {
+			for (int i = 0; i < 3; i++) {
+				lin[i][l] = angA[i][l] = angB[i][l] = dv[i][l] = wA[i][l] = wB[i][l] = 0;
+			}
+		}
+	}
+
+	for (size_t l = 0; l < SOLVER_LANES; l++) {
+		jv[l] = lin[0][l] * dv[0][l] + lin[1][l] * dv[1][l] + lin[2][l] * dv[2][l] +
+				angB[0][l] * wB[0][l] + angB[1][l] * wB[1][l] + angB[2][l] * wB[2][l] -
+				angA[0][l] * wA[0][l] - angA[1][l] * wA[1][l] - angA[2][l] * wA[2][l];
+	}
+
+	for (size_t l = 0; l < count; l++) {
+		constraint_row *r = &rows[l];
+		scalar lower, upper;
+		rowBounds(w, r, &lower, &upper);
+		scalar old = r->impulse;
+		scalar impulse = old - r->mass * (jv[l] + r->bias);
+		r->impulse = mm_min(mm_max(impulse, lower), upper);
+		lambda[l] = r->impulse - old;
+	}
+
+	for (size_t l = 0; l < count; l++) {
+		constraint_row *r = &rows[l];
+		vec3 temp;
+		if (r->invMassA != 0) {
+			accumulator *accA = &w->body_accum[r->a];
+			vec3MulScalar(&temp, &r->linear, r->invMassA * lambda[l]);
+			vec3Sub(&accA->vel, &accA->vel, &temp);
+			vec3MulScalar(&temp, &r->invAngularA, lambda[l]);
+			vec3Sub(&accA->avel, &accA->avel, &temp);
+		}
+		if (r->invMassB != 0) {
+			accumulator *accB = &w->body_accum[r->b];
+			vec3MulScalar(&temp, &r->linear, r->invMassB * lambda[l]);
+			vec3Add(&accB->vel, &accB->vel, &temp);
+			vec3MulScalar(&temp, &r->invAngularB, lambda[l]);
+			vec3Add(&accB->avel, &accB->avel, &temp);
+		}
+	}
+}
+static inline unsigned firstColor(unsigned used) {
+	unsigned free = ~used & ((1u << (SOLVER_COLORS - 1)) - 1);
+	if (free == 0) {
+		return SOLVER_COLORS - 1;
+	}
+#if defined(__GNUC__)
+	return (unsigned)__builtin_ctz(free);
+#else
+	unsigned c = 0;
+	while (!(free & (1u << c))) {
+		c++;
+	}
+	return c;
+#endif
+}
+static void colorRows(world *w) {
+	//Greedy graph coloring followed by a counting sort on the color
+	solver *s = &w->solver;
+	const viscoAllocator *a = scratchAllocator(w);
+	if (s->body_colors_cap < w->body_cap) {
+		unsigned *body_colors = (unsigned*)viscoAlloc(a, w->body_cap * sizeof(unsigned));
+		if (body_colors) {
+			viscoFree(a, s->body_colors);
+			s->body_colors = body_colors;
+			memset(s->body_colors, 0, w->body_cap * sizeof(unsigned));
+			s->body_colors_cap = w->body_cap;
+		}
+	}
+	if (s->colors_cap < s->row_size) {
+		unsigned char *colors = viscoRealloc(a, s->colors, s->colors_cap, s->row_size);
+		if (colors) {
+			s->colors = colors;
+			size_t *order = viscoRealloc(a, s->order, s->colors_cap * sizeof(size_t), s->row_size * sizeof(size_t));
+			if (order) {
+				s->order = order;
+				s->colors_cap = s->row_size;
+			}
+		}
+	}
+	//Rows that cannot be ordered are left out of this step, friction rows come after their normal row
+	if (s->body_colors_cap < w->body_cap) {
+		s->row_size = 0;
+	}
+	if (s->row_size > s->colors_cap) {
+		s->row_size = s->colors_cap;
+	}
+
+	size_t counts[SOLVER_COLORS] = {0};
+
+	for (size_t i = 0; i < s->row_size; i++) {
+		bodyID a = s->rows[i].a;
+		bodyID b = s->rows[i].b;
+		int dynA = w->body_type[a] == BODY_DYNAMIC;
+		int dynB = w->body_type[b] == BODY_DYNAMIC;
+
+		unsigned used = (dynA ? s->body_colors[a] : 0) | (dynB ? s->body_colors[b] : 0);
+		unsigned c = firstColor(used);
+		if (dynA) s->body_colors[a] |= 1u << c;
+		if (dynB) s->body_colors[b] |= 1u << c;
+
+		s->colors[i] = (unsigned char)c;
+		counts[c]++;
+	}
+
+	s->row_batch[0] = 0;
+	for (int c = 0; c < SOLVER_COLORS; c++) {
+		s->row_batch[c + 1] = s->row_batch[c] + counts[c];
+		counts[c] = s->row_batch[c];
+	}
+
+	for (size_t i = 0; i < s->row_size; i++) {
+		s->order[i] = counts[s->colors[i]]++;
+		s->rows_sorted[s->order[i]] = s->rows[i];
+
+		//Reset the body masks for the next step
+		s->body_colors[s->rows[i].a] = 0;
+		s->body_colors[s->rows[i].b] = 0;
+	}
+	//Friction rows follow their normal row
+	for (size_t i = 0; i < s->row_size; i++) {
+		if (s->rows_sorted[i].friction > 0) {
+			s->rows_sorted[i].normal = s->order[s->rows_sorted[i].normal];
+		}
+	}
+
+	constraint_row *temp = s->rows;
+	s->rows = s->rows_sorted;
+	s->rows_sorted = temp;
+}
+
+//Simulation
+static inline void integrateVelocity(world *w, scalar dt) {
+	vec3 gravDelta;
+	vec3MulScalar(&gravDelta, &w->gravity, dt);
+
+	for (size_t i = 0; i < w->body_cap; i++) {
+		if (w->body_type[i] > BODY_STATIC) {
+
+			vec3Add(&BODY_VEL(w, i), &BODY_VEL(w, i), &w->body_accum[i].vel);
+			vec3Add(&BODY_AVEL(w, i), &BODY_AVEL(w, i), &w->body_accum[i].avel);
+			w->body_accum[i] = (accumulator){0};
+			quat rot = BODY_ROT(w, i);
+
+			{ //Linear velocity
+				vec3 delta;
+				vec3MulScalar(&delta, &BODY_VEL(w, i), dt);
+				vec3Add(&BODY_POS(w, i), &BODY_POS(w, i), &delta);
+				if (delta.x != 0 || delta.y != 0 || delta.z != 0) {
+					w->body_moved[i] |= BODY_MOVED_POSITION;
+				}
+			}
+			{ //Angular velocity
+					
+				{	//Angular dampening
+					//TODO: allow customizable dampening
+					vec3 dampen;
+					vec3MulScalar(&dampen, &BODY_AVEL(w, i), dt * 0.1f);
+					vec3Sub(&BODY_AVEL(w, i), &BODY_AVEL(w, i), &dampen);
+				}
+
+				quat adelta;
+				adelta.w = 0;
+				adelta.axis = BODY_AVEL(w, i);
+				quat hw;
+				quatMulScalar(&hw, &adelta, dt * 0.5f);
+				quat hwq;
+				quatMul(&hwq, &hw, &BODY_ROT(w, i));
+				quat end;
+				quatAdd(&end, &BODY_ROT(w, i), &hwq);
+				quatNormalize(&BODY_ROT(w, i), &end);
+				if (memcmp(&rot, &BODY_ROT(w, i), sizeof(quat)) != 0) {
+					w->body_moved[i] |= BODY_MOVED_ROTATION;
+				}
+			}
+
+			if (w->body_type[i] == BODY_DYNAMIC) {
+				//Gravy
+				vec3Add(&BODY_VEL(w, i), &BODY_VEL(w, i), &gravDelta);
+			}
+		}
+	}
+}
+static inline void recalculateAABB(world *w, scalar dt, void (*generate)(aabb*, const shape*, const quat*)) {
+	const scalar low = -w->region_size * REGION_REBASE_MARGIN;
+	const scalar high = w->region_size * (1 + REGION_REBASE_MARGIN);
+	for (size_t i = 0; i < w->body_cap; i++) {
+		if (w->body_type[i] <= BODY_STATIC) {
+			continue;
+		}
+
+		const vec3 *pos = &BODY_POS(w, i);
+		if (!(pos->x >= low && pos->x <= high && pos->y >= low && pos->y <= high && pos->z >= low && pos->z <= high)) {
+			const region_cell *c = &w->body_cell[i];
+			double origin[3] = { cellOrigin(w, c->x), cellOrigin(w, c->y), cellOrigin(w, c->z) };
+			rebaseBody(w, i, origin);
+		}
+
+		unsigned moved = w->body_moved[i];
+		if (w->body_shape[i] != NULL && moved) {
+			const shape *s = w->body_shape[i];
+			if ((moved & BODY_MOVED_ROTATION) && s->type != SHAPE_SPHERE) {
+				generate(&w->body_local[i], s, &BODY_ROT(w, i));
+			}
+			w->body_moved[i] = 0;
+
+			aabb *tight = &w->body_aabb[i];
+			aabbAddVec3(tight, &w->body_local[i], &BODY_POS(w, i));
+
+			aabb *fat = &w->body_fat[i];
+			if (aabbContainsAabb(fat, tight)) {
+				continue;
+			}
+
+			//Only grow towards where the body is heading
+			vec3 move;
+			vec3MulScalar(&move, &BODY_VEL(w, i), dt * AABB_PREDICTION);
+			for (int k = 0; k < 3; k++) {
+				fat->min.data[k] = tight->min.data[k] - AABB_MARGIN + mm_min(move.data[k], 0);
+				fat->max.data[k] = tight->max.data[k] + AABB_MARGIN + mm_max(move.data[k], 0);
+			}
+			w->broadphase_dirty = 1;
+		}
+	}
+}
+
+#pragma region Kernels
+
+//Lanes only work within a color, rows of the last one can share bodies
+static inline void solveRows(world *w, size_t first, size_t last, int lanes) {
+	constraint_row *rows = w->solver.rows;
+	if (!lanes) {
+		for (size_t i = first; i < last; i++) {
+			solveRow(w, &rows[i]);
+		}
+		return;
+	}
+	for (size_t i = first; i < last; i += SOLVER_LANES) {
+		solveRowLanes(w, &rows[i], last - i < SOLVER_LANES ? last - i : SOLVER_LANES);
+	}
+}
+
+typedef struct world_kernels {
+	void (*integrate)(world *w, scalar dt);
+	void (*aabb)(aabb *dest, const shape *s, const quat *rot);
+	int  (*collide)(contact *dest, int maxContacts, const shape *a, const vec3 *posa, const quat *rota,
+		const shape *b, const vec3 *posb, const quat *rotb, gjkCache *cache);
+	void (*rows)(world *w, size_t first, size_t last, int lanes);
+} world_kernels;
+
+#ifdef VISCO_DISPATCH_AVX2
+VISCO_KERNEL_AVX2 static void integrateVelocityAvx2(world *w, scalar dt) {
+	integrateVelocity(w, dt);
+}
+VISCO_KERNEL_AVX2 static void solveRowsAvx2(world *w, size_t first, size_t last, int lanes) {
+	solveRows(w, first, last, lanes);
+}
+#endif
+
+//Indexed by worldKernels
+static const world_kernels kernel_sets[WORLD_KERNELS_AVX2 + 1] = {
+	[VISCO_KERNELS_BASE] = { integrateVelocity, shapeGenerateAabb, shapeCollideCached, solveRows },
+#ifdef VISCO_DISPATCH_AVX2
+	[WORLD_KERNELS_AVX2] = { integrateVelocityAvx2, shapeGenerateAabbAvx2, shapeCollideCachedAvx2, solveRowsAvx2 },
+#endif
+};
+
+#pragma endregion Kernels
+
+//Returns NO_PAIR when the pairs cannot grow, the pair reports no events this step
+static inline size_t pushPair(world *w, bodyID a, bodyID b, bodyID lo, bodyID hi) {
+	if (w->pair_cur_size >= w->pair_cur_cap) {
+		size_t cap = w->pair_cur_cap ? w->pair_cur_cap * 2 : 16;
+		contact_pair *pairs = viscoRealloc(&w->allocator, w->pair_cur, w->pair_cur_cap * sizeof(contact_pair), cap * sizeof(contact_pair));
+		if (!pairs) {
+			return NO_PAIR;
+		}
+		w->pair_cur = pairs;
+		w->pair_cur_cap = cap;
+	}
+
+	contact_pair *p = &w->pair_cur[w->pair_cur_size];
+	p->a  = a;
+	p->b  = b;
+	p->lo = lo;
+	p->hi = hi;
+	p->position = p->normal = p->velocity = vec3Zero;
+	p->impulse  = 0;
+	p->sensor   = 0;
+
+	return w->pair_cur_size++;
+}
+static inline void findGjkCache(gjkCache *dest, const world *w, bodyID lo, bodyID hi) {
+	dest->count = 0;
+
+	size_t first = 0, last = w->gjk_prev_size;
+	while (first < last) {
+		size_t mid = (first + last) / 2;
+		const gjk_pair *p = &w->gjk_prev[mid];
+		if (p->lo < lo || (p->lo == lo && p->hi < hi)) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+	if (first < w->gjk_prev_size && w->gjk_prev[first].lo == lo && w->gjk_prev[first].hi == hi) {
+		*dest = w->gjk_prev[first].cache;
+	}
+}
+static inline void pushGjkCache(world *w, bodyID lo, bodyID hi, const gjkCache *cache) {
+	if (w->gjk_cur_size >= w->gjk_cur_cap) {
+		size_t cap = w->gjk_cur_cap ? w->gjk_cur_cap * 2 : 16;
+		gjk_pair *pairs = viscoRealloc(&w->allocator, w->gjk_cur, w->gjk_cur_cap * sizeof(gjk_pair), cap * sizeof(gjk_pair));
+		if (!pairs) {
+			return; //the next step starts this pair without a cache
+		}
+		w->gjk_cur = pairs;
+		w->gjk_cur_cap = cap;
+	}
+	w->gjk_cur[w->gjk_cur_size++] = (gjk_pair){ lo, hi, *cache };
+}
+static int compareGjkPairs(const void *a, const void *b) {
+	const gjk_pair *pa = (const gjk_pair*)a;
+	const gjk_pair *pb = (const gjk_pair*)b;
+	if (pa->lo != pb->lo) {
+		return pa->lo < pb->lo ? -1 : 1;
+	} else if (pa->hi != pb->hi) {
+		return pa->hi < pb->hi ? -1 : 1;
+	} else {
+		return 0;
+	}
+}
+static inline void swapGjkCaches(world *w) {
+	if (w->gjk_cur_size > 1) {
+		qsort(w->gjk_cur, w->gjk_cur_size, sizeof(gjk_pair), compareGjkPairs);
+	}
+
+	gjk_pair *pairs = w->gjk_prev;
+	size_t cap = w->gjk_prev_cap;
+	w->gjk_prev      = w->gjk_cur;
+	w->gjk_prev_size = w->gjk_cur_size;
+	w->gjk_prev_cap  = w->gjk_cur_cap;
+	w->gjk_cur       = pairs;
+	w->gjk_cur_size  = 0;
+	w->gjk_cur_cap   = cap;
+}
+static inline void collidePair(world **ptr, size_t i, size_t j) {
+	world* w = *ptr;
+
+	//Collision detection and creating manifold
+	contact_joint constraint;
+	contact contacts[VISCO_MAX_CONTACTS];
+	int numContacts;
+
+	gjkCache cache;
+	findGjkCache(&cache, w, i, j);
+
+	//Relative to the cell of a moving body, contacts stay precise next to a large static one
+	region_cell cell = w->body_cell[w->body_type[i] > BODY_STATIC ? i : j];
+	vec3 pos[2];
+	posInCell(&pos[0], w, i, &cell);
+	posInCell(&pos[1], w, j, &cell);
+
+	numContacts = kernel_sets[w->kernels].collide(contacts, VISCO_MAX_CONTACTS,
+		w->body_shape[i], &pos[0], &BODY_ROT(w, i),
+		w->body_shape[j], &pos[1], &BODY_ROT(w, j), &cache);
+
+	if (cache.count > 0) {
+		pushGjkCache(w, i, j, &cache);
+	}
+
+	if (numContacts) {
+
+		constraint.j.type = JOINT_CONTACT;
+		constraint.cell = cell;
+
+		const vec3 *posA, *posB;
+		if (numContacts < 0) {
+			numContacts = -numContacts;
+			constraint.j.a = j;
+			constraint.j.b = i;
+			posA = &pos[1];
+			posB = &pos[0];
+		} else {
+			constraint.j.a = i;
+			constraint.j.b = j;
+			posA = &pos[0];
+			posB = &pos[1];
+		}
+
+		constraint.pair = NO_PAIR;
+		if ((w->body_flags[i] | w->body_flags[j]) & BODY_FLAG_CONTACT_EVENTS) {
+			constraint.pair = pushPair(w, constraint.j.a, constraint.j.b, i, j);
+		}
+
+		for (int c = 0; c < numContacts; c++) {
+			//Collisions detected and contacts generated
+			constraint.contact = contacts[c];
+
+			if (constraint.pair != NO_PAIR) {
+				contact_pair *p = &w->pair_cur[constraint.pair];
+				vec3 rA, rB, velA, velB, rel;
+				vec3Sub(&rA, &contacts[c].position, posA);
+				vec3Sub(&rB, &contacts[c].position, posB);
+				velAtOffset(&velA, w, constraint.j.a, &rA);
+				velAtOffset(&velB, w, constraint.j.b, &rB);
+				vec3Sub(&rel, &velB, &velA);
+
+				vec3Add(&p->position, &p->position, &contacts[c].position);
+				vec3Add(&p->normal,   &p->normal,   &contacts[c].normal);
+				vec3Add(&p->velocity, &p->velocity, &rel);
+			}
+
+			//Add joint for resolution
+			pushJoint(ptr, (joint*)&constraint);
+			w = *ptr;
+		}
+
+		if (constraint.pair != NO_PAIR) {
+			contact_pair *p = &w->pair_cur[constraint.pair];
+			if (numContacts > 1) {
+				vec3DivScalar(&p->position, &p->position, (scalar)numContacts);
+				vec3DivScalar(&p->velocity, &p->velocity, (scalar)numContacts);
+				vec3Normalize(&p->normal, &p->normal);
+			}
+			//Events report positions relative to the world origin
+			p->position = (vec3){
+				(scalar)(cellOrigin(w, cell.x) + p->position.x),
+				(scalar)(cellOrigin(w, cell.y) + p->position.y),
+				(scalar)(cellOrigin(w, cell.z) + p->position.z)
+			};
+		}
+	}
+}
+static inline void overlapPair(world *w, size_t i, size_t j) {
+	//Sensors only overlap moving bodies that are not sensors themselves
+	size_t s, o;
+	if (w->body_flags[i] & BODY_FLAG_SENSOR) {
+		s = i;
+		o = j;
+	} else {
+		s = j;
+		o = i;
+	}
+	if ((w->body_flags[o] & BODY_FLAG_SENSOR) || w->body_type[o] <= BODY_STATIC) {
+		return;
+	}
+
+	vec3 pos;
+	posInCell(&pos, w, j, &w->body_cell[i]);
+	if (shapeOverlap(w->body_shape[i], &BODY_POS(w, i), &BODY_ROT(w, i),
+					 w->body_shape[j], &pos, &BODY_ROT(w, j))) {
+		size_t pair = pushPair(w, s, o, i, j);
+		if (pair == NO_PAIR) {
+			return;
+		}
+		contact_pair *p = &w->pair_cur[pair];
+		p->sensor = 1;
+		bodyGetPosition(&p->position, w, o);
+		p->velocity = BODY_VEL(w, o);
+	}
+}
+static inline void testPair(world **ptr, size_t i, size_t j) {
+	world *w = *ptr;
+	vec3 offset;
+	aabb box;
+	cellOffset(&offset, w, &w->body_cell[i], &w->body_cell[j]);
+	aabbAddVec3(&box, &w->body_aabb[j], &offset);
+	if (aabbCollideAabb(&w->body_aabb[i], &box)) {
+		w->stats.pairs++;
+		if ((w->body_flags[i] | w->body_flags[j]) & BODY_FLAG_SENSOR) {
+			overlapPair(w, i, j);
+		} else {
+			collidePair(ptr, i, j);
+		}
+	}
+}
+//Cell on one axis holding coordinate x, given relative to the origin of cell origin on that axis
+static inline int regionCell(const world *w, int origin, scalar x) {
+	return clampCell((double)origin + floor((double)x / w->region_size));
+}
+static inline size_t regionHash(int x, int y, int z, size_t count) {
+	return (size_t)(((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u) ^ ((unsigned)z * 83492791u)) & (count - 1);
+}
+//Returns 0 when the entry cannot be stored
+static inline int pushRegionEntry(const viscoAllocator *a, broadphase *bp, int x, int y, int z, int awake, bodyID b) {
+	if (bp->entry_size >= bp->entry_cap) {
+		size_t cap = bp->entry_cap ? bp->entry_cap * 2 : 64;
+		region_entry *entries = viscoRealloc(a, bp->entries, bp->entry_cap * sizeof(region_entry), cap * sizeof(region_entry));
+		if (!entries) {
+			return 0;
+		}
+		bp->entries = entries;
+		entries = viscoRealloc(a, bp->entries_sorted, bp->entry_cap * sizeof(region_entry), cap * sizeof(region_entry));
+		if (!entries) {
+			return 0;
+		}
+		bp->entries_sorted = entries;
+		bp->entry_cap = cap;
+	}
+	bp->entries[bp->entry_size++] = (region_entry){ x, y, z, awake, b };
+	return 1;
+}
+static inline int pushLarge(const viscoAllocator *a, broadphase *bp, bodyID b) {
+	if (bp->large_size >= bp->large_cap) {
+		size_t cap = bp->large_cap ? bp->large_cap * 2 : 16;
+		bodyID *large = viscoRealloc(a, bp->large, bp->large_cap * sizeof(bodyID), cap * sizeof(bodyID));
+		if (!large) {
+			return 0;
+		}
+		bp->large = large;
+		bp->large_cap = cap;
+	}
+	bp->large[bp->large_size++] = b;
+	return 1;
+}
+//Returns 0 when the allocator failed and some bodies were left out, they are retried on the next build
+static int buildRegions(world *w) {
+	broadphase *bp = &w->broadphase;
+	const viscoAllocator *a = &w->allocator;
+	bp->entry_size = 0;
+	bp->large_size = 0;
+	if (bp->first_cap < w->body_cap) {
+		region_cell *first = (region_cell*)viscoAlloc(a, w->body_cap * sizeof(region_cell));
+		if (first) {
+			viscoFree(a, bp->first);
+			bp->first = first;
+			bp->first_cap = w->body_cap;
+		}
+	}
+
+	int complete = bp->first_cap >= w->body_cap;
+	size_t bodies = complete ? w->body_cap : bp->first_cap;
+	for (size_t i = 0; i < bodies; i++) {
+		if (w->body_type[i] == BODY_DELETE || w->body_shape[i] == NULL) {
+			continue;
+		}
+
+		const aabb *box = &w->body_fat[i];
+		scalar span = w->region_size * REGION_MAX_SPAN;
+		if (!(box->max.x - box->min.x < span && box->max.y - box->min.y < span && box->max.z - box->min.z < span)) {
+			complete &= pushLarge(a, bp, i);
+			continue;
+		}
+
+		int awake = w->body_type[i] > BODY_STATIC;
+		const region_cell *c = &w->body_cell[i];
+		int x0 = regionCell(w, c->x, box->min.x), x1 = regionCell(w, c->x, box->max.x);
+		int y0 = regionCell(w, c->y, box->min.y), y1 = regionCell(w, c->y, box->max.y);
+		int z0 = regionCell(w, c->z, box->min.z), z1 = regionCell(w, c->z, box->max.z);
+		bp->first[i] = (region_cell){ x0, y0, z0 };
+		for (int x = x0; x <= x1; x++) {
+			for (int y = y0; y <= y1; y++) {
+				for (int z = z0; z <= z1; z++) {
+					complete &= pushRegionEntry(a, bp, x, y, z, awake, i);
+				}
+			}
+		}
+	}
+
+	//Counting sort of the entries by cell hash
+	size_t count = 16;
+	while (count < bp->entry_size * 2) {
+		count *= 2;
+	}
+	if (bp->bucket_cap < count + 1) {
+		size_t *buckets = (size_t*)viscoAlloc(a, (count + 1) * sizeof(size_t));
+		if (buckets) {
+			viscoFree(a, bp->buckets);
+			bp->buckets = buckets;
+			bp->bucket_cap = count + 1;
+		}
+	}
+	//Fewer buckets only make them longer
+	while (count + 1 > bp->bucket_cap && count > 1) {
+		count /= 2;
+	}
+	if (count + 1 > bp->bucket_cap) {
+		bp->entry_size = 0;
+		bp->bucket_count = 0;
+		return 0;
+	}
+	bp->bucket_count = count;
+	memset(bp->buckets, 0, (count + 1) * sizeof(size_t));
+
+	for (size_t i = 0; i < bp->entry_size; i++) {
+		const region_entry *e = &bp->entries[i];
+		bp->buckets[regionHash(e->x, e->y, e->z, count) + 1]++;
+	}
+	for (size_t i = 0; i < count; i++) {
+		bp->buckets[i + 1] += bp->buckets[i];
+	}
+	for (size_t i = 0; i < bp->entry_size; i++) {
+		const region_entry *e = &bp->entries[i];
+		size_t bucket = regionHash(e->x, e->y, e->z, count);
+		bp->entries_sorted[bp->buckets[bucket]++] = *e;
+	}
+	//Scatter moved every offset one bucket ahead, shift them back
+	memmove(&bp->buckets[1], &bp->buckets[0], count * sizeof(size_t));
+	bp->buckets[0] = 0;
+
+	region_entry *temp = bp->entries;
+	bp->entries = bp->entries_sorted;
+	bp->entries_sorted = temp;
+	return complete;
+}
+static void region_collision(world **ptr) {
+	world *w = *ptr;
+	if (w->broadphase_dirty) {
+		//Incomplete regions stay dirty, queries fall back to testing every body
+		w->broadphase_dirty = !buildRegions(w);
+	}
+
+	//The world may move while contacts are pushed, the broadphase arrays do not
+	const region_entry *entries = w->broadphase.entries;
+	const region_cell *cells = w->broadphase.first;
+	const size_t *buckets = w->broadphase.buckets;
+	const size_t bucket_count = w->broadphase.bucket_count;
+	const bodyID *large = w->broadphase.large;
+	const size_t large_size = w->broadphase.large_size;
+
+	for (size_t bucket = 0; bucket < bucket_count; bucket++) {
+		size_t first = buckets[bucket];
+		size_t last  = buckets[bucket + 1];
+
+		//Cells without awake bodies are skipped
+		int awake = 0;
+		for (size_t e = first; e < last && !awake; e++) {
+			awake = entries[e].awake;
+		}
+		if (!awake) {
+			continue;
+		}
+
+		for (size_t e = first; e < last; e++) {
+			for (size_t f = e + 1; f < last; f++) {
+				const region_entry *a = &entries[e];
+				const region_entry *b = &entries[f];
+				if ((!a->awake && !b->awake) || a->x != b->x || a->y != b->y || a->z != b->z) {
+					continue;
+				}
+
+				//Only test a pair in the lowest cell both were entered in
+				const region_cell *ca = &cells[a->body];
+				const region_cell *cb = &cells[b->body];
+				if (mm_max(ca->x, cb->x) != a->x || mm_max(ca->y, cb->y) != a->y || mm_max(ca->z, cb->z) != a->z) {
+					continue;
+				}
+
+				bodyID i = a->body, j = b->body;
+				if (i > j) {
+					bodyID t = i;
+					i = j;
+					j = t;
+				}
+				testPair(ptr, i, j);
+				w = *ptr;
+			}
+		}
+	}
+
+	//Large bodies against everything
+	for (size_t l = 0; l < large_size; l++) {
+		bodyID i = large[l];
+		for (size_t j = 0; j < w->body_cap; j++) {
+			if (j == i || w->body_type[j] == BODY_DELETE || w->body_shape[j] == NULL) {
+				continue;
+			}
+			if (w->body_type[i] <= BODY_STATIC && w->body_type[j] <= BODY_STATIC) {
+				continue;
+			}
+
+			//Pairs of large bodies are only tested once
+			int tested = 0;
+			for (size_t k = 0; k < l && !tested; k++) {
+				tested = large[k] == j;
+			}
+			if (tested) {
+				continue;
+			}
+
+			if (i < j) {
+				testPair(ptr, i, j);
+			} else {
+				testPair(ptr, j, i);
+			}
+			w = *ptr;
+		}
+	}
+}
+
+//Whether the tight bounds of body b overlap a box given relative to the world origin
+static inline int bodyInBox(const world *w, bodyID b, const aabb *box) {
+	aabb local;
+	pointInCell(&local.min, w, &w->body_cell[b], &box->min);
+	pointInCell(&local.max, w, &w->body_cell[b], &box->max);
+	return aabbCollideAabb(&w->body_aabb[b], &local);
+}
+static size_t queryRegions(const world *w, const aabb *box, bodyID *dest, size_t max) {
+	const broadphase *bp = &w->broadphase;
+	size_t count = 0;
+
+	int x0 = regionCell(w, 0, box->min.x), x1 = regionCell(w, 0, box->max.x);
+	int y0 = regionCell(w, 0, box->min.y), y1 = regionCell(w, 0, box->max.y);
+	int z0 = regionCell(w, 0, box->min.z), z1 = regionCell(w, 0, box->max.z);
+	for (int x = x0; x <= x1; x++) {
+		for (int y = y0; y <= y1; y++) {
+			for (int z = z0; z <= z1; z++) {
+				size_t bucket = regionHash(x, y, z, bp->bucket_count);
+				for (size_t e = bp->buckets[bucket]; e < bp->buckets[bucket + 1]; e++) {
+					const region_entry *r = &bp->entries[e];
+					if (r->x != x || r->y != y || r->z != z || !bodyInBox(w, r->body, box)) {
+						continue;
+					}
+
+					//Report a body once, from the lowest cell of the box it was entered in
+					const region_cell *c = &bp->first[r->body];
+					if (mm_max(c->x, x0) != x || mm_max(c->y, y0) != y || mm_max(c->z, z0) != z) {
+						continue;
+					}
+					if (count < max) {
+						dest[count] = r->body;
+					}
+					count++;
+				}
+			}
+		}
+	}
+	for (size_t l = 0; l < bp->large_size; l++) {
+		if (bodyInBox(w, bp->large[l], box)) {
+			if (count < max) {
+				dest[count] = bp->large[l];
+			}
+			count++;
+		}
+	}
+	return count;
+}
+size_t worldQueryAabb(world *w, const aabb *box, bodyID *dest, size_t max) {
+	//Small boxes look up the regions of the last step while they are still valid
+	scalar span = w->region_size * REGION_MAX_SPAN;
+	if (!w->broadphase_dirty && w->broadphase.bucket_count &&
+		box->max.x - box->min.x < span && box->max.y - box->min.y < span && box->max.z - box->min.z < span) {
+		return queryRegions(w, box, dest, max);
+	}
+
+	size_t count = 0;
+	for (size_t i = 0; i < w->body_cap; i++) {
+		if (w->body_type[i] == BODY_DELETE || w->body_shape[i] == NULL) {
+			continue;
+		}
+		if (bodyInBox(w, i, box)) {
+			if (count < max) {
+				dest[count] = i;
+			}
+			count++;
+		}
+	}
+	return count;
+}
+
+void worldSetRegionSize(world *w, scalar size) {
+	if (!(size > 0)) {
+		return;
+	}
+	traceScalar(w, TRACE_REGION_SIZE, size);
+	scalar old = w->region_size;
+	w->region_size = size;
+
+	//Cells are numbered by size, every body moves to the cell of the new grid it is in
+	for (size_t i = 0; i < w->body_cap; i++) {
+		if (w->body_type[i] != BODY_DELETE) {
+			const region_cell *c = &w->body_cell[i];
+			double origin[3] = { (double)c->x * old, (double)c->y * old, (double)c->z * old };
+			rebaseBody(w, i, origin);
+		}
+	}
+	w->broadphase_dirty = 1;
+}
+void worldShiftOrigin(world *w, const vec3 *shift) {
+	traceVec3(w, TRACE_SHIFT_ORIGIN, 0, shift);
+	for (size_t i = 0; i < w->body_cap; i++) {
+		if (w->body_type[i] != BODY_DELETE) {
+			const region_cell *c = &w->body_cell[i];
+			double origin[3] = {
+				cellOrigin(w, c->x) - shift->x,
+				cellOrigin(w, c->y) - shift->y,
+				cellOrigin(w, c->z) - shift->z
+			};
+			rebaseBody(w, i, origin);
+		}
+	}
+	w->origin[0] += shift->x;
+	w->origin[1] += shift->y;
+	w->origin[2] += shift->z;
+	w->broadphase_dirty = 1;
+}
+void worldGetOrigin(double *dest, world *w) {
+	dest[0] = w->origin[0];
+	dest[1] = w->origin[1];
+	dest[2] = w->origin[2];
+}
+//Even an inactive parallel region costs more than a small batch, and worlds
+//stepped by a group are already spread over the threads
+static inline int solverParallel(long count) {
+#ifdef _OPENMP
+	return count >= SOLVER_PARALLEL_MIN && !omp_in_parallel();
+#else
+	(void)count;
+	return 0;
+#endif
+}
+//Threads take whole chunks so the kernels are called once per chunk
+static void solveRowBatch(world *w, const world_kernels *k, size_t first, size_t last, int parallel) {
+	long chunks = (long)((last - first + SOLVER_CHUNK - 1) / SOLVER_CHUNK);
+
+	if (parallel && solverParallel((long)(last - first))) {
+		#pragma omp parallel for
+		for (long c = 0; c < chunks; c++) {
+			size_t i = first + (size_t)c * SOLVER_CHUNK;
+			k->rows(w, i, last - i < SOLVER_CHUNK ? last : i + SOLVER_CHUNK, 1);
+		}
+	} else {
+		k->rows(w, first, last, parallel);
+	}
+}
+static inline void solveConstraints(world *w, scalar dt) {
+	const world_kernels *k = &kernel_sets[w->kernels];
+	solver *s = &w->solver;
+	s->row_size = 0;
+	s->contact_size = 0;
+
+	for (size_t i = 0; i < w->joint_cap; i++) {
+		switch (w->joints[i].j.type) {
+		case JOINT_DELETE:
+			break;
+		case JOINT_CONTACT: {
+			//Contacts without a dynamic body move nothing, and the coloring would not keep their rows apart
+			const joint *c = &w->joints[i].j;
+			if (w->body_type[c->a] == BODY_DYNAMIC || w->body_type[c->b] == BODY_DYNAMIC) {
+				prepareContact(w, &w->joints[i].contact, dt);
+			}
+			destroyJoint(w, i);
+			break;
+		}
+		default:
+			prepareJoint(w, &w->joints[i].constraint, dt);
+			break;
+		}
+	}
+
+	//Contacts and joints are iterated together, effective masses are computed once and reused
+	colorRows(w);
+	for (int it = 0; it < w->solver_iterations; it++) {
+		for (int c = 0; c < SOLVER_COLORS; c++) {
+			solveRowBatch(w, k, s->row_batch[c], s->row_batch[c + 1], c < SOLVER_COLORS - 1);
+		}
+	}
+
+	for (size_t i = 0; i < s->row_size; i++) {
+		if (s->rows[i].pair != NO_PAIR) {
+			w->pair_cur[s->rows[i].pair].impulse += s->rows[i].impulse;
+		}
+	}
+}
+
+//Contact events
+static int comparePairs(const void *a, const void *b) {
+	const contact_pair *pa = (const contact_pair*)a;
+	const contact_pair *pb = (const contact_pair*)b;
+	if (pa->lo != pb->lo) {
+		return pa->lo < pb->lo ? -1 : 1;
+	} else if (pa->hi != pb->hi) {
+		return pa->hi < pb->hi ? -1 : 1;
+	} else if (pa->sensor != pb->sensor) {
+		return pa->sensor < pb->sensor ? -1 : 1;
+	} else {
+		return 0;
+	}
+}
+static inline void pushEvent(world *w, contactEventType type, const contact_pair *p) {
+	if (w->event_cap == 0) {
+		return;
+	}
+
+	size_t index = (w->event_head + w->event_size) % w->event_cap;
+	if (w->event_size == w->event_cap) {
+		//Full, drop the oldest event
+		w->event_head = (w->event_head + 1) % w->event_cap;
+	} else {
+		w->event_size++;
+	}
+
+	contactEvent *e = &w->event_ring[index];
+	e->type     = type;
+	e->a        = p->a;
+	e->b        = p->b;
+	e->position = p->position;
+	e->normal   = p->normal;
+	e->velocity = p->velocity;
+	e->impulse  = p->impulse;
+}
+static inline void emitContactEvents(world *w) {
+	if (w->pair_cur_size == 0 && w->pair_prev_size == 0) {
+		return;
+	}
+
+	if (w->pair_cur_size > 1) {
+		qsort(w->pair_cur, w->pair_cur_size, sizeof(contact_pair), comparePairs);
+	}
+
+	//Merge the sorted pair lists of the last and this step
+	size_t p = 0, c = 0;
+	while (p < w->pair_prev_size || c < w->pair_cur_size) {
+		int order;
+		if (p >= w->pair_prev_size) {
+			order = 1;
+		} else if (c >= w->pair_cur_size) {
+			order = -1;
+		} else {
+			order = comparePairs(&w->pair_prev[p], &w->pair_cur[c]);
+		}
+
+		if (order < 0) {
+			const contact_pair *pair = &w->pair_prev[p++];
+			pushEvent(w, pair->sensor ? SENSOR_END : CONTACT_END, pair);
+		} else if (order > 0) {
+			const contact_pair *pair = &w->pair_cur[c++];
+			pushEvent(w, pair->sensor ? SENSOR_BEGIN : CONTACT_BEGIN, pair);
+		} else {
+			const contact_pair *pair = &w->pair_cur[c++];
+			if (!pair->sensor) {
+				pushEvent(w, CONTACT_PERSIST, pair);
+			}
+			p++;
+		}
+	}
+
+	//Swap lists, this step becomes the last step
+	contact_pair *pairs = w->pair_prev;
+	size_t cap = w->pair_prev_cap;
+	w->pair_prev      = w->pair_cur;
+	w->pair_prev_size = w->pair_cur_size;
+	w->pair_prev_cap  = w->pair_cur_cap;
+	w->pair_cur       = pairs;
+	w->pair_cur_size  = 0;
+	w->pair_cur_cap   = cap;
+}
+
+int worldSetContactEventCapacity(world *w, size_t capacity) {
+	contactEvent *ring = NULL;
+	if (capacity) {
+		if (capacity > SIZE_MAX / sizeof(contactEvent)) {
+			return 0;
+		}
+		ring = (contactEvent*)viscoAlloc(&w->allocator, capacity * sizeof(contactEvent));
+		if (!ring) {
+			return 0;
+		}
+	}
+	traceValue(w, TRACE_EVENT_CAPACITY, 0, capacity);
+	size_t count = w->event_size < capacity ? w->event_size : capacity;
+
+	//Keep the newest events
+	for (size_t i = 0; i < count; i++) {
+		size_t index = (w->event_head + w->event_size - count + i) % w->event_cap;
+		ring[i] = w->event_ring[index];
+	}
+
+	viscoFree(&w->allocator, w->event_ring);
+	w->event_ring = ring;
+	w->event_cap  = capacity;
+	w->event_head = 0;
+	w->event_size = count;
+	return 1;
+}
+size_t worldPollContactEvents(world *w, contactEvent *dest, size_t max) {
+	size_t count = w->event_size < max ? w->event_size : max;
+	for (size_t i = 0; i < count; i++) {
+		dest[i] = w->event_ring[(w->event_head + i) % w->event_cap];
+	}
+	if (count) {
+		w->event_head = (w->event_head + count) % w->event_cap;
+		w->event_size -= count;
+	}
+	return count;
+}
+size_t worldDispatchContactEvents(world *w, const contactListener *l) {
+	size_t count = w->event_size;
+	for (size_t i = 0; i < count; i++) {
+		const contactEvent *e = &w->event_ring[(w->event_head + i) % w->event_cap];
+		switch (e->type) {
+		case CONTACT_BEGIN:
+			if (l->begin) l->begin(e, l->user);
+			break;
+		case CONTACT_PERSIST:
+			if (l->persist) l->persist(e, l->user);
+			break;
+		case CONTACT_END:
+			if (l->end) l->end(e, l->user);
+			break;
+		case SENSOR_BEGIN:
+			if (l->sensorBegin) l->sensorBegin(e, l->user);
+			break;
+		case SENSOR_END:
+			if (l->sensorEnd) l->sensorEnd(e, l->user);
+			break;
+		}
+	}
+	w->event_head = 0;
+	w->event_size = 0;
+	return count;
+}
+
+static inline double now(void) {
+#if defined(_OPENMP)
+	return omp_get_wtime();
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+void worldStep(world **w, scalar dt) {
+	traceScalar(*w, TRACE_STEP, dt);
+	const int profiling = (*w)->profiling;
+	double time[6] = {0};
+
+	if (profiling) time[0] = now();
+	(*w)->stats.pairs = 0;
+	const world_kernels *k = &kernel_sets[(*w)->kernels];
+	k->integrate(*w, dt);
+	if (profiling) time[1] = now();
+	recalculateAABB(*w, dt, k->aabb);
+	if (profiling) time[2] = now();
+
+	//collision detection
+	region_collision(w);
+	swapGjkCaches(*w);
+	if (profiling) time[3] = now();
+
+	//constraints
+	solveConstraints(*w, dt);
+	if (profiling) time[4] = now();
+
+	emitContactEvents(*w);
+	if (profiling) {
+		time[5] = now();
+		worldTimings *t = &(*w)->timings;
+		t->integrate = time[1] - time[0];
+		t->aabbs     = time[2] - time[1];
+		t->collision = time[3] - time[2];
+		t->solver    = time[4] - time[3];
+		t->events    = time[5] - time[4];
+		t->total     = time[5] - time[0];
+	}
+
+	worldStats *stats = &(*w)->stats;
+	stats->bodies   = (*w)->body_size;
+	stats->joints   = (*w)->joint_size;
+	stats->contacts = (*w)->solver.contact_size;
+	stats->rows     = (*w)->solver.row_size;
+	stats->events   = (*w)->event_size;
+}
+void worldGetStats(worldStats *dest, world *w) {
+	*dest = w->stats;
+}
+
+void worldSetProfiling(world *w, int enabled) {
+	w->profiling = enabled;
+	memset(&w->timings, 0, sizeof(worldTimings));
+}
+void worldGetTimings(worldTimings *dest, world *w) {
+	*dest = w->timings;
+}
+
+worldKernels worldGetKernels(world *w) {
+	return w->kernels;
+}
+int worldSetKernels(world *w, worldKernels kernels) {
+	if (!viscoKernelsSupported(kernels)) {
+		return 0;
+	}
+	w->kernels = kernels;
+	return 1;
+}
+
+#pragma region Trace
+
+static void traceSnapshot(world *w) {
+	trace_world tw = { w->gravity, { w->origin[0], w->origin[1], w->origin[2] }, w->region_size,
+		w->solver_iterations, w->event_cap };
+	traceWrite(w->trace, TRACE_WORLD, &tw, sizeof(tw));
+
+	//Every slot up to the highest one used, then the free slots in stack order
+	size_t bodies = w->body_size + w->body_empty_size;
+	for (size_t i = 0; i < bodies; i++) {
+		const region_cell *c = &w->body_cell[i];
+		trace_body_state b = {
+			i, (uint64_t)w->body_type[i], w->body_flags[i], traceShape(w->trace, w->body_shape[i]),
+			BODY_POS(w, i), BODY_VEL(w, i), BODY_AVEL(w, i), BODY_ROT(w, i),
+			w->body_accum[i], w->body_aabb[i], w->body_fat[i], w->body_local[i], { c->x, c->y, c->z }
+		};
+		traceWrite(w->trace, TRACE_BODY_STATE, &b, sizeof(b));
+	}
+	traceWrite(w->trace, TRACE_BODY_EMPTY, w->body_empty, w->body_empty_size * sizeof(size_t));
+
+	size_t joints = w->joint_size + w->joint_empty_size;
+	for (size_t i = 0; i < joints; i++) {
+		traceWrite(w->trace, TRACE_JOINT_STATE, &w->joints[i], sizeof(joint_max));
+	}
+	traceWrite(w->trace, TRACE_JOINT_EMPTY, w->joint_empty, w->joint_empty_size * sizeof(size_t));
+
+	//What the last step leaves for the next one
+	traceWrite(w->trace, TRACE_GJK_CACHES, w->gjk_prev, w->gjk_prev_size * sizeof(gjk_pair));
+	traceWrite(w->trace, TRACE_CONTACT_PAIRS, w->pair_prev, w->pair_prev_size * sizeof(contact_pair));
+}
+
+int worldTraceBegin(world *w, const char *path) {
+	worldTraceEnd(w);
+	w->trace = traceOpen(path);
+	if (!w->trace) {
+		return 0;
+	}
+	traceSnapshot(w);
+	return 1;
+}
+void worldTraceEnd(world *w) {
+	if (w->trace) {
+		traceClose(w->trace);
+		w->trace = NULL;
+	}
+}
+
+void worldTraceReplaceShape(world *w, const shape *old, shape *s) {
+	for (size_t i = 0; i < w->body_cap; i++) {
+		if (w->body_shape[i] == old) {
+			w->body_shape[i] = s;
+			refreshAabb(w, i);
+		}
+	}
+}
+
+//Copies a snapshot of a step buffer into an array the world owns
+static inline void* traceBuffer(world *w, void *old, const void *payload, size_t size) {
+	viscoFree(&w->allocator, old);
+	void *ret = size ? viscoAlloc(&w->allocator, size) : NULL;
+	if (ret) {
+		memcpy(ret, payload, size);
+	}
+	return ret;
+}
+
+static inline const shape* traceShapeAt(shape *const *shapes, size_t count, uint64_t id) {
+	return id < count ? shapes[id] : NULL;
+}
+
+int worldTraceApply(world **ptr, traceRecordType type, const void *payload, size_t size,
+	shape *const *shapes, size_t shape_count, scalar *delta) {
+	world *w = *ptr;
+
+	//Payloads are copied out, the size of each type is checked first
+	union {
+		trace_world world;
+		trace_value value;
+		trace_scalar scalar;
+		trace_vec3 vec;
+		trace_quat quat;
+		trace_force force;
+		trace_body_state body;
+		trace_joint_create create;
+		trace_joint_params joint;
+		joint_max raw;
+	} p;
+	size_t expected;
+	switch (type) {
+	case TRACE_WORLD:             expected = sizeof(trace_world); break;
+	case TRACE_STEP:
+	case TRACE_REGION_SIZE:       expected = sizeof(trace_scalar); break;
+	case TRACE_BODY_POSITION:
+	case TRACE_SHIFT_ORIGIN:      expected = sizeof(trace_vec3); break;
+	case TRACE_BODY_ORIENTATION:  expected = sizeof(trace_quat); break;
+	case TRACE_BODY_FORCE:        expected = sizeof(trace_force); break;
+	case TRACE_BODY_STATE:        expected = sizeof(trace_body_state); break;
+	case TRACE_JOINT_STATE:       expected = sizeof(joint_max); break;
+	case TRACE_JOINT_CREATE:      expected = sizeof(trace_joint_create); break;
+	case TRACE_JOINT_LIMITS:
+	case TRACE_JOINT_MOTOR:       expected = sizeof(trace_joint_params); break;
+	case TRACE_BODY_EMPTY:
+	case TRACE_JOINT_EMPTY:       expected = size - size % sizeof(size_t); break;
+	case TRACE_GJK_CACHES:        expected = size - size % sizeof(gjk_pair); break;
+	case TRACE_CONTACT_PAIRS:     expected = size - size % sizeof(contact_pair); break;
+	case TRACE_BODY_CREATE:
+	case TRACE_BODY_DESTROY:
+	case TRACE_BODY_TYPE:
+	case TRACE_BODY_FLAGS:
+	case TRACE_BODY_SHAPE:
+	case TRACE_JOINT_DESTROY:
+	case TRACE_SOLVER_ITERATIONS:
+	case TRACE_EVENT_CAPACITY:    expected = sizeof(trace_value); break;
+	default:
+		return 0;
+	}
+	if (size != expected) {
+		return -1;
+	}
+	if (size <= sizeof(p)) {
+		memcpy(&p, payload, size);
+	}
+
+	//Calls naming a body or joint must name one the world has, types must be ones the world knows
+	switch (type) {
+	case TRACE_BODY_DESTROY:
+	case TRACE_BODY_FLAGS:
+	case TRACE_BODY_SHAPE:
+		if (p.value.id >= w->body_cap) return -1;
+		break;
+	case TRACE_BODY_TYPE:
+		if (p.value.id >= w->body_cap || p.value.value > BODY_KINEMATIC) return -1;
+		break;
+	case TRACE_BODY_STATE:
+		if (p.body.type > BODY_KINEMATIC) return -1;
+		break;
+	case TRACE_BODY_POSITION:
+		if (p.vec.body >= w->body_cap) return -1;
+		break;
+	case TRACE_BODY_ORIENTATION:
+		if (p.quat.body >= w->body_cap) return -1;
+		break;
+	case TRACE_BODY_FORCE:
+		if (p.force.body >= w->body_cap) return -1;
+		break;
+	case TRACE_JOINT_DESTROY:
+		if (p.value.id >= w->joint_cap) return -1;
+		break;
+	case TRACE_JOINT_LIMITS:
+	case TRACE_JOINT_MOTOR:
+		if (p.joint.joint >= w->joint_cap) return -1;
+		break;
+	case TRACE_JOINT_CREATE:
+		if (p.create.type < JOINT_BALL || p.create.type > JOINT_DISTANCE) return -1;
+		if (p.create.a >= w->body_cap || p.create.b >= w->body_cap) return -1;
+		break;
+	case TRACE_JOINT_STATE: {
+		//Snapshots are taken between steps, when there are no contacts
+		unsigned t = (unsigned)p.raw.j.type;
+		if (t != JOINT_DELETE && (t < JOINT_BALL || t > JOINT_DISTANCE)) return -1;
+		if (t != JOINT_DELETE && (p.raw.j.a >= w->body_cap || p.raw.j.b >= w->body_cap)) return -1;
+		break;
+	}
+	default:
+		break;
+	}
+
+	switch (type) {
+	case TRACE_WORLD:
+		if (!(p.world.region_size > 0)) {
+			return -1;
+		}
+		w->gravity = p.world.gravity;
+		w->origin[0] = p.world.origin[0];
+		w->origin[1] = p.world.origin[1];
+		w->origin[2] = p.world.origin[2];
+		w->region_size = p.world.region_size;
+		w->solver_iterations = p.world.solver_iterations;
+		if (p.world.event_cap && !worldSetContactEventCapacity(w, (size_t)p.world.event_cap)) {
+			return -1;
+		}
+		return 0;
+
+	case TRACE_BODY_STATE: {
+		bodyID b = bodyCreate(ptr);
+		w = *ptr;
+		if (b != p.body.body) {
+			return -1;
+		}
+		w->body_type[b]  = (bodyType)p.body.type;
+		w->body_flags[b] = (unsigned)p.body.flags;
+		w->body_shape[b] = (shape*)traceShapeAt(shapes, shape_count, p.body.shape);
+		BODY_POS(w, b)   = p.body.pos;
+		BODY_VEL(w, b)   = p.body.vel;
+		BODY_AVEL(w, b)  = p.body.avel;
+		BODY_ROT(w, b)   = p.body.rot;
+		w->body_accum[b] = p.body.accum;
+		w->body_aabb[b]  = p.body.tight;
+		w->body_fat[b]   = p.body.fat;
+		w->body_local[b] = p.body.local;
+		w->body_cell[b]  = (region_cell){
+			clampCell(p.body.cell[0]), clampCell(p.body.cell[1]), clampCell(p.body.cell[2])
+		};
+		w->broadphase_dirty = 1;
+		return 0;
+	}
+	case TRACE_BODY_EMPTY: {
+		const unsigned char *ids = (const unsigned char*)payload;
+		for (size_t i = 0; i < size / sizeof(size_t); i++) {
+			size_t b;
+			memcpy(&b, &ids[i * sizeof(size_t)], sizeof(size_t));
+			if (b >= w->body_cap) {
+				return -1;
+			}
+			bodyDestroy(w, b);
+		}
+		return 0;
+	}
+	case TRACE_JOINT_STATE: {
+		joint_max j = { 0 };
+		jointID id = pushJoint(ptr, &j.j);
+		if (id == JOINT_INVALID) {
+			return -1;
+		}
+		w = *ptr;
+		w->joints[id] = p.raw;
+		return 0;
+	}
+	case TRACE_JOINT_EMPTY: {
+		const unsigned char *ids = (const unsigned char*)payload;
+		for (size_t i = 0; i < size / sizeof(size_t); i++) {
+			size_t j;
+			memcpy(&j, &ids[i * sizeof(size_t)], sizeof(size_t));
+			if (j >= w->joint_cap) {
+				return -1;
+			}
+			destroyJoint(w, j);
+		}
+		return 0;
+	}
+	case TRACE_GJK_CACHES:
+		w->gjk_prev = (gjk_pair*)traceBuffer(w, w->gjk_prev, payload, size);
+		w->gjk_prev_size = w->gjk_prev_cap = w->gjk_prev ? size / sizeof(gjk_pair) : 0;
+		return 0;
+	case TRACE_CONTACT_PAIRS:
+		w->pair_prev = (contact_pair*)traceBuffer(w, w->pair_prev, payload, size);
+		w->pair_prev_size = w->pair_prev_cap = w->pair_prev ? size / sizeof(contact_pair) : 0;
+		return 0;
+
+	case TRACE_STEP:
+		*delta = p.scalar.value;
+		return 1;
+	case TRACE_BODY_CREATE:
+		return bodyCreate(ptr) == p.value.id ? 0 : -1;
+	case TRACE_BODY_DESTROY:
+		bodyDestroy(w, p.value.id);
+		return 0;
+	case TRACE_BODY_TYPE:
+		bodySetType(w, p.value.id, (bodyType)p.value.value);
+		return 0;
+	case TRACE_BODY_FLAGS:
+		bodySetFlags(w, p.value.id, (unsigned)p.value.value);
+		return 0;
+	case TRACE_BODY_POSITION:
+		bodySetPosition(w, p.vec.body, &p.vec.v);
+		return 0;
+	case TRACE_BODY_ORIENTATION:
+		bodySetOrientation(w, p.quat.body, &p.quat.q);
+		return 0;
+	case TRACE_BODY_SHAPE:
+		bodySetShape(w, p.value.id, (shape*)traceShapeAt(shapes, shape_count, p.value.value));
+		return 0;
+	case TRACE_BODY_FORCE:
+		bodyApplyForce(w, p.force.body, &p.force.pos, &p.force.force);
+		return 0;
+	case TRACE_JOINT_CREATE: {
+		region_cell cell = { clampCell(p.create.cell[0]), clampCell(p.create.cell[1]), clampCell(p.create.cell[2]) };
+		return createJoint(ptr, (jointType)p.create.type, p.create.a, p.create.b, &cell, &p.create.anchorA,
+			&p.create.anchorB, p.create.has_axis ? &p.create.axis : NULL) == p.create.joint ? 0 : -1;
+	}
+	case TRACE_JOINT_DESTROY:
+		jointDestroy(w, p.value.id);
+		return 0;
+	case TRACE_JOINT_LIMITS:
+		if (p.joint.enabled) {
+			jointSetLimits(w, p.joint.joint, p.joint.x, p.joint.y);
+		} else {
+			jointDisableLimits(w, p.joint.joint);
+		}
+		return 0;
+	case TRACE_JOINT_MOTOR:
+		if (p.joint.enabled) {
+			jointSetMotor(w, p.joint.joint, p.joint.x, p.joint.y);
+		} else {
+			jointDisableMotor(w, p.joint.joint);
+		}
+		return 0;
+	case TRACE_SOLVER_ITERATIONS:
+		worldSetSolverIterations(w, (int)p.value.value);
+		return 0;
+	case TRACE_REGION_SIZE:
+		worldSetRegionSize(w, p.scalar.value);
+		return 0;
+	case TRACE_SHIFT_ORIGIN:
+		worldShiftOrigin(w, &p.vec.v);
+		return 0;
+	case TRACE_EVENT_CAPACITY:
+		return worldSetContactEventCapacity(w, (size_t)p.value.value) ? 0 : -1;
+	default:
+		return 0;
+	}
+}
+
+#pragma endregion Trace
+
+//World groups
+static inline size_t groupThreads(void) {
+#ifdef _OPENMP
+	return (size_t)omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+//The thread count can be raised between steps, returns 0 when the scratch could not grow
+static int growGroupScratch(worldGroup *g, size_t size) {
+	if (size <= g->scratch_size) {
+		return 1;
+	}
+	world_scratch *scratch = (world_scratch*)viscoRealloc(&g->allocator, g->scratch,
+		g->scratch_size * sizeof(world_scratch), size * sizeof(world_scratch));
+	if (!scratch) {
+		return 0;
+	}
+	memset(scratch + g->scratch_size, 0, (size - g->scratch_size) * sizeof(world_scratch));
+	g->scratch = scratch;
+	g->scratch_size = size;
+	return 1;
+}
+worldGroup* worldGroupCreate(const viscoAllocator *allocator) {
+	worldGroup *ret = (worldGroup*)viscoAlloc(allocator, sizeof(worldGroup));
+	if (!ret) {
+		return NULL;
+	}
+	memset(ret, 0, sizeof(worldGroup));
+	if (allocator) {
+		ret->allocator = *allocator;
+	}
+	if (!growGroupScratch(ret, groupThreads())) {
+		viscoFree(allocator, ret);
+		return NULL;
+	}
+	return ret;
+}
+void worldGroupDestroy(worldGroup *g) {
+	viscoAllocator a = g->allocator;
+	for (size_t i = 0; i < g->scratch_size; i++) {
+		freeSolver(&a, &g->scratch[i].solver);
+	}
+	viscoFree(&a, g->scratch);
+	viscoFree(&a, g->worlds);
+	viscoFree(&a, g);
+}
+size_t worldGroupAdd(worldGroup *g, world *w) {
+	if (g->world_size >= g->world_cap) {
+		size_t cap = g->world_cap ? g->world_cap * 2 : 16;
+		world **worlds = (world**)viscoRealloc(&g->allocator, g->worlds, g->world_cap * sizeof(world*), cap * sizeof(world*));
+		if (!worlds) {
+			return WORLD_GROUP_INVALID;
+		}
+		g->worlds = worlds;
+		g->world_cap = cap;
+	}
+	//The world borrows the solver of whichever thread steps it from now on
+	freeSolver(scratchAllocator(w), &w->solver);
+	g->worlds[g->world_size] = w;
+	return g->world_size++;
+}
+void worldGroupRemove(worldGroup *g, size_t index) {
+	g->worlds[index] = g->worlds[--g->world_size];
+}
+size_t worldGroupGetCount(worldGroup *g) {
+	return g->world_size;
+}
+world* worldGroupGetWorld(worldGroup *g, size_t index) {
+	return g->worlds[index];
+}
+void worldGroupStep(worldGroup *g, scalar dt, worldStats *stats) {
+	long count = (long)g->world_size;
+#ifdef _OPENMP
+	//Never more threads than scratch sets, even when growing failed
+	growGroupScratch(g, groupThreads());
+	int threads = (int)g->scratch_size;
+#endif
+
+	#pragma omp parallel for schedule(dynamic) num_threads(threads)
+	for (long i = 0; i < count; i++) {
+#ifdef _OPENMP
+		world_scratch *scratch = &g->scratch[omp_get_thread_num()];
+#else
+		world_scratch *scratch = &g->scratch[0];
+#endif
+		world *w = g->worlds[i];
+		w->solver = scratch->solver;
+		w->scratch_allocator = &g->allocator;
+
+		worldStep(&w, dt);
+
+		//Keep whatever grew during the step for the next world on this thread
+		scratch->solver = w->solver;
+		memset(&w->solver, 0, sizeof(solver));
+		w->scratch_allocator = NULL;
+		g->worlds[i] = w;
+		if (stats) {
+			stats[i] = w->stats;
+		}
+	}
 }
@@ -0,0 +1,86 @@
+//Steps a pile of bodies dropped onto a plane and reports the mean time of every phase.
+//make bench builds it once per body layout and runs both on the same scene.
+//usage: viscobench [bodies [steps]]
+#include <stdio.h>
+#include <stdlib.h>
+#include "viscosity.h"
+
+#ifdef VISCO_LAYOUT_SOA
+#define LAYOUT "soa"
+#else
+#define LAYOUT "aos"
+#endif
+
+#define ROW 20       //bodies per row and rows per layer
+#define SPACING 1.2f //between body centers, the largest shape is 1 wide
+
+int main(int argc, char **argv) {
+	size_t bodies = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : 4000;
+	size_t steps = argc > 2 ? (size_t)strtoull(argv[2], NULL, 10) : 600;
+	const scalar delta = 1.f / 60.f;
+
+	vec3 up = { 0, 1, 0 };
+	vec3 size = { 1, 1, 1 };
+	shape *shapes[4] = {
+		shapeCreatePlane(&up, 0, NULL),
+		shapeCreateSphere(0.5f, NULL),
+		shapeCreateBox(&size, NULL),
+		shapeCreateCapsule(0.3f, 0.4f, NULL)
+	};
+
+	world *w = worldCreate(NULL);
+	bodyID ground = bodyCreate(&w);
+	bodySetShape(w, ground, shapes[0]);
+	for (size_t i = 0; i < bodies; i++) {
+		//Every other layer is offset by half a spacing so the pile does not stay stacked in columns
+		size_t layer = i / (ROW * ROW);
+		scalar shift = layer & 1 ? SPACING * 0.5f : 0;
+		vec3 pos = {
+			(scalar)(i % ROW) * SPACING + shift,
+			1 + (scalar)layer * SPACING,
+			(scalar)(i / ROW % ROW) * SPACING + shift
+		};
+		bodyID b = bodyCreate(&w);
+		bodySetPosition(w, b, &pos);
+		bodySetType(w, b, BODY_DYNAMIC);
+		bodySetShape(w, b, shapes[1 + i % 3]);
+	}
+	worldSetProfiling(w, 1);
+
+	worldTimings sum = {0};
+	for (size_t step = 0; step < steps; step++) {
+		worldStep(&w, delta);
+
+		worldTimings t;
+		worldGetTimings(&t, w);
+		sum.integrate += t.integrate;
+		sum.aabbs     += t.aabbs;
+		sum.collision += t.collision;
+		sum.solver    += t.solver;
+		sum.events    += t.events;
+		sum.total     += t.total;
+	}
+
+	//Mean height of the bodies, the two layouts should end up with the same pile
+	double height = 0;
+	for (size_t i = 0; i < bodies; i++) {
+		vec3 pos;
+		bodyGetPosition(&pos, w, ground + 1 + i);
+		height += pos.y;
+	}
+	worldStats s;
+	worldGetStats(&s, w);
+
+	double n = steps ? (double)steps : 1;
+	printf("%s: %zu bodies, %zu steps, %zu contacts, mean height %.4f\n", LAYOUT, bodies, steps, s.contacts,
+		bodies ? height / (double)bodies : 0);
+	printf("%s: mean ms: integrate %.4f aabbs %.4f collision %.4f solver %.4f events %.4f total %.4f\n", LAYOUT,
+		sum.integrate * 1e3 / n, sum.aabbs * 1e3 / n, sum.collision * 1e3 / n, sum.solver * 1e3 / n,
+		sum.events * 1e3 / n, sum.total * 1e3 / n);
+
+	worldDestroy(w);
+	for (int i = 0; i < 4; i++) {
+		shapeDestroy(shapes[i]);
+	}
+	return 0;
+}
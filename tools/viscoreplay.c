@@ -0,0 +1,84 @@
+//Replays a trace recorded with worldTraceBegin and reports the time of every phase of every step.
+//usage: viscoreplay trace [first [count]]
+#include <stdio.h>
+#include <stdlib.h>
+#include "viscosity.h"
+
+#define SLOWEST 10
+
+typedef struct step_time {
+	size_t step;
+	double total;
+} step_time;
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s trace [first [count]]\n", argv[0]);
+		return 1;
+	}
+	size_t first = argc > 2 ? (size_t)strtoull(argv[2], NULL, 10) : 0;
+	size_t count = argc > 3 ? (size_t)strtoull(argv[3], NULL, 10) : (size_t)-1;
+
+	traceReplay *replay = traceReplayOpen(argv[1]);
+	if (!replay) {
+		fprintf(stderr, "%s: not a trace of this build\n", argv[1]);
+		return 1;
+	}
+
+	world *w = worldCreate(NULL);
+	worldSetProfiling(w, 1);
+
+	step_time slowest[SLOWEST] = {{0}};
+	worldTimings sum = {0};
+	size_t reported = 0;
+
+	printf("step,delta,bodies,pairs,contacts,integrate_ms,aabbs_ms,collision_ms,solver_ms,events_ms,total_ms\n");
+	scalar delta;
+	for (size_t step = 0; (step < first || step - first < count) && traceReplayNext(replay, &w, &delta); step++) {
+		worldStep(&w, delta);
+		if (step < first) {
+			continue;
+		}
+
+		worldTimings t;
+		worldStats s;
+		worldGetTimings(&t, w);
+		worldGetStats(&s, w);
+		printf("%zu,%g,%zu,%zu,%zu,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n", step, (double)delta, s.bodies, s.pairs, s.contacts,
+			t.integrate * 1e3, t.aabbs * 1e3, t.collision * 1e3, t.solver * 1e3, t.events * 1e3, t.total * 1e3);
+
+		sum.integrate += t.integrate;
+		sum.aabbs     += t.aabbs;
+		sum.collision += t.collision;
+		sum.solver    += t.solver;
+		sum.events    += t.events;
+		sum.total     += t.total;
+		reported++;
+
+		//Keep the slowest steps sorted
+		int i = SLOWEST - 1;
+		if (t.total > slowest[i].total) {
+			for (; i > 0 && t.total > slowest[i - 1].total; i--) {
+				slowest[i] = slowest[i - 1];
+			}
+			slowest[i].step = step;
+			slowest[i].total = t.total;
+		}
+	}
+
+	if (reported) {
+		double n = (double)reported;
+		fprintf(stderr, "%zu steps, mean ms: integrate %.4f aabbs %.4f collision %.4f solver %.4f events %.4f total %.4f\n",
+			reported, sum.integrate * 1e3 / n, sum.aabbs * 1e3 / n, sum.collision * 1e3 / n, sum.solver * 1e3 / n,
+			sum.events * 1e3 / n, sum.total * 1e3 / n);
+		fprintf(stderr, "slowest:");
+		for (int i = 0; i < SLOWEST && slowest[i].total > 0; i++) {
+			fprintf(stderr, " %zu (%.4f ms)", slowest[i].step, slowest[i].total * 1e3);
+		}
+		fprintf(stderr, "\n");
+	}
+
+	worldDestroy(w);
+	traceReplayClose(replay);
+	return 0;
+}